@@ -6,19 +6,34 @@
 
 LOG_MODULE_REGISTER(app);
 
-meter_parameters_t meters_parameters[] = {
-	{.type = meters_type_extern_dc, .address = 1, .current_factor = 1},
-	{.type = meters_type_extern_ac, .address = 3, .current_factor = 1},
-	{.type = meters_type_Mercury234, .address = 47, .baudrate = 9600, .current_factor = 1},
-	/*{.type = meters_type_SPM90,    .address = 1, .baudrate = 9600, .current_factor = 1},
-	{.type = meters_type_CE318,    .address = 80114997, .baudrate = 4800, .current_factor = 1},*/
+#if !CONFIG_STRIM_METERS2_DT_TOPOLOGY
+METERS_TYPE_DECLARE(mercury234);
+
+const meter_parameters_t meters_parameters[] = {
+	{.type = METERS_TYPE(extern_dc), .address = 1, .current_factor = 1},
+	{.type = METERS_TYPE(extern_ac), .address = 3, .current_factor = 1},
+	{.type = METERS_TYPE(mercury234), .address = 47, .baudrate = 9600, .current_factor = 1},
+	/*{.type = METERS_TYPE(spm90),    .address = 1, .baudrate = 9600, .current_factor = 1},
+	{.type = METERS_TYPE(ce318),    .address = 80114997, .baudrate = 4800, .current_factor = 1},*/
 };
+#endif
 
 int main(void){
 	LOG_INF("start sample");
+#if !CONFIG_STRIM_METERS2_DT_TOPOLOGY
 	meters_init(meters_parameters, ARRAY_SIZE(meters_parameters));
+#endif
 	while(1){
 		k_msleep(2000);
+#if CONFIG_STRIM_METERS2_BUS485_SIM
+		static meters_values_collection_t collection;
+		uint32_t valid = 0;
+
+		meters_get_all(&collection);
+		for(uint32_t i = 0; i < collection.count; i++)
+			valid += collection.items[i].is_valid ? 1 : 0;
+		LOG_INF("emulated meters valid %u of %u", valid, collection.count);
+#endif
 	}
 
     return 0;
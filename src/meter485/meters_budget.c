@@ -0,0 +1,73 @@
+#include "meters_budget.h"
+#include "meters_bus485.h"
+#include "meters_poll485.h"
+
+LOG_MODULE_DECLARE(meters2, CONFIG_STRIM_METERS2_LOG_LEVEL);
+
+enum{BUDGET_PERMILLE_FULL = 1000};
+
+uint32_t meters_budget_read_us(meters_type_t type, uint32_t baudrate)
+{
+    const meters_budget_t *budget = type->budget;
+
+    if((budget == NULL) || (baudrate == 0))
+        return 0;
+
+    uint64_t bytes = budget->request_bytes + budget->response_bytes;
+    uint64_t wire_us = DIV_ROUND_UP(bytes * METERS_BUS485_CHAR_BITS * USEC_PER_SEC, baudrate);
+    uint64_t pause_us = (uint64_t)budget->requests *
+                        (meters_bus485_silence_us(baudrate, budget->silence_x10) +
+                        (budget->turnaround_ms * USEC_PER_MSEC));
+
+    return (uint32_t)(wire_us + pause_us);
+}
+
+// Счетчик без периода опрашивается в каждом цикле, между циклами поток стоит паузу
+uint32_t meters_budget_period_ms(const meters_context_t *context, uint32_t item_idx)
+{
+    uint32_t period = context->parameters[item_idx].poll_period;
+
+    return (period != 0) ? period : METERS_POLL485_PAUSE_MS;
+}
+
+static uint32_t meters_budget_permille(uint32_t read_us, uint32_t period_ms)
+{
+    return (uint32_t)DIV_ROUND_UP((uint64_t)read_us * BUDGET_PERMILLE_FULL, 
+                                (uint64_t)period_ms * USEC_PER_MSEC);
+}
+
+void meters_budget_item_load(const meters_context_t *context, uint32_t item_idx, meters_budget_load_t *load)
+{
+    const meter_parameters_t *param = &context->parameters[item_idx];
+    uint32_t period = meters_budget_period_ms(context, item_idx);
+
+    load->predicted_permille = meters_budget_permille(meters_budget_read_us(param->type, param->baudrate), period);
+    load->measured_permille = meters_budget_permille(context->items[item_idx].read_us, period);
+}
+
+void meters_budget_total_load(const meters_context_t *context, meters_budget_load_t *load)
+{
+    meters_budget_load_t item;
+
+    load->predicted_permille = 0;
+    load->measured_permille = 0;
+
+    for(uint32_t i = 0; i < context->item_count; i++){
+        meters_budget_item_load(context, i, &item);
+        load->predicted_permille += item.predicted_permille;
+        load->measured_permille += item.measured_permille;
+    }
+}
+
+int32_t meters_budget_check(const meters_context_t *context)
+{
+    meters_budget_load_t load;
+
+    meters_budget_total_load(context, &load);
+    if(load.predicted_permille <= BUDGET_PERMILLE_FULL)
+        return 0;
+
+    LOG_WRN("bus485 over-subscribed: predicted load %u.%u%%, poll periods will stretch",
+            load.predicted_permille / 10, load.predicted_permille % 10);
+    return -EOVERFLOW;
+}
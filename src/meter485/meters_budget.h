@@ -0,0 +1,15 @@
+#pragma once
+
+#include "meters_private.h"
+
+// Загрузка линии в промилле от ее пропускной способности
+typedef struct{
+    uint32_t predicted_permille;
+    uint32_t measured_permille;
+}meters_budget_load_t;
+
+uint32_t meters_budget_read_us(meters_type_t type, uint32_t baudrate);
+uint32_t meters_budget_period_ms(const meters_context_t *context, uint32_t item_idx);
+void meters_budget_item_load(const meters_context_t *context, uint32_t item_idx, meters_budget_load_t *load);
+void meters_budget_total_load(const meters_context_t *context, meters_budget_load_t *load);
+int32_t meters_budget_check(const meters_context_t *context);
@@ -0,0 +1,312 @@
+#include "meters_bus485.h"
+#include "meters_trace.h"
+#if CONFIG_STRIM_METERS2_CAPTURE
+#include "meters_capture.h"
+#endif
+
+#if CONFIG_STRIM_METERS2_BUS485_SIM
+#include "meters_sim485.h"
+
+// линия и счетчики эмулируются, устройство bus485 не используется
+#define bus485_lock(dev)                        ((void)(dev), meters_sim485_lock())
+#define bus485_release(dev)                     ((void)(dev), meters_sim485_release())
+#define bus485_set_baudrate(dev, baudrate)      ((void)(dev), meters_sim485_set_baudrate(baudrate))
+#define bus485_flush(dev)                       ((void)(dev), meters_sim485_flush())
+#define bus485_send(dev, data, length)          ((void)(dev), meters_sim485_send(data, length))
+#define bus485_recv(dev, data, size, timeout)   ((void)(dev), meters_sim485_recv(data, size, timeout))
+#else
+#include "bus485.h"
+#endif
+
+LOG_MODULE_DECLARE(meters2, CONFIG_STRIM_METERS2_LOG_LEVEL);
+
+enum{BUS485_SILENCE_BAUDRATE_MAX = 19200}; // выше этой скорости интервал фиксированный
+
+uint32_t meters_bus485_silence_us(uint32_t baudrate, uint32_t chars_x10)
+{
+    if((baudrate == 0) || (chars_x10 == 0))
+        return 0;
+
+    // на высоких скоростях интервал не уменьшается, иначе его не выдержать
+    // по таймеру (для Modbus RTU это 1.75 мс)
+    baudrate = MIN(baudrate, BUS485_SILENCE_BAUDRATE_MAX);
+
+    uint64_t bits_x10 = (uint64_t)chars_x10 * METERS_BUS485_CHAR_BITS;
+    return (uint32_t)DIV_ROUND_UP(bits_x10 * USEC_PER_SEC, (uint64_t)baudrate * 10);
+}
+
+static void meters_bus485_wait_silence(meters_tools_context_t *tool, uint32_t silence_us)
+{
+    if(!tool->is_bus_idle_valid || (silence_us == 0))
+        return;
+
+    uint32_t elapsed_us = k_cyc_to_us_floor32(k_cycle_get_32() - tool->bus_idle_cycles);
+    if(elapsed_us >= silence_us)
+        return;
+
+    uint32_t remaining_us = silence_us - elapsed_us;
+    if(remaining_us >= (USEC_PER_SEC / CONFIG_SYS_CLOCK_TICKS_PER_SEC))
+        k_sleep(K_USEC(remaining_us));
+    else 
+        k_busy_wait(remaining_us); // меньше одного тика планировщика
+}
+
+int32_t meters_bus485_begin(meters_context_t *context, uint32_t baudrate, uint32_t silence_us)
+{
+    meters_tools_context_t *tool = context->tools;
+    int32_t ret;
+
+    METERS_TRACE("begin", baudrate, silence_us);
+
+    // после захвата: погибший в ожидании линии ее не держит, а лишнее освобождение
+    // пустило бы на линию второго владельца
+    bus485_lock(tool->bus485);
+    tool->is_bus_held = true;
+    METERS_TRACE("lock", 0, 0);
+
+    tool->frame_bytes = 0;
+    tool->baudrate = baudrate;
+#if CONFIG_STRIM_METERS2_BENCH
+    tool->bench_busy_cycles = k_cycle_get_32();
+#endif
+
+    ret = bus485_set_baudrate(tool->bus485, baudrate);
+    METERS_TRACE("baudrate", baudrate, ret);
+    if(ret < 0){
+        bus485_release(tool->bus485);
+        tool->is_bus_held = false;
+        METERS_TRACE("release", 0, 0);
+        return ret;
+    }
+
+#if CONFIG_STRIM_METERS2_BENCH
+    uint32_t pause_cycles = k_cycle_get_32();
+    meters_bus485_wait_silence(tool, silence_us);
+    tool->bench.pause_us += k_cyc_to_us_floor32(k_cycle_get_32() - pause_cycles);
+#else
+    meters_bus485_wait_silence(tool, silence_us);
+#endif
+    bus485_flush(tool->bus485);
+
+    return 0;
+}
+
+#if CONFIG_STRIM_METERS2_CAPTURE
+static void meters_bus485_capture(meters_context_t *context, meters_capture_direction_t direction,
+                                const uint8_t *data, size_t length)
+{
+    meters_tools_context_t *tool = context->tools;
+    uint32_t item = METERS_CAPTURE_ITEM_NONE;
+
+    if(tool->link_stats != NULL)
+        item = CONTAINER_OF(tool->link_stats, meters_item_t, link) - context->items;
+
+    meters_capture_frame(direction, item, tool->baudrate, data, length);
+}
+#endif
+
+int32_t meters_bus485_send(meters_context_t *context, const uint8_t *data, size_t length)
+{
+    meters_tools_context_t *tool = context->tools;
+
+#if CONFIG_STRIM_METERS2_BENCH
+    tool->bench.frames_tx++;
+    tool->bench.bytes_tx += length;
+#endif
+
+    int32_t ret = bus485_send(tool->bus485, data, length);
+    METERS_TRACE("sent", length, ret);
+#if CONFIG_STRIM_METERS2_CAPTURE
+    if(ret >= 0)
+        meters_bus485_capture(context, meters_capture_tx, data, length);
+#endif
+
+    // время ответа отсчитывается от конца передачи запроса
+    tool->link_send_cycles = k_cycle_get_32();
+    tool->link_recv_cycles = tool->link_send_cycles;
+
+    return ret;
+}
+
+int32_t meters_bus485_recv(meters_context_t *context, uint8_t *data, size_t size, uint32_t timeout_ms)
+{
+    meters_tools_context_t *tool = context->tools;
+#if CONFIG_STRIM_METERS2_BENCH
+    uint32_t start_cycles = k_cycle_get_32();
+#endif
+
+    int32_t ret = bus485_recv(tool->bus485, data, size, timeout_ms);
+
+    if(ret > 0){
+        tool->link_recv_cycles = k_cycle_get_32();
+        if(tool->frame_bytes == 0)
+            METERS_TRACE("first_byte", ret, 0);
+        tool->frame_bytes += ret;
+#if CONFIG_STRIM_METERS2_CAPTURE
+        meters_bus485_capture(context, meters_capture_rx, data, ret);
+#endif
+    }
+    else
+        METERS_TRACE("recv_error", tool->frame_bytes, ret);
+
+#if CONFIG_STRIM_METERS2_BENCH
+    if(ret > 0)
+        tool->bench.bytes_rx += ret;
+    else if(ret == -ETIMEDOUT)
+        tool->bench.timeout_us += k_cyc_to_us_floor32(k_cycle_get_32() - start_cycles);
+#endif
+
+    return ret;
+}
+
+void meters_bus485_end(meters_context_t *context)
+{
+    meters_tools_context_t *tool = context->tools;
+
+    // отсчет тишины ведется от последнего байта на линии
+    tool->bus_idle_cycles = k_cycle_get_32();
+    tool->is_bus_idle_valid = true;
+
+    if(tool->frame_bytes != 0)
+        METERS_TRACE("frame", tool->frame_bytes, 0);
+
+#if CONFIG_STRIM_METERS2_BENCH
+    // ответ, принятый по частям, считается одним кадром
+    if(tool->frame_bytes != 0)
+        tool->bench.frames_rx++;
+    tool->bench.busy_us += k_cyc_to_us_floor32(tool->bus_idle_cycles - tool->bench_busy_cycles);
+#endif
+
+    bus485_release(tool->bus485);
+    tool->is_bus_held = false;
+    METERS_TRACE("release", 0, 0);
+}
+
+int32_t meters_bus485_abandon(meters_context_t *context)
+{
+    meters_tools_context_t *tool = context->tools;
+
+    tool->bufs.busy = 0;
+    tool->is_bus_idle_valid = false;
+    tool->link_stats = NULL;
+
+    if(!tool->is_bus_held)
+        return 0;
+
+    int32_t ret = bus485_release(tool->bus485);
+    if(ret == 0)
+        tool->is_bus_held = false;
+
+    return ret;
+}
+
+static void meters_bus485_rtt(meters_link_stats_t *stats, uint32_t rtt_ms)
+{
+    uint32_t bucket = 0;
+
+    while((bucket < ARRAY_SIZE(meters_link_rtt_bounds_ms)) && (rtt_ms > meters_link_rtt_bounds_ms[bucket]))
+        bucket++;
+
+    stats->rtt_histogram[bucket]++;
+    stats->rtt_max_ms = MAX(stats->rtt_max_ms, rtt_ms);
+}
+
+void meters_bus485_result(meters_context_t *context, int32_t result)
+{
+    meters_tools_context_t *tool = context->tools;
+    meters_link_stats_t *stats = tool->link_stats;
+
+    METERS_TRACE("parsed", result, 0);
+
+    if(stats == NULL)
+        return; // обмен вне цикла опроса не учитывается
+
+    meters_data_lock(tool);
+    {
+        stats->requests++;
+
+        switch(result){
+            case 0:
+                break;
+            case -ETIMEDOUT:
+                stats->timeouts++;
+                break;
+            case -EBADMSG:
+                stats->crc_errors++;
+                break;
+            case -EXDEV:
+            case -EADDRNOTAVAIL:
+                stats->address_mismatches++;
+                break;
+            default:
+                stats->protocol_errors++;
+                break;
+        }
+
+        if(result == 0){
+            stats->successes++;
+            stats->last_success_timemark = k_uptime_get_32();
+        }
+        else {
+            stats->last_error = result;
+            stats->last_failure_timemark = k_uptime_get_32();
+        }
+
+        // исключение или ошибка счетчика - тоже ответ, время его прихода известно
+        if(tool->link_recv_cycles != tool->link_send_cycles)
+            meters_bus485_rtt(stats, k_cyc_to_ms_floor32(tool->link_recv_cycles - tool->link_send_cycles));
+    }
+    meters_data_unlock(tool);
+}
+
+uint8_t *meters_bus485_buf_get(meters_context_t *context, size_t size)
+{
+    meters_bus485_bufs_t *bufs = &context->tools->bufs;
+    uint8_t *buf = NULL;
+    uint32_t i;
+
+    // подходящий малый буфер, затем большой
+    if(size <= METERS_BUS485_BUF_SMALL_SIZE){
+        for(i = 0; i < METERS_BUS485_BUF_SMALL_COUNT; i++){
+            if(!(bufs->busy & BIT(METERS_BUS485_BUF_LARGE_COUNT + i))){
+                bufs->busy |= BIT(METERS_BUS485_BUF_LARGE_COUNT + i);
+                buf = bufs->small[i];
+                break;
+            }
+        }
+    }
+
+    if((buf == NULL) && (size <= METERS_BUS485_BUF_LARGE_SIZE)){
+        for(i = 0; i < METERS_BUS485_BUF_LARGE_COUNT; i++){
+            if(!(bufs->busy & BIT(i))){
+                bufs->busy |= BIT(i);
+                buf = bufs->large[i];
+                break;
+            }
+        }
+    }
+
+    if(buf == NULL){
+        bufs->failures++;
+        LOG_ERR("no frame buffer for %zu bytes", size);
+        return NULL;
+    }
+
+    bufs->busy_peak = MAX(bufs->busy_peak, (uint32_t)POPCOUNT(bufs->busy));
+    return buf;
+}
+
+void meters_bus485_buf_put(meters_context_t *context, uint8_t *buf)
+{
+    meters_bus485_bufs_t *bufs = &context->tools->bufs;
+
+    for(uint32_t i = 0; i < METERS_BUS485_BUF_LARGE_COUNT; i++){
+        if(buf == bufs->large[i])
+            bufs->busy &= ~BIT(i);
+    }
+
+    for(uint32_t i = 0; i < METERS_BUS485_BUF_SMALL_COUNT; i++){
+        if(buf == bufs->small[i])
+            bufs->busy &= ~BIT(METERS_BUS485_BUF_LARGE_COUNT + i);
+    }
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include "meters_private.h"
+
+enum{METERS_BUS485_CHAR_BITS = 11}; // старт, 8 бит данных, четность, стоп
+
+// Интервал тишины на линии в десятых долях символа
+enum{METERS_BUS485_SILENCE_NONE = 0};
+enum{METERS_BUS485_SILENCE_MODBUS = 35}; // 3.5 символа по спецификации Modbus RTU
+
+uint32_t meters_bus485_silence_us(uint32_t baudrate, uint32_t chars_x10);
+
+int32_t meters_bus485_begin(meters_context_t *context, uint32_t baudrate, uint32_t silence_us);
+int32_t meters_bus485_send(meters_context_t *context, const uint8_t *data, size_t length);
+int32_t meters_bus485_recv(meters_context_t *context, uint8_t *data, size_t size, uint32_t timeout_ms);
+void meters_bus485_end(meters_context_t *context);
+/**
+ * Поток опроса погиб: линия, если он ее держал, и буферы кадров
+ * освобождаются за него. Ошибка - драйвер bus485 не отпустил линию
+ * чужому потоку, она по-прежнему считается захваченной и вызов можно повторить.
+ */
+int32_t meters_bus485_abandon(meters_context_t *context);
+
+// Итог запроса для статистики опрашиваемого счетчика
+void meters_bus485_result(meters_context_t *context, int32_t result);
+
+// Буфер не меньше size из пула линии, NULL - свободных нет
+uint8_t *meters_bus485_buf_get(meters_context_t *context, size_t size);
+void meters_bus485_buf_put(meters_context_t *context, uint8_t *buf);
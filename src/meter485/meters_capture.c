@@ -0,0 +1,196 @@
+#include "meters_capture.h"
+#include <zephyr/sys/byteorder.h>
+#include <string.h>
+
+LOG_MODULE_DECLARE(meters2, CONFIG_STRIM_METERS2_LOG_LEVEL);
+
+enum{CAPTURE_SIZE = CONFIG_STRIM_METERS2_CAPTURE_SIZE};
+
+typedef struct{
+    uint8_t buffer[CAPTURE_SIZE];
+    uint32_t tail;      // начало самой старой записи
+    uint32_t used;
+    uint32_t dropped;   // вытеснено записей
+    bool is_enabled;
+}capture_context_t;
+
+static METERS_APP_DMEM capture_context_t capture = {.is_enabled = true};
+K_MUTEX_DEFINE(meters_capture_mutex);
+
+static void capture_copy_out(uint32_t offset, uint8_t *data, size_t length)
+{
+    uint32_t position = (capture.tail + offset) % CAPTURE_SIZE;
+    size_t first = MIN(length, CAPTURE_SIZE - position);
+
+    memcpy(data, &capture.buffer[position], first);
+    memcpy(&data[first], capture.buffer, length - first);
+}
+
+static void capture_copy_in(const uint8_t *data, size_t length)
+{
+    uint32_t position = (capture.tail + capture.used) % CAPTURE_SIZE;
+    size_t first = MIN(length, CAPTURE_SIZE - position);
+
+    memcpy(&capture.buffer[position], data, first);
+    memcpy(capture.buffer, &data[first], length - first);
+    capture.used += length;
+}
+
+static void capture_drop_oldest(void)
+{
+    meters_capture_record_t record;
+
+    capture_copy_out(0, (uint8_t *)&record, sizeof(record));
+
+    uint32_t size = sizeof(record) + sys_le16_to_cpu(record.length);
+    if(size > capture.used){
+        capture.tail = 0;   // загруженный дамп оборван, начинаем заново
+        capture.used = 0;
+    }
+    else {
+        capture.tail = (capture.tail + size) % CAPTURE_SIZE;
+        capture.used -= size;
+    }
+    capture.dropped++;
+}
+
+void meters_capture_frame(meters_capture_direction_t direction, uint32_t item, uint32_t baudrate,
+                          const uint8_t *data, size_t length)
+{
+    if(!capture.is_enabled || (length == 0))
+        return;
+
+    length = MIN(length, UINT16_MAX);
+
+    meters_capture_record_t record = {
+        .timestamp_us = sys_cpu_to_le32((uint32_t)k_ticks_to_us_floor64(k_uptime_ticks())),
+        .baudrate = sys_cpu_to_le32(baudrate),
+        .direction = direction,
+        .item = MIN(item, METERS_CAPTURE_ITEM_NONE),
+        .length = sys_cpu_to_le16(length),
+    };
+
+    k_mutex_lock(&meters_capture_mutex, K_FOREVER);
+    {
+        if((sizeof(record) + length) > CAPTURE_SIZE){
+            capture.dropped++;
+        }
+        else {
+            while((capture.used + sizeof(record) + length) > CAPTURE_SIZE)
+                capture_drop_oldest();
+
+            capture_copy_in((const uint8_t *)&record, sizeof(record));
+            capture_copy_in(data, length);
+        }
+    }
+    k_mutex_unlock(&meters_capture_mutex);
+}
+
+void meters_capture_set_enabled(bool is_enabled)
+{
+    capture.is_enabled = is_enabled;
+}
+
+bool meters_capture_is_enabled(void)
+{
+    return capture.is_enabled;
+}
+
+void meters_capture_clear(void)
+{
+    k_mutex_lock(&meters_capture_mutex, K_FOREVER);
+    {
+        capture.tail = 0;
+        capture.used = 0;
+        capture.dropped = 0;
+    }
+    k_mutex_unlock(&meters_capture_mutex);
+}
+
+uint32_t meters_capture_get_size(void)
+{
+    return capture.used;
+}
+
+uint32_t meters_capture_get_dropped(void)
+{
+    return capture.dropped;
+}
+
+int32_t meters_capture_read(uint32_t offset, uint8_t *data, size_t size)
+{
+    int32_t ret = 0;
+
+    k_mutex_lock(&meters_capture_mutex, K_FOREVER);
+    {
+        if(offset < capture.used){
+            ret = MIN(size, capture.used - offset);
+            capture_copy_out(offset, data, ret);
+        }
+    }
+    k_mutex_unlock(&meters_capture_mutex);
+
+    return ret;
+}
+
+// Дамп дописывается в конец как есть, записи проверяются при чтении
+int32_t meters_capture_load(const uint8_t *data, size_t length)
+{
+    int32_t ret = 0;
+
+    if(capture.is_enabled)
+        return -EBUSY;  // загруженные кадры перемешались бы с живыми
+
+    k_mutex_lock(&meters_capture_mutex, K_FOREVER);
+    {
+        if((capture.used + length) > CAPTURE_SIZE)
+            ret = -ENOMEM;
+        else
+            capture_copy_in(data, length);
+    }
+    k_mutex_unlock(&meters_capture_mutex);
+
+    return ret;
+}
+
+int32_t meters_capture_get(uint32_t *offset, meters_capture_record_t *record, uint8_t *data, size_t size)
+{
+    int32_t ret;
+
+    k_mutex_lock(&meters_capture_mutex, K_FOREVER);
+    {
+        if((*offset + sizeof(*record)) > capture.used){
+            ret = -ENODATA;
+        }
+        else {
+            capture_copy_out(*offset, (uint8_t *)record, sizeof(*record));
+            record->timestamp_us = sys_le32_to_cpu(record->timestamp_us);
+            record->baudrate = sys_le32_to_cpu(record->baudrate);
+            record->length = sys_le16_to_cpu(record->length);
+
+            if((*offset + sizeof(*record) + record->length) > capture.used){
+                ret = -EBADMSG;
+            }
+            else {
+                ret = MIN(size, record->length);
+                capture_copy_out(*offset + sizeof(*record), data, ret);
+                *offset += sizeof(*record) + record->length;
+
+                if(ret < record->length)
+                    ret = -EMSGSIZE;
+            }
+        }
+    }
+    k_mutex_unlock(&meters_capture_mutex);
+
+    return ret;
+}
+
+void meters_capture_grant(k_tid_t thread)
+{
+#if CONFIG_USERSPACE
+    k_object_access_grant(&meters_capture_mutex, thread);
+#else
+    ARG_UNUSED(thread);
+#endif
+}
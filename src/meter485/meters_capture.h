@@ -0,0 +1,42 @@
+#pragma once
+
+#include "meters_private.h"
+
+typedef enum{
+    meters_capture_tx = 0,
+    meters_capture_rx = 1,
+}meters_capture_direction_t;
+
+enum{METERS_CAPTURE_ITEM_NONE = 0xFF}; // обмен вне цикла опроса (shell, поиск)
+
+// Заголовок записи, за ним length байт кадра. Порядок байт little-endian,
+// дамп кольца - последовательность таких записей
+typedef struct __packed{
+    uint32_t timestamp_us;  // время окончания передачи или приема, младшие 32 бита
+    uint32_t baudrate;
+    uint8_t direction;
+    uint8_t item;           // индекс счетчика в цикле опроса
+    uint16_t length;
+}meters_capture_record_t;
+
+/**
+ * Кольцо в RAM с кадрами, прошедшими по линии. Принятые части ответа
+ * записываются так, как их вернул bus485. При нехватке места вытесняются
+ * самые старые записи.
+ */
+void meters_capture_frame(meters_capture_direction_t direction, uint32_t item, uint32_t baudrate,
+                          const uint8_t *data, size_t length);
+void meters_capture_set_enabled(bool is_enabled);
+bool meters_capture_is_enabled(void);
+void meters_capture_clear(void);
+uint32_t meters_capture_get_size(void);
+uint32_t meters_capture_get_dropped(void);
+
+// Сырые байты кольца для дампа и загрузка дампа обратно
+int32_t meters_capture_read(uint32_t offset, uint8_t *data, size_t size);
+int32_t meters_capture_load(const uint8_t *data, size_t length);
+
+// Запись по смещению offset, смещение переводится на следующую запись
+int32_t meters_capture_get(uint32_t *offset, meters_capture_record_t *record, uint8_t *data, size_t size);
+
+void meters_capture_grant(k_tid_t thread);
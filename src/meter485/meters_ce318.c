@@ -1,15 +1,18 @@
 #include "meters_ce318.h"
-#include "bus485.h"
+#include "meters_bus485.h"
+#include "meters_codec.h"
 #include <zephyr/sys/util_macro.h>
+#include <stdio.h>
 
 LOG_MODULE_DECLARE(meters2, CONFIG_STRIM_METERS2_LOG_LEVEL);
 
+typedef struct {
+    meters_values_ac_t shadow;
+}meters_data_ce318_t;
+
 enum{CE318_ERROR_THRESHOLD = 3};
-#define DFF_FLAG (0x80)
-#define DFF_FIELD_MAX_SIZE (sizeof(int64_t) + 1)
 
-#define SMP_END (0xC0)
-#define SMP_PROTOCOL_ID (6)
+#define SMP_END (METERS_CODEC_SMP_END)
 
 #define SMP_COMMAND_DATA (6)
 #define SMP_COMMAND_ERROR (7)
@@ -84,6 +87,8 @@ typedef enum
 
 
 #define SMP_NO_DFF        (0x00)
+#define SMP_QUERY_ECHO    (3)     // ответ начинается с повтора запроса
+#define SMP_WILDCARD_ADDRESS (0)  // групповой адрес, отвечает любой счетчик
 
 typedef struct {
     uint32_t baudrate;
@@ -93,107 +98,6 @@ typedef struct {
     uint32_t is_signed_values;
 }ce318_poll_data_t;
  
-static int32_t ce318_set_escape(const uint8_t * src, uint8_t * dest, int32_t count)
-{
-    int32_t size = 0;
-    
-    while(count > 0){
-        if(*src == 0xC0){
-            *dest++ = 0xDB;
-            *dest++ = 0xDC;
-            size++;
-        }
-        else if(*src == 0xDB){
-            *dest++ = 0xDB;
-            *dest++ = 0xDD;
-            size++;
-        }
-        else 
-            *dest++ = *src;
-        src++;
-        count--;
-        size++;
-    }
-    return size;
-}
-
-static int32_t ce318_remove_escape(const uint8_t *src, uint8_t * dest, int32_t count)
-{
-    int32_t size = 0;
-
-    while(count > 0){
-        if(*src == 0xDB){
-            *dest = (*(src + 1) == 0xDC) ? 0xC0 : 0xDB;
-            src += 2;
-            size++;
-            dest++;
-            count -= 2;
-        }
-        else{
-            *dest++ = *src++;
-            size++;
-            count--;
-        }
-    }
-    return size;
-}
-
-static uint16_t ce318_get_crc16(uint16_t crc, const uint8_t * buffer, uint32_t lenght)
-{
-    static const uint16_t poly = 0x8005;
-    uint32_t i;
-    const uint8_t * pcBlock = buffer;
-    
-    while(lenght--){
-        crc ^= *pcBlock++ << 8;
-
-        for(i = 0; i < 8; i++)
-            crc = crc & 0x8000 ? (crc << 1) ^ poly : crc << 1;
-    }
-
-    return crc;
-}
-
-static int32_t ce318_dff_parce(const uint8_t * buffer, uint32_t remaining,
-                                int64_t *field, int32_t signed_field)
-{
-    if(buffer == NULL)
-        return -1;
-    
-    if(field == NULL)
-        return -2;
-    
-    const uint8_t *ch = buffer;
-    int32_t field_size = 0;
-    uint64_t result = 0;
-    uint8_t minus = false;
-
-    
-    if(remaining == 0)
-    return -4;
-    
-    do{
-        if(field_size > DFF_FIELD_MAX_SIZE)
-        return -3;
-        
-        result |= (*ch & 0x7F) << (field_size * 7);
-        field_size++;
-        
-        if(signed_field){
-            minus = (*ch & 0x40) != 0;
-        }
-        
-    }while((*ch++ & DFF_FLAG) != 0);
-
-    if(signed_field && minus){
-       result |= 0xffffffffffffffff << (field_size * 7);
-    }
-
-    *field = (int64_t)result;
-
-    return field_size;
-}
-
 static uint8_t meters_ce318_get_phase(smp_phase_t phase)
 {
   uint8_t flags = 0;
@@ -225,104 +129,66 @@ static int32_t meters_ce318_send_packet(meters_context_t * context,
                                 uint32_t baudrate, uint32_t address, 
                                 const uint8_t * data, uint32_t length)
 {
-    meters_tools_context_t *tool = context->tools;
     if((data == NULL) || (length == 0))
-        return -1;
+        return -EINVAL;
     
     int32_t ret;
-    uint8_t pack[64] = {SMP_END};
-    uint8_t count = 1;
-    uint8_t header_buf[] = {SMP_PROTOCOL_ID, 0, 0, 0, 0, 0, SMP_COMMAND_DATA};
-    
-    for(uint32_t i = 0; i < 4; i++)
-        *(header_buf + i + 1) = (uint8_t)(address >> (i * 8));
-
-    uint16_t crc = 0;
+    uint8_t *pack = meters_bus485_buf_get(context, METERS_BUS485_BUF_SMALL_SIZE);
 
-    crc = ce318_get_crc16(crc, header_buf, sizeof(header_buf));
-    crc = ce318_get_crc16(crc, data, length);
-    
-    uint8_t crc_buf[] = {(crc >> 8) & 0xff, crc & 0xff};
+    if(pack == NULL)
+        return -ENOMEM;
 
-    count += ce318_set_escape(header_buf, &pack[count], sizeof(header_buf));
-    count += ce318_set_escape(data, &pack[count], length);
-    count += ce318_set_escape(crc_buf, &pack[count], 2);
+    ret = meters_codec_smp_encode(address, SMP_COMMAND_DATA, data, length, pack, METERS_BUS485_BUF_SMALL_SIZE);
+    if(ret < 0){
+        meters_bus485_buf_put(context, pack);
+        return ret;
+    }
 
-    pack[count] = SMP_END;
-    count++;
+    uint32_t count = ret;
 
-    bus485_lock(tool->bus485);
-    ret = bus485_set_baudrate(tool->bus485, baudrate);
+    // кадры SMP разделены байтом SMP_END, выдерживать паузу на линии не нужно
+    ret = meters_bus485_begin(context, baudrate, METERS_BUS485_SILENCE_NONE);
     if(ret < 0){
-        bus485_release(tool->bus485);
+        meters_bus485_buf_put(context, pack);
         LOG_ERR("set baudrate error: %d", ret);
         return ret;
     }
 
-    bus485_flush(tool->bus485);
-    ret = bus485_send(tool->bus485, pack, count);
+    ret = meters_bus485_send(context, pack, count);
+    meters_bus485_buf_put(context, pack);
     if(ret < 0){
-        bus485_release(tool->bus485);
+        meters_bus485_end(context);
         LOG_ERR("ce318 send error: %d", ret);
         return ret;
     }
     return 0;
 }
 
-static int32_t meters_ce318_get_response(meters_context_t * context, uint8_t * data, uint32_t length)
+// Кадр принимается в data и разбирается на месте, length - размер data
+static int32_t meters_ce318_get_response(meters_context_t * context, uint8_t * data, uint32_t length,
+                                        uint32_t timeout_ms, uint32_t *source)
 {   
-    meters_tools_context_t *tool = context->tools;
     int32_t ret;
-    uint8_t resp[256];
-    uint8_t size = 0;   
-                                           
-    ret = bus485_recv(tool->bus485, resp, ARRAY_SIZE(resp), CONFIG_STRIM_METERS2_BUS485_RESPONSE_TIMEOUT);
-    if(ret < 0){
-        return ret;
-    }
+    size_t size = 0;   
 
-    size += ret;
+    // драйвер линии может отдать кадр по частям, принимаем до закрывающего SMP_END
+    do{
+        if(size >= length)
+            return -EMSGSIZE;
 
-    //Пока под вопросом нужна ли дополнительное доскачивание, если он за раз всегда вычитывает
-    if(resp[ret-1] != SMP_END){
-        
-        ret = bus485_recv(tool->bus485, resp + ret, ARRAY_SIZE(resp) - ret, CONFIG_STRIM_METERS2_BUS485_RESPONSE_TIMEOUT);
-        if(ret < 0){
+        ret = meters_bus485_recv(context, &data[size], length - size, timeout_ms);
+        if(ret < 0)
             return ret;
-        }
-        else 
-            size += ret;
-    }
-
-    if(size > length){
-        return -EMSGSIZE;
-    }
 
-    if(resp[size - 1] != SMP_END || resp[0] != SMP_END){
-        return -EBADMSG;
-    }
-    
-    uint8_t pack[256] = {0};
-    
-    size = ce318_remove_escape(&resp[1], pack, size - 2);
-    
-    uint16_t crc_test = (pack[size-2] << 8) | pack[size-1];
+        size += ret;
+    }while((size < 2) || (data[size - 1] != SMP_END));
 
-    uint16_t crc = 0;
-    crc = ce318_get_crc16(crc, pack, size - 2);
-    
-    if(crc != crc_test){
-        return -EBADMSG;
-    }
-    memcpy(data, pack + 7, size - 9);
-
-    return size - 9;
+    return meters_codec_smp_decode(data, size, data, length, source);
 }
 
 static int32_t meters_ce318_poll(meters_context_t *context, ce318_poll_data_t *poll_data, 
                         int64_t *values, uint32_t values_count)
 {
-    meters_tools_context_t *tool = context->tools;
     int32_t ret;
 
     ret = meters_ce318_send_packet(context, poll_data->baudrate, poll_data->address,
@@ -331,18 +197,41 @@ static int32_t meters_ce318_poll(meters_context_t *context, ce318_poll_data_t *p
         return ret;
     }
 
-    uint8_t response[256];
-    ret = meters_ce318_get_response(context, response, sizeof(response));
-    if(ret < 0){
-            bus485_release(tool->bus485);
-        return ret;
+    // ответ разбирается на месте, буфер нужен на длину кадра
+    uint8_t *response = meters_bus485_buf_get(context, METERS_CODEC_SMP_FRAME_MAX_SIZE);
+    if(response == NULL){
+        meters_bus485_end(context);
+        return -ENOMEM;
     }
-    bus485_release(tool->bus485);
 
-    int32_t offset = 0;
+    ret = meters_ce318_get_response(context, response, METERS_CODEC_SMP_FRAME_MAX_SIZE,
+                                    CONFIG_STRIM_METERS2_BUS485_RESPONSE_TIMEOUT, NULL);
+    meters_bus485_end(context);
 
-    for(uint32_t i = 0; i < values_count; i++)
-        offset += ce318_dff_parce(response + offset + 3, ret - offset, &values[i], poll_data->is_signed_values);
+    // кадр уже прошел проверку crc, ошибки разбора - ошибки протокола, а не линии
+    if(ret >= 0){
+        if(ret < SMP_QUERY_ECHO){
+            ret = -EPROTO;
+        }
+        else {
+            size_t offset = SMP_QUERY_ECHO;
+
+            for(uint32_t i = 0; i < values_count; i++){
+                int32_t field = meters_codec_dff_parse(&response[offset], ret - offset, 
+                                                    &values[i], poll_data->is_signed_values);
+                if(field < 0){
+                    ret = -EPROTO;
+                    break;
+                }
+                offset += field;
+            }
+        }
+    }
+    meters_bus485_buf_put(context, response);
+
+    meters_bus485_result(context, MIN(ret, 0));
+    if(ret < 0)
+        return ret;
 
     return 0;
 }
@@ -350,28 +239,31 @@ static int32_t meters_ce318_poll(meters_context_t *context, ce318_poll_data_t *p
 int32_t meters_ce318_get_battery(meters_context_t *context, uint32_t baudrate,
                                 uint32_t address, uint8_t *hex)
 {
-    meters_tools_context_t *tool = context->tools;
     uint8_t query[] = {smp_command_get_data_single, SMP_NO_DFF, smp_data_single_battery};
-    
-    uint8_t data[8];
-
+    uint8_t *data = meters_bus485_buf_get(context, METERS_BUS485_BUF_SMALL_SIZE);
     int32_t ret;
 
+    if(data == NULL)
+        return -ENOMEM;
+
     ret = meters_ce318_send_packet(context, baudrate, address,
                                 query, sizeof(query));
     if(ret != 0){
+        meters_bus485_buf_put(context, data);
         return ret;
     }
 
+    ret = meters_ce318_get_response(context, data, METERS_BUS485_BUF_SMALL_SIZE,
+                                    CONFIG_STRIM_METERS2_BUS485_RESPONSE_TIMEOUT, NULL);
+    meters_bus485_end(context);
+    if(ret > METERS_CE318_BATTERY_SIZE)
+        ret = -EMSGSIZE;
+    meters_bus485_result(context, MIN(ret, 0));
+
+    if(ret >= 0)
+        memcpy(hex, data, ret);
+    meters_bus485_buf_put(context, data);
 
-    ret = meters_ce318_get_response(context, data, sizeof(data));
-    if(ret < 0){
-            bus485_release(tool->bus485);
-        return ret;
-    }
-    bus485_release(tool->bus485);
-    
-    memcpy(hex, data, ret);
     return ret;
 }
 
@@ -492,8 +384,9 @@ int32_t meters_ce318_read(meters_context_t * context, uint32_t item_idx)
     int32_t ret;
     meters_item_t * item = &context->items[item_idx];
     meters_tools_context_t *tool = context->tools;
-    meter_parameters_t *param = &context->parameters[item_idx];
-    meters_values_ac_t * shadow = &item->data.ce318.shadow;
+    const meter_parameters_t *param = &context->parameters[item_idx];
+    meters_data_ce318_t * ce318 = item->data;
+    meters_values_ac_t * shadow = &ce318->shadow;
 
     ret = meters_ce318_get_voltage(context, param->baudrate, 
                                 param->address, shadow->voltage);
@@ -529,15 +422,15 @@ int32_t meters_ce318_read(meters_context_t * context, uint32_t item_idx)
     }
     else {
         if(item->is_valid_values && (++item->bad_responce_count > CE318_ERROR_THRESHOLD)){
-            k_mutex_lock(&tool->data_access_mutex, K_FOREVER);
+            meters_data_lock(tool);
             {
                 item->is_valid_values = false;
             }
-            k_mutex_unlock(&tool->data_access_mutex);
+            meters_data_unlock(tool);
         }
 
         if(item->is_valid_values){
-            if((ret != -ETIMEDOUT) && (ret != -EILSEQ) && (ret != -EBADMSG) &&
+            if((ret != -ETIMEDOUT) && (ret != -EILSEQ) && (ret != -EBADMSG) && (ret != -EPROTO) &&
             (ret != -EADDRNOTAVAIL) && (ret != -ENODATA) && (ret != -EMSGSIZE))
                 LOG_ERR("read ce318 %d error: %d", param->address, ret);
             else {
@@ -549,6 +442,19 @@ int32_t meters_ce318_read(meters_context_t * context, uint32_t item_idx)
     return 0;
 }
 
+// Для снимка только энергия и суммарная мощность
+static int32_t meters_ce318_sample(meters_context_t *context, uint32_t item_idx,
+                                uint64_t *energy, float *power)
+{
+    int32_t ret;
+    const meter_parameters_t *param = &context->parameters[item_idx];
+
+    ret = meters_ce318_get_energy_active(context, param->baudrate, param->address, energy);
+    if(ret < 0)
+        return ret;
+
+    return meters_ce318_get_power_active(context, param->baudrate, param->address, power, smp_phase_abc);
+}
 
 int32_t meters_ce318_init(meters_context_t * context, uint32_t item_idx)
 {
@@ -559,4 +465,62 @@ int32_t meters_ce318_init(meters_context_t * context, uint32_t item_idx)
 
     item->bad_responce_count = CE318_ERROR_THRESHOLD;
     return 0;
-}
\ No newline at end of file
+}
+
+static void meters_ce318_format_address(char *buffer, size_t size, uint32_t address)
+{
+    snprintf(buffer, size, " %u", address);
+}
+
+static int32_t meters_ce318_probe(meters_context_t *context, uint32_t address, uint32_t baudrate,
+                                uint32_t timeout_ms, uint32_t *found_address)
+{
+    uint8_t query[] = {smp_command_get_data_single, SMP_NO_DFF, smp_data_single_battery};
+    uint8_t *data = meters_bus485_buf_get(context, METERS_CODEC_SMP_FRAME_MAX_SIZE);
+    int32_t ret;
+
+    if(data == NULL)
+        return -ENOMEM;
+
+    ret = meters_ce318_send_packet(context, baudrate, address, query, sizeof(query));
+    if(ret == 0){
+        ret = meters_ce318_get_response(context, data, METERS_CODEC_SMP_FRAME_MAX_SIZE, timeout_ms,
+                                        found_address);
+        meters_bus485_end(context);
+    }
+    meters_bus485_buf_put(context, data);
+
+    return (ret < 0) ? ret : 0;
+}
+
+static const uint32_t ce318_scan_baudrates[] = {4800, 9600, 2400};
+
+// адрес CE318 - заводской номер, перебрать его нельзя, поиск только по групповому адресу
+static const meters_scan_info_t ce318_scan_info = {
+    .probe = meters_ce318_probe,
+    .address_min = 1,
+    .address_max = 0,
+    .wildcard_address = SMP_WILDCARD_ADDRESS,
+    .has_wildcard = true,
+    .baudrates = ce318_scan_baudrates,
+    .baudrate_count = ARRAY_SIZE(ce318_scan_baudrates),
+};
+
+// напряжение, ток, энергия и мощность отдельными запросами
+static const meters_budget_t ce318_budget = {
+    .requests = 4,
+    .request_bytes = 4 * 15,
+    .response_bytes = 23 + 22 + 18 + 17,
+    .silence_x10 = METERS_BUS485_SILENCE_NONE,
+    .turnaround_ms = 30,
+};
+
+METERS_DRIVER_DEFINE(ce318, meters_data_ce318_t,
+                    .name = "CE318",
+                    .values_type = meters_current_type_ac,
+                    .init = meters_ce318_init,
+                    .read = meters_ce318_read,
+                    .format_address = meters_ce318_format_address,
+                    .sample = meters_ce318_sample,
+                    .scan = &ce318_scan_info,
+                    .budget = &ce318_budget);
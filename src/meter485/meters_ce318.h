@@ -11,5 +11,6 @@ int32_t meters_ce318_get_energy_active(meters_context_t * context, uint32_t baud
 int32_t meters_ce318_get_voltage(meters_context_t *context, uint32_t baudrate, 
                                 uint32_t address, float voltage[3]);
 
+enum{METERS_CE318_BATTERY_SIZE = 8};   // наибольший ответ, hex не меньше
 int32_t meters_ce318_get_battery(meters_context_t *context, uint32_t baudrate,
                                 uint32_t address, uint8_t *hex);                                
\ No newline at end of file
@@ -0,0 +1,244 @@
+#include "meters_codec.h"
+#include <errno.h>
+#include <string.h>
+
+enum{CODEC_SMP_PROTOCOL_ID = 6};
+enum{CODEC_SMP_ESC = 0xDB};
+enum{CODEC_SMP_ESC_END = 0xDC};
+enum{CODEC_SMP_ESC_ESC = 0xDD};
+enum{CODEC_SMP_CRC_POLY = 0x8005};
+enum{CODEC_DFF_FLAG = 0x80};
+enum{CODEC_DFF_FIELD_MAX_SIZE = 9};     // 63 бита значения
+
+enum{CODEC_MODBUS_EXCEPTION_FLAG = 0x80};
+enum{CODEC_MODBUS_EXCEPTION_SIZE = 5};  // адрес, функция, код исключения и crc
+enum{CODEC_MODBUS_WRAP_SIZE = 5};       // адрес, функция, счетчик байт и crc
+enum{CODEC_MODBUS_DATA_MAX_SIZE = 250}; // 125 регистров, кадр RTU не длиннее 256 байт
+enum{CODEC_MODBUS_READ_HOLDING = 0x03};
+enum{CODEC_MODBUS_READ_INPUT = 0x04};
+
+uint16_t meters_codec_crc16(const uint8_t *data, size_t length)
+{
+    uint16_t crc = 0xFFFF;
+
+    while(length--){
+        crc ^= *data++;
+        for(uint32_t i = 0; i < 8; i++)
+            crc = (crc & 0x0001) ? ((crc >> 1) ^ 0xA001) : (crc >> 1);
+    }
+
+    return crc;
+}
+
+bool meters_codec_crc16_is_valid(const uint8_t *frame, size_t length)
+{
+    if(length <= METERS_CODEC_CRC_SIZE)
+        return false;
+
+    length -= METERS_CODEC_CRC_SIZE;
+    uint16_t crc = frame[length] | (frame[length + 1] << 8);
+
+    return meters_codec_crc16(frame, length) == crc;
+}
+
+size_t meters_codec_crc16_append(uint8_t *frame, size_t length)
+{
+    uint16_t crc = meters_codec_crc16(frame, length);
+
+    frame[length] = crc & 0xFF;
+    frame[length + 1] = (crc >> 8) & 0xFF;
+
+    return length + METERS_CODEC_CRC_SIZE;
+}
+
+// Старший байт, затем младший и средний
+uint32_t meters_codec_unpack3(const uint8_t *src, uint8_t high_mask)
+{
+    return ((uint32_t)(src[0] & high_mask) << 16) |
+           ((uint32_t)src[2] << 8) |
+           src[1];
+}
+
+int32_t meters_codec_modbus_frame_length(const uint8_t *frame, size_t length)
+{
+    if(length < 2)
+        return 0;
+
+    if(frame[1] & CODEC_MODBUS_EXCEPTION_FLAG)
+        return CODEC_MODBUS_EXCEPTION_SIZE;
+
+    switch(frame[1]){
+        case CODEC_MODBUS_READ_HOLDING:
+        case CODEC_MODBUS_READ_INPUT:
+            if(length < METERS_CODEC_MODBUS_HEADER_SIZE)
+                return 0;
+            // регистры по два байта
+            if((frame[2] > CODEC_MODBUS_DATA_MAX_SIZE) || (frame[2] & 1))
+                return -EBADMSG;
+            return CODEC_MODBUS_WRAP_SIZE + frame[2];
+        default:
+            return -EBADMSG;
+    }
+}
+
+uint16_t meters_codec_smp_crc16(uint16_t crc, const uint8_t *data, size_t length)
+{
+    while(length--){
+        crc ^= *data++ << 8;
+        for(uint32_t i = 0; i < 8; i++)
+            crc = (crc & 0x8000) ? ((crc << 1) ^ CODEC_SMP_CRC_POLY) : (crc << 1);
+    }
+
+    return crc;
+}
+
+int32_t meters_codec_smp_escape(const uint8_t *src, size_t length, uint8_t *dest, size_t size)
+{
+    size_t count = 0;
+
+    for(size_t i = 0; i < length; i++){
+        bool is_special = (src[i] == METERS_CODEC_SMP_END) || (src[i] == CODEC_SMP_ESC);
+
+        if((count + (is_special ? 2 : 1)) > size)
+            return -ENOBUFS;
+
+        if(src[i] == METERS_CODEC_SMP_END){
+            dest[count++] = CODEC_SMP_ESC;
+            dest[count++] = CODEC_SMP_ESC_END;
+        }
+        else if(src[i] == CODEC_SMP_ESC){
+            dest[count++] = CODEC_SMP_ESC;
+            dest[count++] = CODEC_SMP_ESC_ESC;
+        }
+        else
+            dest[count++] = src[i];
+    }
+
+    return count;
+}
+
+int32_t meters_codec_smp_unescape(const uint8_t *src, size_t length, uint8_t *dest, size_t size)
+{
+    size_t count = 0;
+
+    for(size_t i = 0; i < length; i++){
+        if(count >= size)
+            return -EMSGSIZE;
+
+        if(src[i] != CODEC_SMP_ESC){
+            dest[count++] = src[i];
+            continue;
+        }
+
+        // байт замены не может быть последним
+        if(++i >= length)
+            return -EBADMSG;
+
+        if(src[i] == CODEC_SMP_ESC_END)
+            dest[count++] = METERS_CODEC_SMP_END;
+        else if(src[i] == CODEC_SMP_ESC_ESC)
+            dest[count++] = CODEC_SMP_ESC;
+        else
+            return -EBADMSG;
+    }
+
+    return count;
+}
+
+int32_t meters_codec_smp_encode(uint32_t address, uint8_t command, const uint8_t *data, size_t length,
+                                uint8_t *frame, size_t size)
+{
+    uint8_t header[METERS_CODEC_SMP_HEADER_SIZE] = {CODEC_SMP_PROTOCOL_ID};
+    int32_t ret;
+    size_t count = 0;
+
+    for(uint32_t i = 0; i < 4; i++)
+        header[i + 1] = (uint8_t)(address >> (i * 8));
+    header[METERS_CODEC_SMP_HEADER_SIZE - 1] = command;
+
+    uint16_t crc = meters_codec_smp_crc16(0, header, sizeof(header));
+    crc = meters_codec_smp_crc16(crc, data, length);
+    uint8_t crc_buf[] = {(crc >> 8) & 0xFF, crc & 0xFF};
+
+    if(size < 2)
+        return -ENOBUFS;
+    frame[count++] = METERS_CODEC_SMP_END;
+
+    ret = meters_codec_smp_escape(header, sizeof(header), &frame[count], size - count - 1);
+    if(ret < 0)
+        return ret;
+    count += ret;
+
+    ret = meters_codec_smp_escape(data, length, &frame[count], size - count - 1);
+    if(ret < 0)
+        return ret;
+    count += ret;
+
+    ret = meters_codec_smp_escape(crc_buf, sizeof(crc_buf), &frame[count], size - count - 1);
+    if(ret < 0)
+        return ret;
+    count += ret;
+
+    frame[count++] = METERS_CODEC_SMP_END;
+
+    return count;
+}
+
+int32_t meters_codec_smp_decode(const uint8_t *frame, size_t length, uint8_t *data, size_t size,
+                                uint32_t *source)
+{
+    if((length < 2) || (frame[0] != METERS_CODEC_SMP_END) || (frame[length - 1] != METERS_CODEC_SMP_END))
+        return -EBADMSG;
+
+    // кадр без замены байт собирается прямо в data, отдельный буфер не нужен;
+    // запись отстает от чтения, поэтому data может быть и самим кадром
+    int32_t count = meters_codec_smp_unescape(&frame[1], length - 2, data, size);
+    if(count < 0)
+        return count;
+
+    if(count < (METERS_CODEC_SMP_HEADER_SIZE + 2))
+        return -EBADMSG;
+
+    uint16_t crc = (data[count - 2] << 8) | data[count - 1];
+    if(meters_codec_smp_crc16(0, data, count - 2) != crc)
+        return -EBADMSG;
+
+    size_t payload = count - METERS_CODEC_SMP_HEADER_SIZE - 2;
+
+    if(source != NULL)
+        *source = data[1] | (data[2] << 8) | (data[3] << 16) | ((uint32_t)data[4] << 24);
+
+    memmove(data, &data[METERS_CODEC_SMP_HEADER_SIZE], payload);
+
+    return payload;
+}
+
+int32_t meters_codec_dff_parse(const uint8_t *buffer, size_t remaining, int64_t *field, bool is_signed)
+{
+    uint64_t result = 0;
+    size_t count = 0;
+    uint8_t byte;
+
+    if((buffer == NULL) || (field == NULL))
+        return -EINVAL;
+
+    do{
+        if(count >= remaining)
+            return -ENODATA;    // поле обрывается на конце данных
+
+        if(count >= CODEC_DFF_FIELD_MAX_SIZE)
+            return -EOVERFLOW;
+
+        byte = buffer[count];
+        result |= (uint64_t)(byte & 0x7F) << (count * 7);
+        count++;
+    }while(byte & CODEC_DFF_FLAG);
+
+    // знак - старший бит последних семи
+    if(is_signed && (byte & 0x40) && (count < CODEC_DFF_FIELD_MAX_SIZE))
+        result |= UINT64_MAX << (count * 7);
+
+    *field = (int64_t)result;
+
+    return count;
+}
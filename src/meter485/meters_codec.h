@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/**
+ * Сборка и разбор кадров протоколов счетчиков. Модуль работает только с
+ * буферами и не зависит от ядра Zephyr, поэтому собирается и на хосте.
+ * Все функции проверяют границы входных данных и возвращают отрицательный
+ * код ошибки вместо выхода за буфер.
+ */
+
+// Mercury и Modbus RTU: CRC16 с полиномом 0xA001, младший байт первым
+enum{METERS_CODEC_CRC_SIZE = 2};
+
+uint16_t meters_codec_crc16(const uint8_t *data, size_t length);
+bool meters_codec_crc16_is_valid(const uint8_t *frame, size_t length);
+size_t meters_codec_crc16_append(uint8_t *frame, size_t length);
+
+// Mercury: упакованное 3-байтное значение
+uint32_t meters_codec_unpack3(const uint8_t *src, uint8_t high_mask);
+
+// Modbus RTU: длина ответа по первым байтам, 0 - еще неизвестна
+enum{METERS_CODEC_MODBUS_HEADER_SIZE = 3};
+int32_t meters_codec_modbus_frame_length(const uint8_t *frame, size_t length);
+
+// SMP (CE318): кадр между байтами 0xC0 с заменой служебных байт
+enum{METERS_CODEC_SMP_END = 0xC0};
+enum{METERS_CODEC_SMP_HEADER_SIZE = 7};   // протокол, адрес, команда
+enum{METERS_CODEC_SMP_FRAME_MAX_SIZE = 256};
+
+uint16_t meters_codec_smp_crc16(uint16_t crc, const uint8_t *data, size_t length);
+int32_t meters_codec_smp_escape(const uint8_t *src, size_t length, uint8_t *dest, size_t size);
+int32_t meters_codec_smp_unescape(const uint8_t *src, size_t length, uint8_t *dest, size_t size);
+int32_t meters_codec_smp_encode(uint32_t address, uint8_t command, const uint8_t *data, size_t length,
+                                uint8_t *frame, size_t size);
+// data - и рабочий буфер: size не меньше кадра без замены байт (заголовок, данные, crc).
+// data может совпадать с frame, тогда кадр разбирается на месте
+int32_t meters_codec_smp_decode(const uint8_t *frame, size_t length, uint8_t *data, size_t size,
+                                uint32_t *source);
+
+// Поле DFF: по 7 бит, старший бит - признак продолжения
+int32_t meters_codec_dff_parse(const uint8_t *buffer, size_t remaining, int64_t *field, bool is_signed);
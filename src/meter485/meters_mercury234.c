@@ -1,77 +1,136 @@
-#include "meters_private.h"
-#include "bus485.h"
-#include <zephyr/sys/crc.h>
+#include "meters_mercury234.h"
+#include "meters_bus485.h"
+#include "meters_codec.h"
 #include <zephyr/kernel.h>
 #include <zephyr/logging/log.h>
 #include <string.h>
+#include <stdio.h>
 
 enum{MERCURY_ERROR_THRESHOLD = 3};
-enum{MERCURY_REQUEST_PAUSE = 30};
+enum{MERCURY_SILENCE = METERS_BUS485_SILENCE_MODBUS}; // пауза между кадрами, как в Modbus RTU
+enum{MERCURY_FRAME_MIN_SIZE = 4}; // адрес, байт состояния и crc
+enum{MERCURY_FRAME_MAX_SIZE = 48};
+enum{MERCURY_BROADCAST_ADDRESS = 0};  // отвечает любой счетчик, подставляя свой адрес
+enum{MERCURY_ADDRESS_MAX = 253};
+enum{MERCURY_POWER_MASK = 0x3F}; // старшие биты мощности - направление
+
+// байт состояния в ответе счетчика
+enum{
+    MERCURY_STATUS_OK             = 0x00,
+    MERCURY_STATUS_BAD_REQUEST    = 0x01,
+    MERCURY_STATUS_INTERNAL_ERROR = 0x02,
+    MERCURY_STATUS_ACCESS_DENIED  = 0x03,
+    MERCURY_STATUS_CLOCK_ERROR    = 0x04,
+    MERCURY_STATUS_SESSION_CLOSED = 0x05,
+};
 
 LOG_MODULE_DECLARE(meters2, CONFIG_STRIM_METERS2_LOG_LEVEL);
 
+// Чтение массивом параметров (0x08 0x14)
+typedef enum{
+    mercury_block_unverified = 0,   // раскладка еще не сверена с поштучными запросами
+    mercury_block_verified,
+    mercury_block_unsupported,      // счетчик отверг запрос или раскладка не совпала
+}mercury_block_state_t;
+
+enum{MERCURY_BLOCK_MISMATCH_LIMIT = 3}; // несовпадений подряд до отказа от массива
+
+typedef struct {
+    meters_values_ac_t shadow;
+    uint32_t is_session_open;
+    uint32_t block_state;       // mercury_block_state_t
+    uint32_t block_mismatches;
+}meters_data_mercury_t;
+
 static int32_t meters_mercury_send(meters_context_t *context, uint8_t address, uint32_t baudrate,
                             const uint8_t *data, size_t length)
 {
-    meters_tools_context_t *tool = context->tools;
     int32_t ret;
-    uint8_t query[24] = {address};
     size_t count = length + 1;
 
-    memcpy(&query[1], data, length);
+    if((count + METERS_CODEC_CRC_SIZE) > MERCURY_FRAME_MAX_SIZE)
+        return -EMSGSIZE;
 
-    uint16_t crc = crc16_reflect(0xA001, 0xFFFF, query, count);
+    uint8_t *query = meters_bus485_buf_get(context, MERCURY_FRAME_MAX_SIZE);
+    if(query == NULL)
+        return -ENOMEM;
 
-    query[count] = crc & 0xff;
-    query[count + 1] = (crc >> 8) & 0xff;
+    query[0] = address;
+    memcpy(&query[1], data, length);
 
-    count += 2;
+    count = meters_codec_crc16_append(query, count);
 
-    bus485_lock(tool->bus485);
-    
-    ret = bus485_set_baudrate(tool->bus485, baudrate);
+    ret = meters_bus485_begin(context, baudrate, meters_bus485_silence_us(baudrate, MERCURY_SILENCE));
     if(ret < 0){
-        bus485_release(tool->bus485);
+        meters_bus485_buf_put(context, query);
         return ret;
     }
 
-    bus485_flush(tool->bus485);
-
-    ret = bus485_send(tool->bus485, query, count);
+    ret = meters_bus485_send(context, query, count);
+    meters_bus485_buf_put(context, query);
     if(ret < 0){
-        bus485_release(tool->bus485);
+        meters_bus485_end(context);
         return ret;
     }
 
     return 0;
 }
 
-static int32_t meters_mercury_receive(meters_context_t *context, uint8_t address, uint8_t *data, uint32_t length){
-    int32_t ret;
-    uint8_t resp[32];
-    meters_tools_context_t *tool = context->tools;
-
-    ret = bus485_recv(tool->bus485, resp, sizeof(resp), CONFIG_STRIM_METERS2_BUS485_RESPONSE_TIMEOUT);
-    if(ret < 0){
-        bus485_release(tool->bus485);
-        return ret;
-    }
-    bus485_release(tool->bus485);
-
-    uint16_t crc = crc16_reflect(0xA001, 0xFFFF, resp, ret - sizeof(uint16_t));
-    uint16_t crc1 = (((uint16_t)resp[ret-1]) << 8) | resp[ret-2];
-
-    if(crc != crc1)
+static int32_t meters_mercury_parse(const uint8_t *resp, int32_t ret, uint8_t address, uint8_t *data,
+                                    uint32_t length, uint8_t *source)
+{
+    if((ret < MERCURY_FRAME_MIN_SIZE) || !meters_codec_crc16_is_valid(resp, ret))
         return -EBADMSG;
     
-    if(resp[0] != 0 && resp[0] != address)
+    if(address != MERCURY_BROADCAST_ADDRESS && resp[0] != 0 && resp[0] != address)
         return -EXDEV;
+
+    if(source != NULL)
+        *source = resp[0];
+
+    if((ret - 3) > length)
+        return -EMSGSIZE;
     
     memcpy(data, &resp[1], ret - 3);
 
     return ret - 3;
 }
 
+static int32_t meters_mercury_receive(meters_context_t *context, uint8_t address, uint8_t *data, uint32_t length,
+                                    uint32_t timeout_ms, uint8_t *source){
+    int32_t ret;
+    uint8_t *resp = meters_bus485_buf_get(context, MERCURY_FRAME_MAX_SIZE);
+
+    if(resp == NULL){
+        meters_bus485_end(context);
+        return -ENOMEM;
+    }
+
+    ret = meters_bus485_recv(context, resp, MERCURY_FRAME_MAX_SIZE, timeout_ms);
+    meters_bus485_end(context);
+    if(ret >= 0)
+        ret = meters_mercury_parse(resp, ret, address, data, length, source);
+
+    meters_bus485_buf_put(context, resp);
+    return ret;
+}
+
+static int32_t meters_mercury_status_error(uint8_t status)
+{
+    switch(status){
+        case MERCURY_STATUS_OK:
+            return 0;
+        case MERCURY_STATUS_BAD_REQUEST:
+            return -EOPNOTSUPP;
+        case MERCURY_STATUS_ACCESS_DENIED:
+            return -EACCES;
+        case MERCURY_STATUS_SESSION_CLOSED:
+            return -ENOTCONN;
+        default:
+            return -EPROTO;
+    }
+}
+
 static int32_t meters_mercury_request(meters_context_t *context, uint8_t address, uint32_t baudrate,
                                     const uint8_t *req_data, uint32_t req_length,
                                     uint8_t *rcv_buffer, uint32_t rcv_length )
@@ -81,15 +140,22 @@ static int32_t meters_mercury_request(meters_context_t *context, uint8_t address
     if(ret < 0)
         return ret;
     
-    ret = meters_mercury_receive(context, address, rcv_buffer, rcv_length);
+    ret = meters_mercury_receive(context, address, rcv_buffer, rcv_length, 
+                                CONFIG_STRIM_METERS2_BUS485_RESPONSE_TIMEOUT, NULL);
     if(ret < 0){
+        meters_bus485_result(context, ret);
         if(ret != -ETIMEDOUT){
             LOG_WRN("mercury %d request error: %d", address, ret);
             LOG_HEXDUMP_WRN(req_data, req_length, "request");
         }
         return ret;
     }
+
+    //на запрос данных счетчик отвечает одним байтом состояния только при ошибке
+    if((ret == 1) && (rcv_length > 1))
+        ret = meters_mercury_status_error(rcv_buffer[0]);
     
+    meters_bus485_result(context, MIN(ret, 0));
     return ret;
 
 }
@@ -114,6 +180,29 @@ int32_t meters_mercury_ping(meters_context_t *context, uint8_t address, uint32_t
     return 0;
 }
 
+static int32_t meters_mercury_probe(meters_context_t *context, uint32_t address, uint32_t baudrate,
+                                    uint32_t timeout_ms, uint32_t *found_address)
+{
+    int32_t ret;
+
+    uint8_t req[1] = {0x00}; //проверка связи
+
+    uint8_t rcv[1];
+    uint8_t source;
+
+    ret = meters_mercury_send(context, address, baudrate, req, sizeof(req));
+    if(ret < 0)
+        return ret;
+
+    // любой корректный ответ, даже с ошибкой, означает наличие счетчика
+    ret = meters_mercury_receive(context, address, rcv, sizeof(rcv), timeout_ms, &source);
+    if(ret < 0)
+        return ret;
+
+    *found_address = source;
+    return 0;
+}
+
 static int32_t meters_mercury_connect(meters_context_t *context, uint8_t address, uint32_t baudrate)
 {
     int32_t ret;
@@ -131,9 +220,9 @@ static int32_t meters_mercury_connect(meters_context_t *context, uint8_t address
     if(ret < 0)
         return ret;
     
-    if(rcv[0]!= 0x00){
+    if(rcv[0]!= MERCURY_STATUS_OK){
         LOG_WRN("mercury open session error: %d", rcv[0]);
-        return -EPROTO;
+        return meters_mercury_status_error(rcv[0]);
     }
 
     return 0;
@@ -155,17 +244,81 @@ static int32_t meters_mercury_get_energy(meters_context_t *context, uint8_t addr
     ret = meters_mercury_request(context, address, baudrate, req, sizeof(req), rcv, sizeof(rcv));
     if(ret < 0)
         return ret;
+
+    // нужна только активная энергия прямого направления, первые четыре байта
+    if(ret < 4)
+        return -EBADMSG;
     
-    uint32_t energy_wh = (rcv[1] << 24) |
-                         (rcv[0] << 16) |
-                         (rcv[3] << 8) |
+    uint32_t energy_wh = ((uint32_t)rcv[1] << 24) |
+                         ((uint32_t)rcv[0] << 16) |
+                         ((uint32_t)rcv[3] << 8) |
                          (rcv[2]);
 
-    value->energy_active = energy_wh * 3600; // в Вт*с
+    value->energy_active = (uint64_t)energy_wh * 3600; // в Вт*с
 
     return 0;
 }
 
+typedef struct{
+    uint8_t offset;     // смещение первого значения в ответе
+    uint8_t count;      // количество значений подряд
+    uint8_t high_mask;  // маска старшего байта
+    float scale;        // множитель к единицам meters_values_ac_t
+    size_t target;      // смещение поля в meters_values_ac_t
+}mercury_block_field_t;
+
+// Массив вспомогательных параметров (0x08 0x14): мощность P по сумме и фазам,
+// напряжения и токи фаз, частота сети. Раскладка подтверждена не для всех
+// исполнений счетчика, поэтому первый массив каждого счетчика сверяется с
+// документированными поштучными запросами 0x08 0x11 и 0x08 0x16.
+static const mercury_block_field_t mercury_block_fields[] = {
+    {.offset = 0,  .count = 1, .high_mask = MERCURY_POWER_MASK, .scale = 0.01f,
+     .target = offsetof(meters_values_ac_t, power_active)},
+    {.offset = 12, .count = 3, .high_mask = 0xFF, .scale = 0.01f,
+     .target = offsetof(meters_values_ac_t, voltage)},
+    {.offset = 21, .count = 3, .high_mask = 0xFF, .scale = 0.001f,
+     .target = offsetof(meters_values_ac_t, current)},
+    {.offset = 30, .count = 1, .high_mask = 0xFF, .scale = 0.01f,
+     .target = offsetof(meters_values_ac_t, frequency)},
+};
+
+enum{MERCURY_BLOCK_SIZE = 33};
+
+static void meters_mercury_decode_block(const uint8_t *block, const mercury_block_field_t *fields,
+                                        uint32_t count, meters_values_ac_t *value)
+{
+    for(uint32_t i = 0; i < count; i++){
+        float *target = (float *)((uint8_t *)value + fields[i].target);
+        for(uint32_t j = 0; j < fields[i].count; j++){
+            target[j] = meters_codec_unpack3(&block[fields[i].offset + (3 * j)], 
+                                                fields[i].high_mask) * fields[i].scale;
+        }
+    }
+}
+
+static int32_t meters_mercury_get_block(meters_context_t *context, uint8_t address,
+                                        uint32_t baudrate, meters_values_ac_t *value)
+{
+    int32_t ret;
+
+    uint8_t req[3] = {
+        0x08, // чтение параметров
+        0x14, // массив вспомогательных параметров
+        0x00  // мощность, напряжение, ток и частота одним ответом
+    };
+
+    uint8_t rcv[MERCURY_BLOCK_SIZE];
+    ret = meters_mercury_request(context, address, baudrate, req, sizeof(req), rcv, sizeof(rcv));
+    if(ret < 0)
+        return ret;
+
+    if(ret != MERCURY_BLOCK_SIZE)
+        return -EMSGSIZE;
+
+    meters_mercury_decode_block(rcv, mercury_block_fields, ARRAY_SIZE(mercury_block_fields), value);
+    return 0;
+}
+
 static int32_t meters_mercury_get_power(meters_context_t *context, uint8_t address, 
                                         uint32_t baudrate, meters_values_ac_t *value)
 {
@@ -182,11 +335,34 @@ static int32_t meters_mercury_get_power(meters_context_t *context, uint8_t addre
     if(ret < 0)
         return ret;
 
-    uint32_t power_10mw = ((rcv[0] & 0x3F) << 16) |
-                           ( rcv[2]         <<  8) |
-                           ( rcv[1]              );
+    if(ret < (int32_t)sizeof(rcv))
+        return -EBADMSG;
 
-    value->power_active = power_10mw / 100.0; //в Вт
+    value->power_active = meters_codec_unpack3(rcv, MERCURY_POWER_MASK) / 100.0; //в Вт
+    
+    return 0;
+}
+
+static int32_t meters_mercury_get_frequency(meters_context_t *context, uint8_t address, 
+                                            uint32_t baudrate, meters_values_ac_t *value)
+{
+    int32_t ret;
+
+    uint8_t req[] = {
+        0x08, // чтение параметров
+        0x11, // мгновенное значение
+        0x40  // частота сети
+    };
+
+    uint8_t rcv[3];
+    ret = meters_mercury_request(context, address, baudrate, req, sizeof(req), rcv, sizeof(rcv));
+    if(ret < 0)
+        return ret;
+
+    if(ret < (int32_t)sizeof(rcv))
+        return -EBADMSG;
+
+    value->frequency = meters_codec_unpack3(rcv, 0xFF) / 100.0; //в Гц
     
     return 0;
 }
@@ -207,11 +383,11 @@ static int32_t meters_mercury_get_voltage(meters_context_t * context, uint8_t ad
     if(ret < 0)
         return ret;
 
+    if(ret < (int32_t)sizeof(rcv))
+        return -EBADMSG;
+
     for(uint32_t i = 0; i < 3; i++){
-        uint32_t voltage_10mv = (rcv[0 + (3 * i)] << 16) |
-                                (rcv[2 + (3 * i)] << 8) |
-                                (rcv[1 + (3 * i)]);
-        value->voltage[i] = voltage_10mv / 100.0; //значение в вольт
+        value->voltage[i] = meters_codec_unpack3(&rcv[3 * i], 0xFF) / 100.0; //значение в вольт
     }
     return 0;
 }
@@ -232,118 +408,186 @@ static int32_t meters_mercury_get_current(meters_context_t *context, uint8_t add
     if(ret < 0)
         return ret;
 
+    if(ret < (int32_t)sizeof(rcv))
+        return -EBADMSG;
+
     for(uint32_t i = 0; i < 3; i++){
-        uint32_t current_ma = (rcv[0 + (3 * i)] << 16) |
-                                (rcv[2 + (3 * i)] << 8) |
-                                (rcv[1 + (3 * i)]);
-        value->current[i] = current_ma / 1000.0; //значение в вольт
+        value->current[i] = meters_codec_unpack3(&rcv[3 * i], 0xFF) / 1000.0; //значение в ампер
     }
     return 0;
 }            
 
-static int32_t meters_mercury_disconnect(meters_context_t *context, uint8_t address, uint32_t baudrate)
+// Поштучное чтение тех же значений, что и в массиве: пять кадров за цикл вместе с энергией
+static int32_t meters_mercury_get_params(meters_context_t *context, uint8_t address,
+                                        uint32_t baudrate, meters_values_ac_t *value)
 {
     int32_t ret;
+
+    ret = meters_mercury_get_power(context, address, baudrate, value);
+    if(ret < 0)
+        return ret;
     
-    uint8_t req[1] = {0x02}; //закрытие сессии
+    ret = meters_mercury_get_voltage(context, address, baudrate, value);
+    if(ret < 0)
+        return ret;
+    
+    ret = meters_mercury_get_current(context, address, baudrate, value);
+    if(ret < 0)
+        return ret;
 
-    uint8_t rcv[1];
+    return meters_mercury_get_frequency(context, address, baudrate, value);
+}
 
-    ret = meters_mercury_request(context, address, baudrate, req, sizeof(req), rcv, sizeof(rcv));
+static bool meters_mercury_is_close(float a, float b, float tolerance)
+{
+    float diff = a - b;
+    return (diff <= tolerance) && (diff >= -tolerance);
+}
+
+/**
+ * Сверка массива с поштучными запросами. Сравниваются напряжения и частота:
+ * они меняются медленно, а при другой раскладке массива на их местах
+ * оказались бы чужие значения. Возвращает -EILSEQ при несовпадении,
+ * value заполняется поштучными значениями.
+ */
+static int32_t meters_mercury_verify_block(meters_context_t *context, uint8_t address,
+                                        uint32_t baudrate, meters_values_ac_t *value)
+{
+    meters_values_ac_t block = *value;
+    int32_t ret;
+
+    ret = meters_mercury_get_params(context, address, baudrate, value);
     if(ret < 0)
         return ret;
-    
-    if(rcv[0]!= 0x00){
-        LOG_WRN("mercury close session error: %d", rcv[0]);
-        return -EPROTO;
+
+    if(!meters_mercury_is_close(block.frequency, value->frequency, 0.1f))
+        return -EILSEQ;
+
+    for(uint32_t i = 0; i < 3; i++){
+        if(!meters_mercury_is_close(block.voltage[i], value->voltage[i], 2.0f))
+            return -EILSEQ;
     }
 
     return 0;
 }
 
-int32_t meters_mercury_read(meters_context_t *context, uint32_t item_idx)
+// Отказ от массива: счетчик не знает запроса или раскладка не совпала несколько раз подряд
+static bool meters_mercury_block_mismatch(meters_data_mercury_t *mercury, uint8_t address, int32_t ret)
 {
-    int32_t ret;
+    if((ret != -EOPNOTSUPP) && (++mercury->block_mismatches < MERCURY_BLOCK_MISMATCH_LIMIT))
+        return false;
 
-    meters_item_t *item = &context->items[item_idx];
-    meter_parameters_t *param = &context->parameters[item_idx];
-    meters_values_ac_t *shadow = &item->data.mercury.shadow;
-    meters_tools_context_t *tool = context->tools;
+    LOG_INF("mercury %u: parameters array not usable (%d), read one by one", address, ret);
+    mercury->block_state = mercury_block_unsupported;
+    return true;
+}
+
+static int32_t meters_mercury_get_values(meters_context_t *context, uint32_t item_idx)
+{
+    int32_t ret;
+    meters_data_mercury_t *mercury = context->items[item_idx].data;
+    const meter_parameters_t *param = &context->parameters[item_idx];
 
-    ret = meters_mercury_ping(context, param->address, param->baudrate);
+    ret = meters_mercury_get_energy(context, param->address, param->baudrate, &mercury->shadow);
     if(ret < 0)
-        goto mercury_end_poll;
+        return ret;
     
-    k_sleep(K_MSEC(MERCURY_REQUEST_PAUSE));
+    if(mercury->block_state == mercury_block_unsupported)
+        return meters_mercury_get_params(context, param->address, param->baudrate, &mercury->shadow);
+
+    ret = meters_mercury_get_block(context, param->address, param->baudrate, &mercury->shadow);
+    if((ret == -EOPNOTSUPP) || (ret == -EMSGSIZE)){
+        if(!meters_mercury_block_mismatch(mercury, param->address, ret))
+            return ret;
+        return meters_mercury_get_params(context, param->address, param->baudrate, &mercury->shadow);
+    }
+    // ошибки связи и прочие ответы с ошибкой не говорят о раскладке, цикл просто неудачен
+    if(ret < 0)
+        return ret;
+
+    if(mercury->block_state == mercury_block_unverified){
+        ret = meters_mercury_verify_block(context, param->address, param->baudrate, &mercury->shadow);
+        if(ret == -EILSEQ){
+            meters_mercury_block_mismatch(mercury, param->address, ret);
+            return 0;   // значения уже прочитаны поштучно
+        }
+        if(ret < 0)
+            return ret;
+
+        mercury->block_state = mercury_block_verified;
+    }
+
+    mercury->block_mismatches = 0;
+    return 0;
+}
+
+static int32_t meters_mercury_open_session(meters_context_t *context, uint32_t item_idx)
+{
+    int32_t ret;
+    meters_data_mercury_t *mercury = context->items[item_idx].data;
+    const meter_parameters_t *param = &context->parameters[item_idx];
+
+    mercury->is_session_open = false;
 
     ret = meters_mercury_connect(context, param->address, param->baudrate);
     if(ret < 0)
-        goto mercury_end_poll;
-    
-    k_sleep(K_MSEC(MERCURY_REQUEST_PAUSE));
+        return ret;
 
-    ret = meters_mercury_get_energy(context, param->address, param->baudrate, shadow);
-    if(ret < 0)
-        goto mercury_end_poll;
-    
-    k_sleep(K_MSEC(MERCURY_REQUEST_PAUSE));
+    mercury->is_session_open = true;
 
-    ret = meters_mercury_get_power(context, param->address, param->baudrate, shadow);
-    if(ret < 0)
-        goto mercury_end_poll;
-    
-    k_sleep(K_MSEC(MERCURY_REQUEST_PAUSE));
+    return 0;
+}
 
-    ret = meters_mercury_get_voltage(context, param->address, param->baudrate, shadow);
-    if(ret < 0)
-        goto mercury_end_poll;
-    
-    k_sleep(K_MSEC(MERCURY_REQUEST_PAUSE));
+int32_t meters_mercury_read(meters_context_t *context, uint32_t item_idx)
+{
+    int32_t ret = 0;
 
-    ret = meters_mercury_get_current(context, param->address, param->baudrate, shadow);
-    if(ret < 0)
-        goto mercury_end_poll;
-    
-    k_sleep(K_MSEC(MERCURY_REQUEST_PAUSE));
+    meters_item_t *item = &context->items[item_idx];
+    const meter_parameters_t *param = &context->parameters[item_idx];
+    meters_data_mercury_t *mercury = item->data;
+    meters_values_ac_t *shadow = &mercury->shadow;
+    meters_tools_context_t *tool = context->tools;
 
-    ret = meters_mercury_disconnect(context, param->address, param->baudrate);
-    if(ret < 0)
-        goto mercury_end_poll;
-    
-    k_sleep(K_MSEC(MERCURY_REQUEST_PAUSE));
+    // сессия остается открытой между циклами опроса
+    if(!mercury->is_session_open){
+        ret = meters_mercury_open_session(context, item_idx);
+        if(ret < 0)
+            goto mercury_end_poll;
+    }
+
+    ret = meters_mercury_get_values(context, item_idx);
+    if(ret == -ENOTCONN){ //счетчик закрыл сессию по таймауту неактивности
+        LOG_DBG("mercury %u session closed by meter", param->address);
+
+        ret = meters_mercury_open_session(context, item_idx);
+        if(ret < 0)
+            goto mercury_end_poll;
+
+        ret = meters_mercury_get_values(context, item_idx);
+    }
 
     mercury_end_poll:
     if(ret == 0){
         if(!item->is_valid_values)
           LOG_INF("mercury poll recovered");
         item->bad_responce_count = 0;
-        
-        //Учет коэффициента трансформаторов тока
-        if(param->current_factor > 1){
-            for(uint32_t i = 0; i < 3; i++){
-                shadow->current[i] *= param->current_factor;
-            }
-            shadow->power_active *= param->current_factor;
-            shadow->energy_active *= param->current_factor;
-        }
 
+        // коэффициент трансформаторов тока учитывается при записи значений
         meters_values_t data = {.AC = *shadow, .type = meters_current_type_ac};
         meters_set_values(item_idx, &data);
     }
     else {
 
         if(item->is_valid_values && (++item->bad_responce_count > MERCURY_ERROR_THRESHOLD)){
-            k_mutex_lock(&tool->data_access_mutex, K_FOREVER);
+            meters_data_lock(tool);
             {
                 item->is_valid_values = false;
             }
-            k_mutex_unlock(&tool->data_access_mutex);
+            meters_data_unlock(tool);
         }
 
-        if(ret == -ETIMEDOUT){ //пропала связь во время сессии
-            k_sleep(K_MSEC(500));
-            meters_mercury_disconnect(context, param->address, param->baudrate);
-            k_sleep(K_MSEC(1000));
+        if((ret == -ETIMEDOUT) || (ret == -ENOTCONN)){ //пропала связь, сессию откроем заново
+            mercury->is_session_open = false;
             ret = 0;
         }
         else if((ret != -EFAULT) && (ret != -EINVAL))
@@ -358,14 +602,94 @@ int32_t meters_mercury_read(meters_context_t *context, uint32_t item_idx)
 }
 
 
+// Для снимка только энергия и суммарная мощность, два коротких ответа вместо массива параметров
+static int32_t meters_mercury_get_sample(meters_context_t *context, uint32_t item_idx,
+                                        meters_values_ac_t *value)
+{
+    int32_t ret;
+    const meter_parameters_t *param = &context->parameters[item_idx];
+
+    ret = meters_mercury_get_energy(context, param->address, param->baudrate, value);
+    if(ret < 0)
+        return ret;
+
+    return meters_mercury_get_power(context, param->address, param->baudrate, value);
+}
+
+static int32_t meters_mercury_sample(meters_context_t *context, uint32_t item_idx,
+                                    uint64_t *energy, float *power)
+{
+    int32_t ret = -ENOTCONN;
+    meters_data_mercury_t *mercury = context->items[item_idx].data;
+    meters_values_ac_t value;
+
+    if(mercury->is_session_open)
+        ret = meters_mercury_get_sample(context, item_idx, &value);
+
+    if(ret == -ENOTCONN){
+        ret = meters_mercury_open_session(context, item_idx);
+        if(ret < 0)
+            return ret;
+
+        ret = meters_mercury_get_sample(context, item_idx, &value);
+    }
+    if(ret < 0)
+        return ret;
+
+    *energy = value.energy_active;
+    *power = value.power_active;
+
+    return 0;
+}
+
 int32_t meters_mercury_init(meters_context_t * context, uint32_t item_idx)
 {
     if(item_idx >= context->item_count)
         return -ERANGE;
     
     meters_item_t * item = &context->items[item_idx];
+    meters_data_mercury_t *mercury = item->data;
 
     item->bad_responce_count = MERCURY_ERROR_THRESHOLD;
+    mercury->is_session_open = false;
+    mercury->block_state = mercury_block_unverified;
+    mercury->block_mismatches = 0;
 
     return 0;
-}
\ No newline at end of file
+}
+
+static void meters_mercury_format_address(char *buffer, size_t size, uint32_t address)
+{
+    snprintf(buffer, size, "  %4u", address);
+}
+
+static const uint32_t mercury_scan_baudrates[] = {9600, 4800, 19200, 2400, 1200, 38400};
+
+static const meters_scan_info_t mercury_scan_info = {
+    .probe = meters_mercury_probe,
+    .address_min = 1,
+    .address_max = MERCURY_ADDRESS_MAX,
+    .wildcard_address = MERCURY_BROADCAST_ADDRESS,
+    .has_wildcard = true,
+    .baudrates = mercury_scan_baudrates,
+    .baudrate_count = ARRAY_SIZE(mercury_scan_baudrates),
+};
+
+// энергия и массив параметров, сессия остается открытой между циклами
+static const meters_budget_t mercury_budget = {
+    .requests = 2,
+    .request_bytes = 6 + 6,
+    .response_bytes = 19 + 36,
+    .silence_x10 = MERCURY_SILENCE,
+    .turnaround_ms = 15,
+};
+
+METERS_DRIVER_DEFINE(mercury234, meters_data_mercury_t,
+                    .name = "MERCURY234",
+                    .values_type = meters_current_type_ac,
+                    .init = meters_mercury_init,
+                    .read = meters_mercury_read,
+                    .format_address = meters_mercury_format_address,
+                    .sample = meters_mercury_sample,
+                    .scan = &mercury_scan_info,
+                    .budget = &mercury_budget);
\ No newline at end of file
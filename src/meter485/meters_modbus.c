@@ -0,0 +1,272 @@
+#include "meters_modbus.h"
+#include "meters_bus485.h"
+#include "meters_codec.h"
+#include <zephyr/sys/byteorder.h>
+
+LOG_MODULE_DECLARE(meters2, CONFIG_STRIM_METERS2_LOG_LEVEL);
+
+enum{MODBUS_REQUEST_SIZE = 8};
+enum{MODBUS_WRAP_SIZE = 5}; // адрес, функция, счетчик байт и crc
+enum{MODBUS_REGS_MAX = CONFIG_STRIM_METERS2_MODBUS_MAX_REGS};
+
+BUILD_ASSERT((MODBUS_WRAP_SIZE + MODBUS_REGS_MAX * sizeof(uint16_t)) <= METERS_BUS485_BUF_LARGE_SIZE,
+            "modbus response does not fit a frame buffer");
+
+static uint32_t meters_modbus_reg_width(const meters_modbus_reg_t *reg)
+{
+    return ((reg->format == meters_modbus_format_u32) || 
+            (reg->format == meters_modbus_format_s32)) ? 2 : 1;
+}
+
+enum{MODBUS_EXCEPTION_FLAG = 0x80};
+enum{MODBUS_BUSY_RETRIES = 2};
+
+enum{
+    MODBUS_EXCEPTION_ILLEGAL_FUNCTION = 0x01,
+    MODBUS_EXCEPTION_ILLEGAL_ADDRESS  = 0x02,
+    MODBUS_EXCEPTION_ILLEGAL_VALUE    = 0x03,
+    MODBUS_EXCEPTION_DEVICE_FAILURE   = 0x04,
+    MODBUS_EXCEPTION_ACKNOWLEDGE      = 0x05,
+    MODBUS_EXCEPTION_DEVICE_BUSY      = 0x06,
+    MODBUS_EXCEPTION_GATEWAY_PATH     = 0x0A,
+    MODBUS_EXCEPTION_GATEWAY_TARGET   = 0x0B,
+};
+
+static int32_t meters_modbus_exception_error(uint8_t code)
+{
+    switch(code){
+        case MODBUS_EXCEPTION_ILLEGAL_FUNCTION:
+            return -EOPNOTSUPP;
+        case MODBUS_EXCEPTION_ILLEGAL_ADDRESS:
+            return -ENXIO;
+        case MODBUS_EXCEPTION_ILLEGAL_VALUE:
+            return -EDOM;
+        case MODBUS_EXCEPTION_DEVICE_FAILURE:
+            return -EIO;
+        case MODBUS_EXCEPTION_ACKNOWLEDGE:
+            return -EINPROGRESS;
+        case MODBUS_EXCEPTION_DEVICE_BUSY:
+            return -EBUSY;
+        case MODBUS_EXCEPTION_GATEWAY_PATH:
+        case MODBUS_EXCEPTION_GATEWAY_TARGET:
+            return -EHOSTUNREACH;
+        default:
+            return -EPROTO;
+    }
+}
+
+bool meters_modbus_is_meter_error(int32_t error)
+{
+    switch(error){
+        case -ETIMEDOUT:
+        case -EBADMSG:
+        case -EADDRNOTAVAIL:
+        case -ENODATA:
+        case -EMSGSIZE:
+        case -EOPNOTSUPP:
+        case -ENXIO:
+        case -EDOM:
+        case -EIO:
+        case -EINPROGRESS:
+        case -EBUSY:
+        case -EHOSTUNREACH:
+        case -EPROTO:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Прием кадра по частям до получения ожидаемой длины, без ожидания таймаута
+static int32_t meters_modbus_receive(meters_context_t *context, uint8_t *frame, size_t size,
+                                    uint32_t timeout_ms)
+{
+    int32_t ret;
+    size_t length = 0;
+    int32_t expected = 0;
+    int64_t deadline = k_uptime_get() + timeout_ms;
+
+    while((expected == 0) || (length < expected)){
+        int64_t remaining = deadline - k_uptime_get();
+        if(remaining <= 0)
+            return -ETIMEDOUT;
+
+        size_t wanted = (expected == 0) ? (METERS_CODEC_MODBUS_HEADER_SIZE - length) : (expected - length);
+
+        ret = meters_bus485_recv(context, &frame[length], wanted, (uint32_t)remaining);
+        if(ret < 0)
+            return ret;
+
+        length += ret;
+
+        if(expected == 0){
+            expected = meters_codec_modbus_frame_length(frame, length);
+            if(expected < 0)
+                return expected;
+            if(expected > size)
+                return -EMSGSIZE;
+        }
+    }
+
+    if(!meters_codec_crc16_is_valid(frame, expected))
+        return -EBADMSG;
+
+    return expected;
+}
+
+// Значения регистров сдвигаются в начало кадра
+static int32_t meters_modbus_parse(uint8_t *resp, uint8_t id, uint8_t function, uint16_t count)
+{
+    if(resp[0] != id)
+        return -EADDRNOTAVAIL;
+
+    if(resp[1] == (function | MODBUS_EXCEPTION_FLAG))
+        return meters_modbus_exception_error(resp[2]);
+
+    if(resp[1] != function)
+        return -ENODATA;
+
+    if(resp[2] != (count * sizeof(uint16_t)))
+        return -EMSGSIZE;
+
+    memmove(resp, &resp[3], count * sizeof(uint16_t));
+    return 0;
+}
+
+// data - и буфер ответа: не меньше MODBUS_WRAP_SIZE + count * 2 байт
+static int32_t meters_modbus_transfer(meters_context_t *context, uint8_t id, uint32_t baudrate,
+                                    uint8_t function, uint16_t start, uint16_t count, 
+                                    uint8_t *data, uint32_t timeout_ms)
+{
+    int32_t ret;
+    uint8_t req[MODBUS_REQUEST_SIZE] = {id, function};
+    size_t size = MODBUS_WRAP_SIZE + (count * sizeof(uint16_t));
+
+    if(count > MODBUS_REGS_MAX)
+        return -E2BIG;
+
+    sys_put_be16(start, &req[2]);
+    sys_put_be16(count, &req[4]);
+    meters_codec_crc16_append(req, 6);
+
+    ret = meters_bus485_begin(context, baudrate, 
+                            meters_bus485_silence_us(baudrate, METERS_BUS485_SILENCE_MODBUS));
+    if(ret < 0)
+        return ret;
+
+    ret = meters_bus485_send(context, req, sizeof(req));
+    if(ret < 0){
+        meters_bus485_end(context);
+        return ret;
+    }
+
+    ret = meters_modbus_receive(context, data, size, timeout_ms);
+    meters_bus485_end(context);
+    if(ret < 0)
+        return ret;
+
+    return meters_modbus_parse(data, id, function, count);
+}
+
+static void meters_modbus_decode(const meters_modbus_reg_t *reg, const uint8_t *data, void *values)
+{
+    uint8_t *target = (uint8_t *)values + reg->target;
+    double value;
+
+    switch(reg->format){
+        case meters_modbus_format_s16:
+            value = (int16_t)sys_get_be16(data);
+            break;
+        case meters_modbus_format_u32:
+        case meters_modbus_format_s32: {
+            uint32_t raw = (reg->order == meters_modbus_order_low_first)
+                            ? ((uint32_t)sys_get_be16(&data[2]) << 16) | sys_get_be16(data)
+                            : sys_get_be32(data);
+            value = (reg->format == meters_modbus_format_s32) ? (double)(int32_t)raw : raw;
+            break;
+        }
+        case meters_modbus_format_u16:
+        default:
+            value = sys_get_be16(data);
+            break;
+    }
+
+    value *= reg->scale;
+
+    if(reg->target_type == meters_modbus_target_u64){
+        uint64_t result = (value > 0) ? (uint64_t)value : 0;
+        memcpy(target, &result, sizeof(result));
+    }
+    else {
+        float result = (float)value;
+        memcpy(target, &result, sizeof(result));
+    }
+}
+
+int32_t meters_modbus_read_map(meters_context_t *context, uint8_t id, uint32_t baudrate,
+                                const meters_modbus_map_t *map, void *values)
+{
+    int32_t ret = 0;
+    // ответ принимается и разбирается в одном буфере
+    uint8_t *data = meters_bus485_buf_get(context, MODBUS_WRAP_SIZE + MODBUS_REGS_MAX * sizeof(uint16_t));
+    uint32_t first = 0;
+
+    if(data == NULL)
+        return -ENOMEM;
+
+    while(first < map->count){
+        const meters_modbus_reg_t *start = &map->regs[first];
+        uint32_t end = start->address + meters_modbus_reg_width(start);
+        uint32_t last = first + 1;
+
+        // присоединяем следующие регистры, пока разрыв и размер запроса допустимы
+        while(last < map->count){
+            const meters_modbus_reg_t *next = &map->regs[last];
+            uint32_t next_end = next->address + meters_modbus_reg_width(next);
+
+            if((next->function != start->function) || (next->address < start->address) ||
+               (next->address > end + map->max_gap) || (next_end - start->address > MODBUS_REGS_MAX))
+                break;
+
+            end = MAX(end, next_end);
+            last++;
+        }
+
+        // занятый счетчик отвечает исключением сразу, повтор не ждет таймаута
+        uint32_t retries = 0;
+        do{
+            ret = meters_modbus_transfer(context, id, baudrate, start->function,
+                                        start->address, end - start->address, data,
+                                        CONFIG_STRIM_METERS2_BUS485_RESPONSE_TIMEOUT);
+            meters_bus485_result(context, ret);
+        }while(((ret == -EBUSY) || (ret == -EINPROGRESS)) && (retries++ < MODBUS_BUSY_RETRIES));
+
+        if(ret < 0)
+            break;
+
+        for(uint32_t i = first; i < last; i++){
+            const meters_modbus_reg_t *reg = &map->regs[i];
+            meters_modbus_decode(reg, &data[(reg->address - start->address) * sizeof(uint16_t)], values);
+        }
+
+        first = last;
+    }
+
+    meters_bus485_buf_put(context, data);
+    return ret;
+}
+
+int32_t meters_modbus_probe(meters_context_t *context, uint8_t id, uint32_t baudrate,
+                            uint8_t function, uint16_t address, uint32_t timeout_ms)
+{
+    uint8_t data[MODBUS_WRAP_SIZE + sizeof(uint16_t)];
+
+    int32_t ret = meters_modbus_transfer(context, id, baudrate, function, address, 1, data, timeout_ms);
+
+    // исключение тоже означает, что устройство с этим адресом есть на шине
+    if((ret == 0) || ((ret != -ETIMEDOUT) && (ret != -EBADMSG) && (ret != -EADDRNOTAVAIL) &&
+                        meters_modbus_is_meter_error(ret)))
+        return 0;
+
+    return ret;
+}
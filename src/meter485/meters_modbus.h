@@ -0,0 +1,66 @@
+#pragma once
+
+#include "meters_private.h"
+
+enum{METERS_MODBUS_ADDRESS_MIN = 1};
+enum{METERS_MODBUS_ADDRESS_MAX = 247};
+
+enum{
+    METERS_MODBUS_READ_HOLDING = 0x03,
+    METERS_MODBUS_READ_INPUT   = 0x04,
+};
+
+typedef enum{
+    meters_modbus_format_u16,
+    meters_modbus_format_s16,
+    meters_modbus_format_u32,
+    meters_modbus_format_s32,
+}meters_modbus_format_t;
+
+typedef enum{
+    meters_modbus_target_float,
+    meters_modbus_target_u64,
+}meters_modbus_target_t;
+
+typedef enum{
+    meters_modbus_order_high_first, // старшее слово по младшему адресу
+    meters_modbus_order_low_first,
+}meters_modbus_order_t;
+
+// Описание одного значения в карте регистров счетчика
+typedef struct{
+    uint16_t address;
+    uint8_t function;               // METERS_MODBUS_READ_HOLDING или METERS_MODBUS_READ_INPUT
+    uint8_t format;                 // meters_modbus_format_t
+    uint8_t order;                  // meters_modbus_order_t для 32-битных значений
+    uint8_t target_type;            // meters_modbus_target_t
+    uint16_t target;                // смещение поля в структуре значений
+    float scale;                    // множитель к единицам поля
+}meters_modbus_reg_t;
+
+// Карта регистров модели. Записи упорядочены по функции и адресу,
+// соседние регистры с разрывом не больше max_gap читаются одним запросом
+typedef struct{
+    const meters_modbus_reg_t *regs;
+    uint32_t count;
+    uint16_t max_gap;
+}meters_modbus_map_t;
+
+#define METERS_MODBUS_REG(_function, _address, _format, _order, _type, _struct, _field, _scale) \
+    {                                                                   \
+        .address = (_address),                                          \
+        .function = (_function),                                        \
+        .format = (_format),                                            \
+        .order = (_order),                                              \
+        .target_type = (_type),                                         \
+        .target = offsetof(_struct, _field),                            \
+        .scale = (_scale),                                              \
+    }
+
+bool meters_modbus_is_meter_error(int32_t error);
+
+int32_t meters_modbus_read_map(meters_context_t *context, uint8_t id, uint32_t baudrate,
+                                const meters_modbus_map_t *map, void *values);
+
+int32_t meters_modbus_probe(meters_context_t *context, uint8_t id, uint32_t baudrate,
+                            uint8_t function, uint16_t address, uint32_t timeout_ms);
@@ -1,34 +1,362 @@
 #include "meters_poll485.h"
+#include "meters_trace.h"
 
 LOG_MODULE_DECLARE(meters2, CONFIG_STRIM_METERS2_LOG_LEVEL);
 
+K_MUTEX_DEFINE(meters_job_mutex);  // один запрос за раз, берут только вызывающие
+
+#if !CONFIG_STRIM_METERS2_POLL_SYSTEM_WORKQ
 static K_THREAD_STACK_DEFINE(meters_basestack, CONFIG_STRIM_METERS2_MAIN_STACK_SIZE);
+#endif
+
+#if CONFIG_STRIM_METERS2_BENCH
+static void meters_bench_delta(meters_bench_counters_t *delta, const meters_bench_counters_t *now,
+                            const meters_bench_counters_t *before)
+{
+    delta->busy_us = now->busy_us - before->busy_us;
+    delta->pause_us = now->pause_us - before->pause_us;
+    delta->timeout_us = now->timeout_us - before->timeout_us;
+    delta->frames_tx = now->frames_tx - before->frames_tx;
+    delta->bytes_tx = now->bytes_tx - before->bytes_tx;
+    delta->frames_rx = now->frames_rx - before->frames_rx;
+    delta->bytes_rx = now->bytes_rx - before->bytes_rx;
+}
+
+static void meters_bench_publish(meters_tools_context_t *tool, meters_bench_cycle_t *bench)
+{
+    meters_data_lock(tool);
+    {
+        bench->cycle = tool->bench_cycle.cycle + 1;
+        tool->bench_cycle = *bench;
+    }
+    meters_data_unlock(tool);
+}
+#endif
+
+static bool meters_poll485_is_backoff(const meters_item_t *item)
+{
+    return (item->link.backoff_ms != 0) &&
+        ((k_uptime_get_32() - item->backoff_timemark) < item->link.backoff_ms);
+}
+
+// Ошибка драйвера выключает из опроса только этот счетчик
+static void meters_poll485_failed(meters_context_t *context, uint32_t item_idx, int32_t ret)
+{
+    meters_tools_context_t *tool = context->tools;
+    meters_item_t *item = &context->items[item_idx];
+    uint32_t backoff = METERS_POLL485_BACKOFF_MIN_MS << MIN(item->failures, 16);
+
+    backoff = MIN(backoff, METERS_POLL485_BACKOFF_MAX_MS);
+    if(backoff != item->link.backoff_ms)
+        LOG_WRN("read meter %u error: %d, next try in %u ms", item_idx, ret, backoff);
+
+    item->failures++;
+    item->backoff_timemark = k_uptime_get_32();
+
+    meters_data_lock(tool);
+    {
+        item->link.driver_failures++;
+        item->link.driver_error = ret;
+        item->link.backoff_ms = backoff;
+    }
+    meters_data_unlock(tool);
+}
+
+static void meters_poll485_recovered(meters_context_t *context, uint32_t item_idx)
+{
+    meters_tools_context_t *tool = context->tools;
+    meters_item_t *item = &context->items[item_idx];
+
+    if(item->failures == 0)
+        return;
+
+    LOG_INF("meter %u recovered after %u errors", item_idx, item->failures);
+    item->failures = 0;
+
+    meters_data_lock(tool);
+    {
+        item->link.backoff_ms = 0;
+    }
+    meters_data_unlock(tool);
+}
+
+static void meters_poll485_cycle_done(meters_tools_context_t *tool)
+{
+    meters_data_lock(tool);
+    {
+        tool->poll_stats.cycles++;
+    }
+    meters_data_unlock(tool);
+}
+
+// Чтение одного счетчика, общее для потока опроса и очереди работ
+static int32_t meters_poll485_read(meters_context_t *context, uint32_t item_idx)
+{
+    meters_item_t *item = &context->items[item_idx];
+    meters_read_t read_func = context->parameters[item_idx].type->read;
+    int32_t ret;
+
+    item->poll_timemark = k_uptime_get_32();
+    context->tools->link_stats = &item->link;
+    METERS_TRACE("read", item_idx, 0);
+    uint32_t read_start = k_cycle_get_32();
+
+    ret = read_func(context, item_idx);
+
+    item->read_us = k_cyc_to_us_floor32(k_cycle_get_32() - read_start);
+    context->tools->link_stats = NULL;
+    METERS_TRACE("read_done", item_idx, ret);
+
+    if(ret != 0)
+        meters_poll485_failed(context, item_idx, ret);
+    else
+        meters_poll485_recovered(context, item_idx);
+
+    // любое чтение, и очередное тоже, отвечает всем ожидающим свежего значения
+    meters_data_lock(context->tools);
+    {
+        if(context->tools->fresh_pending & BIT(item_idx)){
+            context->tools->fresh_pending &= ~BIT(item_idx);
+            meters_fresh_wake(context->tools);
+        }
+    }
+    meters_data_unlock(context->tools);
+
+    return ret;
+}
+
+static void meters_poll485_serve_job(meters_context_t *context)
+{
+    meters_tools_context_t *tool = context->tools;
+    meters_job_t func;
+
+    meters_data_lock(tool);
+    {
+        func = tool->job;
+        tool->job = NULL;   // взят в работу, снять его уже нельзя
+        tool->is_job_running = (func != NULL);
+    }
+    meters_data_unlock(tool);
+
+    if(func == NULL)
+        return;
+
+    METERS_TRACE("job", 0, 0);
+    int32_t result = func(context, tool->job_data);
+    METERS_TRACE("job_done", 0, result);
+
+    meters_data_lock(tool);
+    {
+        tool->job_result = result;
+        tool->is_job_running = false;
+    }
+    meters_data_unlock(tool);
+    k_sem_give(&tool->job_done);
+}
+
+int32_t meters_poll485_job(meters_context_t *context, meters_job_t func, void *data, size_t size,
+                        k_timeout_t timeout)
+{
+    meters_tools_context_t *tool = context->tools;
+    k_timepoint_t end = sys_timepoint_calc(timeout);
+    bool is_withdrawn = false;
+    bool is_lost = false;
+    bool is_running;
+    int32_t ret;
+
+    if(tool == NULL)
+        return -ENODEV; // опрос не запущен
+
+    if(size > sizeof(tool->job_data))
+        return -ENOMEM;
+
+    if(k_mutex_lock(&meters_job_mutex, timeout) != 0)
+        return -EAGAIN;
+    {
+        meters_data_lock(tool);
+        {
+            is_running = tool->is_job_running;
+        }
+        meters_data_unlock(tool);
+
+        // прежний запрос брошен по таймауту и еще занимает job_data
+        if(is_running && (k_sem_take(&tool->job_done, sys_timepoint_timeout(end)) != 0)){
+            k_mutex_unlock(&meters_job_mutex);
+            return -EAGAIN;
+        }
+
+        memcpy(tool->job_data, data, size);
+        k_sem_reset(&tool->job_done);
+
+        meters_data_lock(tool);
+        {
+            tool->job = func;
+        }
+        meters_data_unlock(tool);
+
+#if CONFIG_STRIM_METERS2_POLL_THREAD
+        k_sem_give(&tool->poll_wake);
+#else
+        k_work_submit_to_queue(tool->poll_queue, &tool->job_work);
+#endif
+
+        if(k_sem_take(&tool->job_done, sys_timepoint_timeout(end)) != 0){
+            meters_data_lock(tool);
+            {
+                is_withdrawn = (tool->job != NULL);
+                tool->job = NULL;
+            }
+            meters_data_unlock(tool);
+
+            // запрос уже на линии: его ограничивают таймауты драйвера, а гибель потока - супервизор
+            if(!is_withdrawn && (k_sem_take(&tool->job_done, K_MSEC(METERS_POLL485_JOB_RUN_MS)) != 0)){
+                LOG_ERR("job still running after %u ms", METERS_POLL485_JOB_RUN_MS);
+                is_lost = true;
+            }
+        }
+
+        if(is_withdrawn){
+            ret = -EAGAIN;
+        }
+        else if(is_lost){
+            ret = -ETIMEDOUT;
+        }
+        else {
+            memcpy(data, tool->job_data, size);
+            ret = tool->job_result;
+        }
+    }
+    k_mutex_unlock(&meters_job_mutex);
+
+    return ret;
+}
+
+bool meters_poll485_job_running(meters_context_t *context)
+{
+    meters_tools_context_t *tool = context->tools;
+    bool is_running;
+
+    if(tool == NULL)
+        return false;
+
+    meters_data_lock(tool);
+    {
+        is_running = tool->is_job_running;
+    }
+    meters_data_unlock(tool);
+
+    return is_running;
+}
+
+#if CONFIG_STRIM_METERS2_POLL_THREAD
+void meters_poll485_cancel_jobs(meters_context_t *context)
+{
+    meters_tools_context_t *tool = context->tools;
+    bool is_pending;
+
+    meters_data_lock(tool);
+    {
+        is_pending = (tool->job != NULL) || tool->is_job_running;
+        tool->job = NULL;
+        tool->is_job_running = false;
+        if(is_pending)
+            tool->job_result = -ECANCELED;
+    }
+    meters_data_unlock(tool);
+
+    if(is_pending)
+        k_sem_give(&tool->job_done);
+}
+
+// Срочные чтения выполняются до следующего очередного
+static void meters_poll485_serve_urgent(meters_context_t *context)
+{
+    meters_tools_context_t *tool = context->tools;
+    uint32_t pending;
+
+    while(true){
+        meters_data_lock(tool);
+        {
+            pending = tool->fresh_pending;
+        }
+        meters_data_unlock(tool);
+
+        if(pending == 0)
+            return;
+
+        meters_poll485_read(context, find_lsb_set(pending) - 1);
+    }
+}
+
+// Срочные чтения и запросы выполняются и в паузе, не начиная нового цикла
+static void meters_poll485_pause(meters_context_t *context)
+{
+    meters_tools_context_t *tool = context->tools;
+    k_timepoint_t end = sys_timepoint_calc(K_MSEC(METERS_POLL485_PAUSE_MS));
+
+    while(k_sem_take(&tool->poll_wake, sys_timepoint_timeout(end)) == 0){
+        if(tool->reconfig_pending)
+            return;
+
+        meters_poll485_serve_urgent(context);
+        meters_poll485_serve_job(context);
+    }
+}
 
 static void meters_poll_bus485_thread(void *args0, void *args1, void *args2){
     meters_context_t *context = (meters_context_t*)args0;
     (void)args1;
     (void)args2;
 
-    int32_t ret = 0;
+#if CONFIG_STRIM_METERS2_BENCH
+    meters_tools_context_t *tool = context->tools;
+    meters_bench_cycle_t bench;
+#endif
+
+    context->tools->link_stats = NULL;  // после перезапуска мог остаться от погибшего потока
 
     while(true){
+#if CONFIG_STRIM_METERS2_BENCH
+        memset(&bench, 0, sizeof(bench));
+        uint32_t cycle_start = k_cycle_get_32();
+#endif
+
+        meters_reconfig_apply(context);
 
         for(uint32_t i = 0; i < context->item_count; i++){
-            meters_read_t read_func = meters_get_read_func(context->parameters[i].type);
-            if (read_func != NULL) {
-                ret = read_func(context, i);
-                if (ret != 0)
-                {
-                    LOG_ERR("read meter %d error: %d", i, ret);
-                    goto exit_poll485_thread;
-                }
-            }
+            // таблица сменилась: цикл начинается заново по новой
+            if(meters_reconfig_apply(context))
+                break;
+
+            meters_poll485_serve_urgent(context);
+            meters_poll485_serve_job(context);
+
+            meters_item_t *item = &context->items[i];
+            const meter_parameters_t *param = &context->parameters[i];
+
+            if((param->poll_period != 0) && 
+                ((k_uptime_get_32() - item->poll_timemark) < param->poll_period))
+                continue; //период опроса счетчика еще не прошел
+
+            if(meters_poll485_is_backoff(item) || (param->type->read == NULL))
+                continue;
+
+#if CONFIG_STRIM_METERS2_BENCH
+            meters_bench_counters_t before = tool->bench;
+            meters_poll485_read(context, i);
+            meters_bench_delta(&bench.items[i], &tool->bench, &before);
+            bench.wall_us[i] = item->read_us;
+#else
+            meters_poll485_read(context, i);
+#endif
         }
-        k_sleep(K_MSEC(1000));
+#if CONFIG_STRIM_METERS2_BENCH
+        bench.cycle_us = k_cyc_to_us_floor32(k_cycle_get_32() - cycle_start);
+        meters_bench_publish(tool, &bench);
+#endif
+        meters_poll485_cycle_done(context->tools);
+        meters_poll485_pause(context);
     }
-
-    exit_poll485_thread:
-    LOG_ERR("thread %s stopped", k_thread_name_get(k_current_get()));
 }
 
 k_tid_t meters_poll485_thread_run(meters_context_t *context){
@@ -39,8 +367,144 @@ k_tid_t meters_poll485_thread_run(meters_context_t *context){
 
     ret = k_thread_create(&context->tools->poll485_thread, context->tools->poll485_stack, context->tools->poll485_stack_size,
                     meters_poll_bus485_thread, context, NULL, NULL,
-                    CONFIG_STRIM_METERS2_INIT_PRIORITY, K_USER, K_NO_WAIT);
+                    CONFIG_STRIM_METERS2_MAIN_THREAD_PRIORITY, K_USER, K_NO_WAIT);
     
     k_thread_name_set(&context->tools->poll485_thread, "meters_bus485");
     return ret;
-}
\ No newline at end of file
+}
+
+void meters_poll485_kick(meters_context_t *context)
+{
+    // новая таблица применяется сразу, а не после паузы между циклами;
+    // k_wakeup не подходит, он прервал бы и выдержку тишины на линии
+    k_sem_give(&context->tools->poll_wake);
+}
+
+void meters_poll485_urgent(meters_context_t *context, uint32_t item_idx)
+{
+    ARG_UNUSED(item_idx);
+    k_sem_give(&context->tools->poll_wake);
+}
+#endif //CONFIG_STRIM_METERS2_POLL_THREAD
+
+#if CONFIG_STRIM_METERS2_POLL_WORKQ
+// Следующее чтение: после ошибок - через паузу отступа, иначе по периоду опроса
+static uint32_t meters_poll485_delay_ms(const meters_context_t *context, uint32_t item_idx)
+{
+    const meters_item_t *item = &context->items[item_idx];
+    uint32_t period = context->parameters[item_idx].poll_period;
+
+    if(item->link.backoff_ms != 0)
+        return item->link.backoff_ms;
+
+    if(period == 0)
+        period = METERS_POLL485_PAUSE_MS;
+
+    uint32_t elapsed = k_uptime_get_32() - item->poll_timemark;
+    return (elapsed < period) ? (period - elapsed) : 0;
+}
+
+// Каждая работа опрашивает счетчик со своим индексом в текущей таблице
+static void meters_poll485_work_handler(struct k_work *work)
+{
+    meters_context_t *context = &meters_context;
+    meters_tools_context_t *tool = context->tools;
+    struct k_work_delayable *poll_work = k_work_delayable_from_work(work);
+    uint32_t item_idx = poll_work - tool->poll_works;
+
+    if((item_idx >= context->item_count) || (context->parameters[item_idx].type->read == NULL))
+        return; // счетчик удален или задается извне
+
+    meters_poll485_read(context, item_idx);
+    meters_poll485_cycle_done(tool);
+
+    k_work_schedule_for_queue(tool->poll_queue, poll_work,
+                            K_MSEC(meters_poll485_delay_ms(context, item_idx)));
+}
+
+// Очередь выполняет работы по одной, запрос встает между чтениями счетчиков
+static void meters_poll485_job_handler(struct k_work *work)
+{
+    ARG_UNUSED(work);
+    meters_poll485_serve_job(&meters_context);
+}
+
+// Работы очереди выполняются по одной, поэтому таблица меняется между чтениями
+static void meters_poll485_reconfig_handler(struct k_work *work)
+{
+    meters_context_t *context = &meters_context;
+    meters_tools_context_t *tool = context->tools;
+
+    if(!meters_reconfig_apply(context))
+        return;
+
+    for(uint32_t i = 0; i < ARRAY_SIZE(tool->poll_works); i++){
+        if(i < context->item_count)
+            k_work_reschedule_for_queue(tool->poll_queue, &tool->poll_works[i], K_NO_WAIT);
+        else
+            k_work_cancel_delayable(&tool->poll_works[i]);
+    }
+}
+
+void meters_poll485_workq_run(meters_context_t *context)
+{
+    meters_tools_context_t *tool = context->tools;
+
+#if CONFIG_STRIM_METERS2_POLL_SYSTEM_WORKQ
+    tool->poll_queue = &k_sys_work_q;
+#else
+    const struct k_work_queue_config config = {.name = "meters_bus485"};
+
+    k_work_queue_init(&tool->poll_workq);
+    k_work_queue_start(&tool->poll_workq, meters_basestack, K_THREAD_STACK_SIZEOF(meters_basestack),
+                    CONFIG_STRIM_METERS2_MAIN_THREAD_PRIORITY, &config);
+    tool->poll_queue = &tool->poll_workq;
+#endif
+
+    k_work_init(&tool->reconfig_work, meters_poll485_reconfig_handler);
+    k_work_init(&tool->job_work, meters_poll485_job_handler);
+    for(uint32_t i = 0; i < ARRAY_SIZE(tool->poll_works); i++){
+        k_work_init_delayable(&tool->poll_works[i], meters_poll485_work_handler);
+        if(i < context->item_count)
+            k_work_schedule_for_queue(tool->poll_queue, &tool->poll_works[i], K_NO_WAIT);
+    }
+}
+
+void meters_poll485_kick(meters_context_t *context)
+{
+    k_work_submit_to_queue(context->tools->poll_queue, &context->tools->reconfig_work);
+}
+
+// Работа счетчика встает в очередь сразу, не дожидаясь периода опроса
+void meters_poll485_urgent(meters_context_t *context, uint32_t item_idx)
+{
+    meters_tools_context_t *tool = context->tools;
+
+    k_work_reschedule_for_queue(tool->poll_queue, &tool->poll_works[item_idx], K_NO_WAIT);
+}
+#endif //CONFIG_STRIM_METERS2_POLL_WORKQ
+
+void meters_poll485_stack_info(meters_context_t *context, uint32_t *size, uint32_t *unused)
+{
+    k_tid_t thread;
+
+#if CONFIG_STRIM_METERS2_POLL_THREAD
+    thread = &context->tools->poll485_thread;
+    *size = context->tools->poll485_stack_size;
+#elif CONFIG_STRIM_METERS2_POLL_SYSTEM_WORKQ
+    thread = k_work_queue_thread_get(&k_sys_work_q);
+    *size = CONFIG_SYSTEM_WORKQUEUE_STACK_SIZE;
+#else
+    thread = k_work_queue_thread_get(&context->tools->poll_workq);
+    *size = K_THREAD_STACK_SIZEOF(meters_basestack);
+#endif
+
+    *unused = 0;
+#if CONFIG_INIT_STACKS && CONFIG_THREAD_STACK_INFO
+    size_t space;
+    if(k_thread_stack_space_get(thread, &space) == 0)
+        *unused = space;
+#else
+    ARG_UNUSED(thread);
+#endif
+}
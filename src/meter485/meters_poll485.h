@@ -2,4 +2,45 @@
 
 #include "meters_private.h"
 
-k_tid_t meters_poll485_thread_run(meters_context_t *context);
\ No newline at end of file
+enum{METERS_POLL485_PAUSE_MS = 1000}; // пауза между циклами опроса
+
+// Пауза в опросе счетчика после ошибки драйвера удваивается с каждой ошибкой подряд
+enum{METERS_POLL485_BACKOFF_MIN_MS = 1000};
+enum{METERS_POLL485_BACKOFF_MAX_MS = 60000};
+
+// Взятый в работу запрос ограничен таймаутами драйвера; снимок всей линии - самый долгий
+enum{METERS_POLL485_JOB_RUN_MS = 60000};
+
+#if CONFIG_STRIM_METERS2_POLL_THREAD
+k_tid_t meters_poll485_thread_run(meters_context_t *context);
+#endif
+#if CONFIG_STRIM_METERS2_POLL_WORKQ
+void meters_poll485_workq_run(meters_context_t *context);
+#endif
+
+// Ускорить переход на новую таблицу счетчиков
+void meters_poll485_kick(meters_context_t *context);
+// Поставить срочное чтение счетчика, вызывается под data_access_mutex
+void meters_poll485_urgent(meters_context_t *context, uint32_t item_idx);
+
+/**
+ * Диагностический запрос на линию (shell) выполняется в контексте опроса
+ * между чтениями счетчиков, а не параллельно с ним: опрос задерживается
+ * не больше чем на один запрос, а запрос ждет не больше одного чтения.
+ * data копируется в память, доступную потоку опроса, и обратно.
+ * -EAGAIN - запрос не дождался очереди за timeout и снят.
+ * -ETIMEDOUT - взятый запрос не завершился за METERS_POLL485_JOB_RUN_MS,
+ * следующий запрос дождется его окончания.
+ * -ECANCELED - поток опроса погиб и перезапущен, запрос не выполнен.
+ */
+int32_t meters_poll485_job(meters_context_t *context, meters_job_t func, void *data, size_t size,
+                        k_timeout_t timeout);
+// Взятый запрос еще выполняется, в том числе брошенный с -ETIMEDOUT
+bool meters_poll485_job_running(meters_context_t *context);
+#if CONFIG_STRIM_METERS2_POLL_THREAD
+// Поток опроса погиб: ждущий запрос и взятый им завершаются с -ECANCELED
+void meters_poll485_cancel_jobs(meters_context_t *context);
+#endif
+
+// Размер стека контекста опроса и его нетронутая часть
+void meters_poll485_stack_info(meters_context_t *context, uint32_t *size, uint32_t *unused);
@@ -0,0 +1,110 @@
+#include "meters_scan.h"
+#include "meters_poll485.h"
+
+LOG_MODULE_DECLARE(meters2, CONFIG_STRIM_METERS2_LOG_LEVEL);
+
+typedef struct{
+    const meters_scan_info_t *scan;
+    uint32_t address;
+    uint32_t baudrate;
+    uint32_t timeout_ms;
+    uint32_t found_address;
+}meters_scan_probe_job_t;
+
+static int32_t meters_scan_probe_job(meters_context_t *context, void *data)
+{
+    meters_scan_probe_job_t *job = data;
+
+    return job->scan->probe(context, job->address, job->baudrate, job->timeout_ms, &job->found_address);
+}
+
+// Каждый запрос поиска - отдельное задание между чтениями счетчиков, опрос не останавливается
+static int32_t meters_scan_probe(meters_context_t *context, const meters_scan_info_t *scan,
+                                uint32_t address, uint32_t baudrate, uint32_t timeout_ms,
+                                uint32_t *found_address)
+{
+    meters_scan_probe_job_t job = {
+        .scan = scan,
+        .address = address,
+        .baudrate = baudrate,
+        .timeout_ms = timeout_ms,
+    };
+
+    int32_t ret = meters_poll485_job(context, meters_scan_probe_job, &job, sizeof(job), K_FOREVER);
+    *found_address = job.found_address;
+
+    return ret;
+}
+
+static void meters_scan_report(const meters_scan_config_t *config, meters_type_t type,
+                            uint32_t address, uint32_t baudrate)
+{
+    meters_scan_result_t result = {
+        .type = type,
+        .address = address,
+        .baudrate = baudrate,
+    };
+
+    LOG_INF("scan: %s %u found at %u", type->name, address, baudrate);
+
+    if(config->callback != NULL)
+        config->callback(&result, config->user_data);
+}
+
+static int32_t meters_scan_baudrate(meters_context_t *context, const meters_scan_config_t *config,
+                                    meters_type_t type, uint32_t baudrate)
+{
+    const meters_scan_info_t *scan = type->scan;
+    uint32_t found_address;
+    int32_t found = 0;
+    int32_t ret;
+
+    if(scan->has_wildcard){
+        ret = meters_scan_probe(context, scan, scan->wildcard_address, baudrate, config->timeout_ms,
+                            &found_address);
+        if(ret == 0){
+            // ответил ровно один счетчик, перебор не нужен
+            meters_scan_report(config, type, found_address, baudrate);
+            return 1;
+        }
+
+        if(ret == -ETIMEDOUT)
+            return 0; // на этой скорости счетчиков протокола нет
+
+        // ответы нескольких счетчиков наложились, ищем перебором
+        if(scan->address_min > scan->address_max){
+            LOG_WRN("scan: %s collision at %u, sweep not supported", type->name, baudrate);
+            return 0;
+        }
+    }
+
+    for(uint32_t address = scan->address_min; address <= scan->address_max; address++){
+        ret = meters_scan_probe(context, scan, address, baudrate, config->timeout_ms, &found_address);
+        if(ret == 0){
+            meters_scan_report(config, type, found_address, baudrate);
+            found++;
+        }
+    }
+
+    return found;
+}
+
+int32_t meters_scan(meters_context_t *context, const meters_scan_config_t *config)
+{
+    int32_t found = 0;
+
+    STRUCT_SECTION_FOREACH(meters_driver, driver){
+        if((driver->scan == NULL) || ((config->type != NULL) && (config->type != driver)))
+            continue;
+
+        for(uint32_t i = 0; i < driver->scan->baudrate_count; i++){
+            uint32_t baudrate = driver->scan->baudrates[i];
+            if((config->baudrate != 0) && (config->baudrate != baudrate))
+                continue;
+
+            found += meters_scan_baudrate(context, config, driver, baudrate);
+        }
+    }
+
+    return found;
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include "meters_private.h"
+
+typedef struct{
+    meters_type_t type;
+    uint32_t address;
+    uint32_t baudrate;
+}meters_scan_result_t;
+
+typedef void (*meters_scan_cb_t)(const meters_scan_result_t *result, void *user_data);
+
+typedef struct{
+    meters_type_t type;         // NULL - все протоколы с поддержкой поиска
+    uint32_t baudrate;          // 0 - все скорости из описания драйвера
+    uint32_t timeout_ms;        // ожидание ответа на один запрос
+    meters_scan_cb_t callback;
+    void *user_data;
+}meters_scan_config_t;
+
+int32_t meters_scan(meters_context_t *context, const meters_scan_config_t *config);
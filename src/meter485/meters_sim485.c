@@ -0,0 +1,793 @@
+#include "meters_sim485.h"
+#include "meters_bus485.h"
+#if CONFIG_STRIM_METERS2_CAPTURE
+#include "meters_capture.h"
+#endif
+#include <zephyr/sys/crc.h>
+#include <string.h>
+
+LOG_MODULE_DECLARE(meters2, CONFIG_STRIM_METERS2_LOG_LEVEL);
+
+enum{SIM485_FRAME_MAX_SIZE = 256};
+enum{SIM485_DATA_MAX_SIZE = 64};
+
+// SMP (CE318)
+enum{SIM485_SMP_END = 0xC0};
+enum{SIM485_SMP_ESC = 0xDB};
+enum{SIM485_SMP_ESC_END = 0xDC};
+enum{SIM485_SMP_ESC_ESC = 0xDD};
+enum{SIM485_SMP_PROTOCOL_ID = 6};
+enum{SIM485_SMP_COMMAND_DATA = 6};
+enum{SIM485_SMP_COMMAND_ERROR = 7};
+enum{SIM485_SMP_HEADER_SIZE = 7};  // протокол, адрес, команда
+enum{SIM485_SMP_QUERY_ECHO = 3};   // ответ повторяет начало запроса
+enum{SIM485_SMP_CRC_POLY = 0x8005};
+enum{SIM485_DFF_FLAG = 0x80};
+
+// Mercury
+enum{SIM485_MERCURY_SESSION_TIMEOUT_MS = 240000}; // сессия закрывается без обмена
+enum{SIM485_MERCURY_BLOCK_SIZE = 33};
+enum{SIM485_MERCURY_ENERGY_SIZE = 16};
+
+// Modbus RTU (SPM90)
+enum{SIM485_MODBUS_REQUEST_SIZE = 8};
+enum{SIM485_MODBUS_REGS_MAX = 125};
+enum{SIM485_MODBUS_EXCEPTION = 0x80};
+enum{SIM485_SPM90_REG_COUNT = 6};
+
+typedef struct sim485_meter sim485_meter_t;
+
+// Ответ счетчика на запрос: длина ответа или 0, если счетчик молчит
+typedef int32_t (*sim485_respond_t)(sim485_meter_t *meter, const uint8_t *request,
+                                    size_t length, uint8_t *response);
+
+typedef struct{
+    const char *id;     // id драйвера, протокол которого эмулируется
+    sim485_respond_t respond;
+}sim485_model_t;
+
+struct sim485_meter{
+    const sim485_model_t *model;
+    uint32_t address;
+    uint32_t baudrate;
+    meters_values_t values;
+    uint32_t is_session_open;
+    int64_t session_timemark;
+    meters_sim485_block_t mercury_block;
+};
+
+typedef struct{
+    sim485_meter_t meters[CONFIG_STRIM_METERS2_BUS485_SIM_METERS_MAX_COUNT];
+    uint32_t meter_count;
+    meters_sim485_faults_t faults;
+    uint32_t baudrate;
+    uint32_t random;
+    uint8_t response[SIM485_FRAME_MAX_SIZE];
+    size_t response_length;
+    size_t response_offset;
+    int64_t response_start;     // тик начала передачи ответа
+    bool is_oops_armed;         // следующий запрос роняет поток опроса
+#if CONFIG_STRIM_METERS2_CAPTURE
+    meters_sim485_replay_t replay;
+#endif
+}sim485_context_t;
+
+static METERS_APP_BMEM sim485_context_t sim485;
+// семафор, а не мьютекс: линию погибшего потока опроса освобождает супервизор
+K_SEM_DEFINE(meters_sim485_sem, 1, 1);
+
+static uint32_t sim485_random(void)
+{
+    // xorshift32, последовательность неисправностей повторяется от запуска к запуску
+    uint32_t x = (sim485.random != 0) ? sim485.random : 0x2545F491;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    sim485.random = x;
+
+    return x;
+}
+
+static bool sim485_chance(uint32_t permille)
+{
+    return (permille != 0) && ((sim485_random() % 1000) < permille);
+}
+
+static int64_t sim485_chars_ticks(uint32_t count)
+{
+    uint64_t us = DIV_ROUND_UP((uint64_t)count * METERS_BUS485_CHAR_BITS * USEC_PER_SEC,
+                                sim485.baudrate);
+    return (int64_t)k_us_to_ticks_ceil64(us);
+}
+
+static void sim485_sleep_until(int64_t ticks)
+{
+    int64_t delay = ticks - k_uptime_ticks();
+    if(delay > 0)
+        k_sleep(K_TICKS(delay));
+}
+
+static int64_t sim485_scale(float value, float scale)
+{
+    value *= scale;
+    return (int64_t)((value < 0) ? (value - 0.5f) : (value + 0.5f));
+}
+
+// CE318, протокол SMP
+
+static int32_t sim485_smp_unescape(const uint8_t *src, size_t length, uint8_t *dest)
+{
+    size_t size = 0;
+
+    if((length < 2) || (src[0] != SIM485_SMP_END) || (src[length - 1] != SIM485_SMP_END))
+        return -EBADMSG;
+
+    for(size_t i = 1; i < (length - 1); i++){
+        if(size >= SIM485_FRAME_MAX_SIZE)
+            return -EMSGSIZE;
+
+        if(src[i] != SIM485_SMP_ESC){
+            dest[size++] = src[i];
+            continue;
+        }
+
+        if(++i >= (length - 1))
+            return -EBADMSG;
+
+        dest[size++] = (src[i] == SIM485_SMP_ESC_END) ? SIM485_SMP_END : SIM485_SMP_ESC;
+    }
+
+    return size;
+}
+
+static size_t sim485_smp_escape(const uint8_t *src, size_t length, uint8_t *dest)
+{
+    size_t size = 0;
+
+    for(size_t i = 0; i < length; i++){
+        if(src[i] == SIM485_SMP_END){
+            dest[size++] = SIM485_SMP_ESC;
+            dest[size++] = SIM485_SMP_ESC_END;
+        }
+        else if(src[i] == SIM485_SMP_ESC){
+            dest[size++] = SIM485_SMP_ESC;
+            dest[size++] = SIM485_SMP_ESC_ESC;
+        }
+        else
+            dest[size++] = src[i];
+    }
+
+    return size;
+}
+
+// Поле DFF: по 7 бит начиная с младших, старший бит - признак продолжения
+static size_t sim485_dff_put(uint8_t *dest, int64_t value, bool is_signed)
+{
+    size_t size = 0;
+
+    while(true){
+        uint8_t byte = value & 0x7F;
+        value >>= 7;
+
+        bool is_last = (value == 0) && (!is_signed || !(byte & 0x40));
+        if(is_signed && (value == -1) && (byte & 0x40))
+            is_last = true;
+
+        dest[size++] = is_last ? byte : (byte | SIM485_DFF_FLAG);
+        if(is_last)
+            return size;
+    }
+}
+
+static size_t sim485_ce318_data(const sim485_meter_t *meter, const uint8_t *query, uint8_t *data)
+{
+    const meters_values_ac_t *ac = &meter->values.AC;
+    size_t size = SIM485_SMP_QUERY_ECHO;
+
+    memcpy(data, query, SIM485_SMP_QUERY_ECHO);
+
+    switch((query[0] << 8) | query[2]){
+        case (1 << 8) | 1:  // энергия A+ в десятитысячных кВт*ч
+            size += sim485_dff_put(&data[size], ac->energy_active / 360, false);
+            break;
+        case (1 << 8) | 32: // напряжение батареи
+            size += sim485_dff_put(&data[size], 310, false);
+            break;
+        case (10 << 8) | 14: // активная мощность в Вт
+            size += sim485_dff_put(&data[size], sim485_scale(ac->power_active, 1.0f), false);
+            break;
+        case (10 << 8) | 22: // токи фаз в мА
+            for(uint32_t i = 0; i < 3; i++)
+                size += sim485_dff_put(&data[size], sim485_scale(ac->current[i], 1000.0f), true);
+            break;
+        case (10 << 8) | 24: // напряжения фаз в сотых долях вольта
+            for(uint32_t i = 0; i < 3; i++)
+                size += sim485_dff_put(&data[size], sim485_scale(ac->voltage[i], 100.0f), true);
+            break;
+        default:
+            return 0;
+    }
+
+    return size;
+}
+
+static int32_t sim485_ce318_respond(sim485_meter_t *meter, const uint8_t *request,
+                                    size_t length, uint8_t *response)
+{
+    uint8_t pack[SIM485_FRAME_MAX_SIZE];
+    int32_t size = sim485_smp_unescape(request, length, pack);
+
+    if(size < (int32_t)(SIM485_SMP_HEADER_SIZE + SIM485_SMP_QUERY_ECHO + sizeof(uint16_t)))
+        return 0;
+
+    if(crc16(SIM485_SMP_CRC_POLY, 0, pack, size - 2) != sys_get_be16(&pack[size - 2]))
+        return 0;
+
+    uint32_t address = sys_get_le32(&pack[1]);
+    if((pack[0] != SIM485_SMP_PROTOCOL_ID) || ((address != 0) && (address != meter->address)))
+        return 0;
+
+    uint8_t answer[SIM485_SMP_HEADER_SIZE + SIM485_DATA_MAX_SIZE + sizeof(uint16_t)] = {
+        SIM485_SMP_PROTOCOL_ID
+    };
+    sys_put_le32(meter->address, &answer[1]);
+
+    size_t count = sim485_ce318_data(meter, &pack[SIM485_SMP_HEADER_SIZE],
+                                    &answer[SIM485_SMP_HEADER_SIZE]);
+    if(count == 0){
+        answer[SIM485_SMP_HEADER_SIZE - 1] = SIM485_SMP_COMMAND_ERROR;
+        answer[SIM485_SMP_HEADER_SIZE] = pack[SIM485_SMP_HEADER_SIZE];
+        count = 1;
+    }
+    else
+        answer[SIM485_SMP_HEADER_SIZE - 1] = SIM485_SMP_COMMAND_DATA;
+
+    count += SIM485_SMP_HEADER_SIZE;
+    sys_put_be16(crc16(SIM485_SMP_CRC_POLY, 0, answer, count), &answer[count]);
+    count += sizeof(uint16_t);
+
+    size = 0;
+    response[size++] = SIM485_SMP_END;
+    size += sim485_smp_escape(answer, count, &response[size]);
+    response[size++] = SIM485_SMP_END;
+
+    return size;
+}
+
+// Mercury 234
+
+// Упакованное 3-байтное значение: старший байт, затем младший и средний
+static void sim485_mercury_pack3(uint8_t *dest, int64_t value)
+{
+    uint32_t raw = (uint32_t)CLAMP(value, 0, 0x3FFFFF);
+
+    dest[0] = (raw >> 16) & 0xFF;
+    dest[1] = raw & 0xFF;
+    dest[2] = (raw >> 8) & 0xFF;
+}
+
+static size_t sim485_mercury_data(const sim485_meter_t *meter, const uint8_t *cmd,
+                                size_t length, uint8_t *data)
+{
+    const meters_values_ac_t *ac = &meter->values.AC;
+
+    if((length != 3) || ((cmd[0] != 0x05) && (cmd[0] != 0x08)))
+        return 0;
+
+    switch((cmd[0] << 16) | (cmd[1] << 8) | cmd[2]){
+        case 0x050000:{ // энергия от сброса по сумме тарифов, Вт*ч
+            uint32_t energy_wh = ac->energy_active / 3600;
+            memset(data, 0, SIM485_MERCURY_ENERGY_SIZE);
+            data[0] = (energy_wh >> 16) & 0xFF;
+            data[1] = (energy_wh >> 24) & 0xFF;
+            data[2] = energy_wh & 0xFF;
+            data[3] = (energy_wh >> 8) & 0xFF;
+            return SIM485_MERCURY_ENERGY_SIZE;
+        }
+        case 0x081400:{ // массив вспомогательных параметров
+            // раскладка повторяет ожидаемую драйвером, драйвер сам сверяет ее с поштучными
+            // запросами; чужая раскладка меняет местами напряжения и токи
+            bool is_foreign = (meter->mercury_block == meters_sim485_block_foreign);
+            if(meter->mercury_block == meters_sim485_block_rejected)
+                return 0;
+
+            memset(data, 0, SIM485_MERCURY_BLOCK_SIZE);
+            sim485_mercury_pack3(&data[0], sim485_scale(ac->power_active, 100.0f));
+            for(uint32_t i = 0; i < 3; i++){
+                sim485_mercury_pack3(&data[3 + (3 * i)], sim485_scale(ac->power_active, 100.0f / 3));
+                sim485_mercury_pack3(&data[(is_foreign ? 21 : 12) + (3 * i)], sim485_scale(ac->voltage[i], 100.0f));
+                sim485_mercury_pack3(&data[(is_foreign ? 12 : 21) + (3 * i)], sim485_scale(ac->current[i], 1000.0f));
+            }
+            sim485_mercury_pack3(&data[30], sim485_scale(ac->frequency, 100.0f));
+            return SIM485_MERCURY_BLOCK_SIZE;
+        }
+        case 0x081100:
+            sim485_mercury_pack3(data, sim485_scale(ac->power_active, 100.0f));
+            return 3;
+        case 0x081140:
+            sim485_mercury_pack3(data, sim485_scale(ac->frequency, 100.0f));
+            return 3;
+        case 0x081611:
+            for(uint32_t i = 0; i < 3; i++)
+                sim485_mercury_pack3(&data[3 * i], sim485_scale(ac->voltage[i], 100.0f));
+            return 9;
+        case 0x081621:
+            for(uint32_t i = 0; i < 3; i++)
+                sim485_mercury_pack3(&data[3 * i], sim485_scale(ac->current[i], 1000.0f));
+            return 9;
+        default:
+            return 0;
+    }
+}
+
+static int32_t sim485_mercury_respond(sim485_meter_t *meter, const uint8_t *request,
+                                    size_t length, uint8_t *response)
+{
+    if(length < 4)
+        return 0;
+
+    if(crc16_reflect(0xA001, 0xFFFF, request, length - 2) != sys_get_le16(&request[length - 2]))
+        return 0;
+
+    if((request[0] != 0) && (request[0] != meter->address))
+        return 0;
+
+    const uint8_t *cmd = &request[1];
+    size_t cmd_length = length - 3;
+    int64_t now = k_uptime_get();
+    size_t count = 1;
+
+    if(meter->is_session_open && ((now - meter->session_timemark) > SIM485_MERCURY_SESSION_TIMEOUT_MS))
+        meter->is_session_open = false;
+
+    response[0] = meter->address;
+    response[1] = 0x00; // байт состояния
+
+    switch(cmd[0]){
+        case 0x00: // проверка связи
+            break;
+        case 0x01: // открытие сессии первого уровня с паролем по умолчанию
+            if((cmd_length == 8) && (cmd[1] == 0x01) && (memcmp(&cmd[2], "111111", 6) == 0)){
+                meter->is_session_open = true;
+                meter->session_timemark = now;
+            }
+            else
+                response[1] = 0x03;
+            break;
+        default:
+            if(!meter->is_session_open){
+                response[1] = 0x05;
+                break;
+            }
+
+            meter->session_timemark = now;
+            count = sim485_mercury_data(meter, cmd, cmd_length, &response[1]);
+            if(count == 0){
+                response[1] = 0x01;
+                count = 1;
+            }
+            break;
+    }
+
+    count++;
+    sys_put_le16(crc16_reflect(0xA001, 0xFFFF, response, count), &response[count]);
+
+    return count + sizeof(uint16_t);
+}
+
+// SPM90, Modbus RTU
+
+static int32_t sim485_spm90_respond(sim485_meter_t *meter, const uint8_t *request,
+                                    size_t length, uint8_t *response)
+{
+    if(length != SIM485_MODBUS_REQUEST_SIZE)
+        return 0;
+
+    if(crc16_reflect(0xA001, 0xFFFF, request, length - 2) != sys_get_le16(&request[length - 2]))
+        return 0;
+
+    // на широковещательный запрос Modbus RTU не отвечают
+    if(request[0] != meter->address)
+        return 0;
+
+    const meters_values_dc_t *dc = &meter->values.DC;
+    uint16_t regs[SIM485_SPM90_REG_COUNT];
+    uint32_t power = sim485_scale(dc->power, 10.0f);
+    uint32_t energy = dc->energy / 36000; // десятки Вт*ч
+
+    regs[0] = sim485_scale(dc->voltage, 10.0f);
+    regs[1] = sim485_scale(dc->current, 100.0f);
+    regs[2] = power >> 16;
+    regs[3] = power & 0xFFFF;
+    regs[4] = energy >> 16;
+    regs[5] = energy & 0xFFFF;
+
+    uint8_t function = request[1];
+    uint16_t start = sys_get_be16(&request[2]);
+    uint16_t count = sys_get_be16(&request[4]);
+    size_t size = 0;
+
+    response[size++] = meter->address;
+
+    if(function != 0x03){
+        response[size++] = function | SIM485_MODBUS_EXCEPTION;
+        response[size++] = 0x01; // функция не поддерживается
+    }
+    else if((count == 0) || (count > SIM485_MODBUS_REGS_MAX) ||
+            ((start + count) > SIM485_SPM90_REG_COUNT)){
+        response[size++] = function | SIM485_MODBUS_EXCEPTION;
+        response[size++] = 0x02; // недопустимый адрес регистра
+    }
+    else {
+        response[size++] = function;
+        response[size++] = count * 2;
+        for(uint16_t i = 0; i < count; i++){
+            sys_put_be16(regs[start + i], &response[size]);
+            size += 2;
+        }
+    }
+
+    sys_put_le16(crc16_reflect(0xA001, 0xFFFF, response, size), &response[size]);
+
+    return size + sizeof(uint16_t);
+}
+
+static const sim485_model_t sim485_models[] = {
+    {.id = "ce318", .respond = sim485_ce318_respond},
+    {.id = "mercury234", .respond = sim485_mercury_respond},
+    {.id = "spm90", .respond = sim485_spm90_respond},
+};
+
+static const sim485_model_t * sim485_find_model(meters_type_t type)
+{
+    for(uint32_t i = 0; i < ARRAY_SIZE(sim485_models); i++){
+        if(strcmp(sim485_models[i].id, type->id) == 0)
+            return &sim485_models[i];
+    }
+    return NULL;
+}
+
+int32_t meters_sim485_add(meters_type_t type, uint32_t address, uint32_t baudrate)
+{
+    int32_t ret;
+
+    if(!meters_is_type_registered(type))
+        return -EINVAL;
+
+    const sim485_model_t *model = sim485_find_model(type);
+    if(model == NULL)
+        return -ENOTSUP;
+
+    k_sem_take(&meters_sim485_sem, K_FOREVER);
+    {
+        if(sim485.meter_count >= ARRAY_SIZE(sim485.meters)){
+            ret = -ENOMEM;
+        }
+        else {
+            sim485_meter_t *meter = &sim485.meters[sim485.meter_count];
+
+            memset(meter, 0, sizeof(*meter));
+            meter->model = model;
+            meter->address = address;
+            meter->baudrate = baudrate;
+            meter->values.type = type->values_type;
+            ret = sim485.meter_count++;
+        }
+    }
+    k_sem_give(&meters_sim485_sem);
+
+    return ret;
+}
+
+int32_t meters_sim485_set_values(uint32_t index, const meters_values_t *values)
+{
+    int32_t ret = 0;
+
+    k_sem_take(&meters_sim485_sem, K_FOREVER);
+    {
+        if(index >= sim485.meter_count)
+            ret = -ERANGE;
+        else if(values->type != sim485.meters[index].values.type)
+            ret = -EINVAL;
+        else
+            sim485.meters[index].values = *values;
+    }
+    k_sem_give(&meters_sim485_sem);
+
+    return ret;
+}
+
+uint32_t meters_sim485_get_count(void)
+{
+    return sim485.meter_count;
+}
+
+void meters_sim485_clear(void)
+{
+    k_sem_take(&meters_sim485_sem, K_FOREVER);
+    {
+        sim485.meter_count = 0;
+        sim485.response_length = 0;
+    }
+    k_sem_give(&meters_sim485_sem);
+}
+
+// Правдоподобные значения, различающиеся от счетчика к счетчику
+static void sim485_default_values(meters_values_t *values, uint32_t index)
+{
+    if(values->type == meters_current_type_ac){
+        meters_values_ac_t *ac = &values->AC;
+
+        ac->power_active = 0;
+        for(uint32_t i = 0; i < 3; i++){
+            ac->voltage[i] = 230.0f + index + i;
+            ac->current[i] = 5.0f + i;
+            ac->power_active += ac->voltage[i] * ac->current[i];
+        }
+        ac->frequency = 50.0f;
+        ac->energy_active = (uint64_t)(index + 1) * 1000 * 3600 * 1000; // 1000 кВт*ч
+    }
+    else {
+        meters_values_dc_t *dc = &values->DC;
+
+        dc->voltage = 400.0f + index;
+        dc->current = 10.0f;
+        dc->power = dc->voltage * dc->current;
+        dc->energy = (uint64_t)(index + 1) * 100 * 3600 * 1000; // 100 кВт*ч
+    }
+}
+
+void meters_sim485_populate(const meter_parameters_t *params, uint32_t count)
+{
+    for(uint32_t i = 0; i < count; i++){
+        if(sim485_find_model(params[i].type) == NULL)
+            continue;
+
+        int32_t index = meters_sim485_add(params[i].type, params[i].address, params[i].baudrate);
+        if(index < 0){
+            LOG_WRN("sim485: meter %u not emulated: %d", i, index);
+            continue;
+        }
+
+        meters_values_t values = {.type = params[i].type->values_type};
+        sim485_default_values(&values, i);
+        meters_sim485_set_values(index, &values);
+    }
+}
+
+int32_t meters_sim485_set_mercury_block(uint32_t index, meters_sim485_block_t mode)
+{
+    int32_t ret = 0;
+
+    k_sem_take(&meters_sim485_sem, K_FOREVER);
+    {
+        if(index >= sim485.meter_count)
+            ret = -ERANGE;
+        else if(sim485.meters[index].model->respond != sim485_mercury_respond)
+            ret = -EINVAL;
+        else
+            sim485.meters[index].mercury_block = mode;
+    }
+    k_sem_give(&meters_sim485_sem);
+
+    return ret;
+}
+
+void meters_sim485_set_faults(const meters_sim485_faults_t *faults)
+{
+    k_sem_take(&meters_sim485_sem, K_FOREVER);
+    {
+        sim485.faults = *faults;
+    }
+    k_sem_give(&meters_sim485_sem);
+}
+
+void meters_sim485_get_faults(meters_sim485_faults_t *faults)
+{
+    *faults = sim485.faults;
+}
+
+void meters_sim485_oops(void)
+{
+    sim485.is_oops_armed = true;
+}
+
+void meters_sim485_grant(k_tid_t thread)
+{
+#if CONFIG_USERSPACE
+    k_object_access_grant(&meters_sim485_sem, thread);
+#else
+    ARG_UNUSED(thread);
+#endif
+}
+
+void meters_sim485_lock(void)
+{
+    k_sem_take(&meters_sim485_sem, K_FOREVER);
+}
+
+int32_t meters_sim485_release(void)
+{
+    k_sem_give(&meters_sim485_sem);
+    return 0;
+}
+
+int32_t meters_sim485_set_baudrate(uint32_t baudrate)
+{
+    if(baudrate == 0)
+        return -EINVAL;
+
+    sim485.baudrate = baudrate;
+    return 0;
+}
+
+void meters_sim485_flush(void)
+{
+    sim485.response_length = 0;
+    sim485.response_offset = 0;
+}
+
+#if CONFIG_STRIM_METERS2_CAPTURE
+void meters_sim485_replay_start(void)
+{
+    // кадры воспроизведения не должны попадать в то же кольцо
+    meters_capture_set_enabled(false);
+
+    k_sem_take(&meters_sim485_sem, K_FOREVER);
+    {
+        memset(&sim485.replay, 0, sizeof(sim485.replay));
+        sim485.replay.is_active = true;
+    }
+    k_sem_give(&meters_sim485_sem);
+}
+
+void meters_sim485_replay_stop(void)
+{
+    sim485.replay.is_active = false;
+}
+
+void meters_sim485_get_replay(meters_sim485_replay_t *replay)
+{
+    *replay = sim485.replay;
+}
+
+// Ответ из записи: следующий записанный такой же запрос и принятые после него части
+static void sim485_replay_respond(const uint8_t *request, size_t length)
+{
+    meters_capture_record_t record;
+    uint32_t offset = sim485.replay.offset;
+    int32_t ret;
+
+    while(true){
+        ret = meters_capture_get(&offset, &record, sim485.response, sizeof(sim485.response));
+        if((ret == -ENODATA) || (ret == -EBADMSG)){
+            sim485.replay.misses++;
+            return;     // такого запроса в записи больше нет, счетчик молчит
+        }
+
+        if((ret == (int32_t)length) && (record.direction == meters_capture_tx) &&
+            (record.baudrate == sim485.baudrate) && (memcmp(sim485.response, request, length) == 0))
+            break;
+    }
+
+    uint32_t request_us = record.timestamp_us;
+    int64_t start = k_uptime_ticks();
+    bool is_first = true;
+
+    while(true){
+        uint32_t next = offset;
+
+        ret = meters_capture_get(&next, &record, &sim485.response[sim485.response_length],
+                                sizeof(sim485.response) - sim485.response_length);
+        if((ret <= 0) || (record.direction != meters_capture_rx))
+            break;
+
+        // первая часть принята целиком к моменту записи, ответ начался раньше
+        if(is_first){
+            int32_t delay_us = (int32_t)(record.timestamp_us - request_us);
+            start += k_us_to_ticks_ceil64(MAX(delay_us, 0)) - sim485_chars_ticks(ret);
+            is_first = false;
+        }
+
+        sim485.response_length += ret;
+        offset = next;
+    }
+
+    sim485.replay.offset = offset;
+    sim485.replay.requests++;
+    sim485.response_start = MAX(start, k_uptime_ticks());
+}
+#endif
+
+int32_t meters_sim485_send(const uint8_t *data, size_t length)
+{
+    uint8_t frame[SIM485_FRAME_MAX_SIZE];
+    uint32_t answers = 0;
+
+    if(sim485.baudrate == 0)
+        return -EINVAL;
+
+    // поток опроса гибнет, держа линию, как при нарушении доступа в драйвере
+    if(sim485.is_oops_armed){
+        sim485.is_oops_armed = false;
+        k_oops();
+    }
+
+    // запрос уходит в линию с реальной скоростью
+    sim485_sleep_until(k_uptime_ticks() + sim485_chars_ticks(length));
+
+    sim485.response_length = 0;
+    sim485.response_offset = 0;
+
+#if CONFIG_STRIM_METERS2_CAPTURE
+    if(sim485.replay.is_active){
+        sim485_replay_respond(data, length);
+        return length;
+    }
+#endif
+
+    for(uint32_t i = 0; i < sim485.meter_count; i++){
+        sim485_meter_t *meter = &sim485.meters[i];
+
+        if(meter->baudrate != sim485.baudrate)
+            continue; // на чужой скорости счетчик видит только мусор
+
+        int32_t size = meter->model->respond(meter, data, length, frame);
+        if(size <= 0)
+            continue;
+
+        // одновременные ответы накладываются, на линии побеждает ноль
+        for(size_t j = 0; j < size; j++)
+            sim485.response[j] = (j < sim485.response_length) ? (sim485.response[j] & frame[j]) : frame[j];
+
+        sim485.response_length = MAX(sim485.response_length, size);
+        answers++;
+    }
+
+    if(answers == 0)
+        return length;
+
+    if(sim485_chance(sim485.faults.drop_permille)){
+        LOG_DBG("sim485: response dropped");
+        sim485.response_length = 0;
+        return length;
+    }
+
+    if(sim485_chance(sim485.faults.corrupt_permille)){
+        uint32_t random = sim485_random();
+        sim485.response[random % sim485.response_length] ^= BIT((random >> 16) % 8);
+        LOG_DBG("sim485: response corrupted");
+    }
+
+    sim485.response_start = k_uptime_ticks() + k_ms_to_ticks_ceil64(sim485.faults.latency_ms);
+
+    return length;
+}
+
+int32_t meters_sim485_recv(uint8_t *data, size_t size, uint32_t timeout_ms)
+{
+    int64_t deadline = k_uptime_ticks() + k_ms_to_ticks_ceil64(timeout_ms);
+    size_t offset = sim485.response_offset;
+    size_t count = MIN(size, sim485.response_length - offset);
+
+    if(sim485.faults.split_size != 0)
+        count = MIN(count, sim485.faults.split_size);
+
+    // байт ответа доступен после передачи всех предыдущих символов
+    while((count > 0) &&
+        ((sim485.response_start + sim485_chars_ticks(offset + count)) > deadline))
+        count--;
+
+    if(count == 0){
+        sim485_sleep_until(deadline);
+        return -ETIMEDOUT;
+    }
+
+    sim485_sleep_until(sim485.response_start + sim485_chars_ticks(offset + count));
+
+    memcpy(data, &sim485.response[offset], count);
+    sim485.response_offset += count;
+
+    return count;
+}
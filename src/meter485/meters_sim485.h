@@ -0,0 +1,58 @@
+#pragma once
+
+#include "meters_private.h"
+
+// Неисправности линии, вносимые эмулятором
+typedef struct{
+    uint32_t latency_ms;        // задержка ответа после последнего байта запроса
+    uint32_t drop_permille;     // доля потерянных ответов, промилле
+    uint32_t corrupt_permille;  // доля ответов с искаженным битом, промилле
+    uint32_t split_size;        // байт за один прием, 0 - ответ целиком
+}meters_sim485_faults_t;
+
+// Ответ эмулятора Mercury на запрос массива параметров 0x08 0x14
+typedef enum{
+    meters_sim485_block_native = 0, // раскладка, которую ожидает драйвер
+    meters_sim485_block_rejected,   // состояние 0x01, запрос не поддерживается
+    meters_sim485_block_foreign,    // другая раскладка той же длины
+}meters_sim485_block_t;
+
+// Воспроизведение записи кольца meters_capture вместо эмуляторов
+typedef struct{
+    bool is_active;
+    uint32_t offset;    // позиция в записи
+    uint32_t requests;  // запросов, найденных в записи
+    uint32_t misses;    // запросов, которых в записи нет
+}meters_sim485_replay_t;
+
+/**
+ * Эмулятор линии RS485 со счетчиками CE318, Mercury 234 и SPM90. Заменяет
+ * устройство bus485 на транспортном уровне, поэтому драйверы работают с
+ * ним без изменений. Счетчик отвечает только на своей скорости, время
+ * передачи кадров соответствует скорости линии.
+ */
+int32_t meters_sim485_add(meters_type_t type, uint32_t address, uint32_t baudrate);
+int32_t meters_sim485_set_values(uint32_t index, const meters_values_t *values);
+uint32_t meters_sim485_get_count(void);
+void meters_sim485_clear(void);
+void meters_sim485_populate(const meter_parameters_t *params, uint32_t count);
+int32_t meters_sim485_set_mercury_block(uint32_t index, meters_sim485_block_t mode);
+void meters_sim485_set_faults(const meters_sim485_faults_t *faults);
+void meters_sim485_get_faults(meters_sim485_faults_t *faults);
+// Фатальная ошибка в потоке опроса на следующем запросе, для проверки супервизора
+void meters_sim485_oops(void);
+void meters_sim485_grant(k_tid_t thread);
+
+#if CONFIG_STRIM_METERS2_CAPTURE
+void meters_sim485_replay_start(void);
+void meters_sim485_replay_stop(void);
+void meters_sim485_get_replay(meters_sim485_replay_t *replay);
+#endif
+
+// Замена вызовов bus485 для meters_bus485.c
+void meters_sim485_lock(void);
+int32_t meters_sim485_release(void);
+int32_t meters_sim485_set_baudrate(uint32_t baudrate);
+void meters_sim485_flush(void);
+int32_t meters_sim485_send(const uint8_t *data, size_t length);
+int32_t meters_sim485_recv(uint8_t *data, size_t size, uint32_t timeout_ms);
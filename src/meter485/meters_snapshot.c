@@ -0,0 +1,122 @@
+#include "meters_snapshot.h"
+#include "meters_poll485.h"
+#include "meters_trace.h"
+#include <string.h>
+
+LOG_MODULE_DECLARE(meters2, CONFIG_STRIM_METERS2_LOG_LEVEL);
+
+typedef struct{
+    meters_snapshot_t work;     // собирается пачкой в контексте опроса
+    meters_snapshot_t last;     // готовый, под data_access_mutex
+    bool is_valid;
+}snapshot_context_t;
+
+// доступно потоку опроса в пользовательском режиме
+static METERS_APP_BMEM snapshot_context_t snapshot;
+
+static void snapshot_read_item(meters_context_t *context, uint32_t item_idx, uint32_t start_cycles)
+{
+    meters_item_t *item = &context->items[item_idx];
+    meters_sample_t sample = context->parameters[item_idx].type->sample;
+    meters_snapshot_item_t *result = &snapshot.work.items[item_idx];
+
+    memset(result, 0, sizeof(*result));
+
+    if(sample == NULL){
+        result->result = -ENOTSUP;
+        return;
+    }
+
+    // таймаут неотвечающего счетчика растянул бы снимок для остальных
+    if(item->link.backoff_ms != 0){
+        result->result = -EAGAIN;
+        return;
+    }
+
+    context->tools->link_stats = &item->link;
+    uint32_t read_start = k_cycle_get_32();
+
+    result->result = sample(context, item_idx, &result->energy, &result->power);
+
+    uint32_t read_end = k_cycle_get_32();
+    context->tools->link_stats = NULL;
+
+    result->offset_us = k_cyc_to_us_floor32(read_start - start_cycles);
+    result->duration_us = k_cyc_to_us_ceil32(read_end - read_start);
+
+    // как и при записи значений опроса
+    uint32_t factor = meters_current_factor(&context->parameters[item_idx]);
+    result->energy *= factor;
+    result->power *= factor;
+}
+
+static int32_t snapshot_job(meters_context_t *context, void *data)
+{
+    meters_snapshot_t *work = &snapshot.work;
+    uint32_t first_us = UINT32_MAX;
+    uint32_t last_us = 0;
+    int32_t count = 0;
+
+    ARG_UNUSED(data);
+
+    work->count = MIN(context->item_count, ARRAY_SIZE(work->items));
+    work->timemark = k_uptime_get_32();
+    METERS_TRACE("snapshot", work->count, 0);
+
+    uint32_t start_cycles = k_cycle_get_32();
+    for(uint32_t i = 0; i < work->count; i++)
+        snapshot_read_item(context, i, start_cycles);
+
+    // показания сняты где-то внутри своих чтений, граница - от первого начала до последнего конца
+    for(uint32_t i = 0; i < work->count; i++){
+        const meters_snapshot_item_t *item = &work->items[i];
+        if(item->result != 0)
+            continue;
+
+        first_us = MIN(first_us, item->offset_us);
+        last_us = MAX(last_us, item->offset_us + item->duration_us);
+        count++;
+    }
+    work->skew_us = (count != 0) ? (last_us - first_us) : 0;
+    METERS_TRACE("snapshot_done", count, work->skew_us);
+
+    meters_data_lock(context->tools);
+    {
+        work->sequence = snapshot.last.sequence + 1;
+        snapshot.last = *work;
+        snapshot.is_valid = true;
+    }
+    meters_data_unlock(context->tools);
+
+    return count;
+}
+
+int32_t meters_snapshot_take(meters_context_t *context, k_timeout_t timeout)
+{
+    return meters_poll485_job(context, snapshot_job, NULL, 0, timeout);
+}
+
+int32_t meters_snapshot_get(meters_context_t *context, meters_snapshot_t *result)
+{
+    meters_tools_context_t *tool = context->tools;
+    int32_t ret = 0;
+
+    if(tool == NULL)
+        return -ENODEV;
+
+    meters_data_lock(tool);
+    {
+        if(snapshot.is_valid)
+            *result = snapshot.last;
+        else
+            ret = -ENODATA;
+    }
+    meters_data_unlock(tool);
+
+    return ret;
+}
+
+void meters_snapshot_invalidate(void)
+{
+    snapshot.is_valid = false;
+}
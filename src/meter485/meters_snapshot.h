@@ -0,0 +1,27 @@
+#pragma once
+
+#include "meters_private.h"
+
+/**
+ * Согласованный снимок: счетчики с драйвером, умеющим sample, читаются
+ * подряд в одном запросе к контексту опроса, без пауз и чтений между
+ * ними. Возвращает число прочитанных счетчиков.
+ *
+ * Широковещательная фиксация данных Меркурия не используется:
+ *  - коды фиксации и раскладка массива зафиксированных данных у исполнений
+ *    234 различаются и на доступных прошивках не проверены (см. проверку
+ *    массива параметров в драйвере);
+ *  - фиксация перезаписывает единственный буфер зафиксированных данных
+ *    счетчика, которым пользуются АСКУЭ и другие системы на той же линии;
+ *  - широковещательная команда остается без ответа, ее исполнение нельзя
+ *    подтвердить, а CE и Modbus такой команды не имеют вовсе.
+ * Пачка дает измеренную, а не предполагаемую границу: skew_us. На 9600 бод
+ * это десятки мс на счетчик, что не больше периода обновления мощности в
+ * самих счетчиках (около 1 с); если граница велика, снимок отбрасывается
+ * по skew_us.
+ */
+int32_t meters_snapshot_take(meters_context_t *context, k_timeout_t timeout);
+int32_t meters_snapshot_get(meters_context_t *context, meters_snapshot_t *snapshot);
+
+// Индексы счетчиков сменились, вызывается под data_access_mutex
+void meters_snapshot_invalidate(void);
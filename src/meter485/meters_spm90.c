@@ -1,115 +1,68 @@
 #include "meters_spm90.h"
-#include "bus485.h"
-#include <zephyr/sys/crc.h>
+#include "meters_modbus.h"
+#include "meters_bus485.h"
+#include <stdio.h>
 
 LOG_MODULE_DECLARE(meters2, CONFIG_STRIM_METERS2_LOG_LEVEL);
 
-enum {SPM90_ERROR_THRESHOLD = 3};
+typedef struct {
+    meters_values_dc_t shadow;
+}meters_data_spm90_t;
 
-static int32_t meters_spm90_get_responce(meters_context_t * context, uint8_t id, 
-                                    uint16_t * buf, uint16_t count)
-{
-    meters_tools_context_t *tool = context->tools;
-    int32_t ret;
-    uint8_t resp[17];
-    enum {MODBUS_WRAP_SIZE = 5};    
-    uint16_t expected = (sizeof(uint16_t) * count) + MODBUS_WRAP_SIZE;
-
-    if(expected > sizeof(resp))
-        return -E2BIG;
-                                        
-    ret = bus485_recv(tool->bus485, resp, ARRAY_SIZE(resp), CONFIG_STRIM_METERS2_BUS485_RESPONSE_TIMEOUT);
-    if(ret < 0)
-        return ret;
+enum {SPM90_ERROR_THRESHOLD = 3};
 
-    uint16_t crc = crc16_reflect(0xA001, 0xFFFF, resp, expected - sizeof(uint16_t));
-    uint16_t crc1 = (((uint16_t)resp[ret-1]) << 8) | resp[ret-2];
-    if(crc != crc1)
-        return -EBADMSG;
-    
-    if(resp[0] != id)
-        return -EADDRNOTAVAIL;
-    
-    if (resp[1] != 0x03)
-        return -ENODATA;
-    
-    if ((count * sizeof(uint16_t)) != resp[2])
-        return -EMSGSIZE;
-    
-    for (uint16_t i = 0; i < count; i++){
-        buf[i] = resp[4 + (i * 2)] | (resp[3 + (i * 2)] << 8);
-    }
-    
-    return 0;
-}
+// Регистры хранения SPM90: напряжение, ток, мощность и энергия подряд с адреса 0
+static const meters_modbus_reg_t spm90_regs[] = {
+    METERS_MODBUS_REG(METERS_MODBUS_READ_HOLDING, 0x0000, meters_modbus_format_u16, 
+                    meters_modbus_order_high_first, meters_modbus_target_float, 
+                    meters_values_dc_t, voltage, 0.1f),
+    METERS_MODBUS_REG(METERS_MODBUS_READ_HOLDING, 0x0001, meters_modbus_format_u16, 
+                    meters_modbus_order_high_first, meters_modbus_target_float, 
+                    meters_values_dc_t, current, 0.01f),
+    METERS_MODBUS_REG(METERS_MODBUS_READ_HOLDING, 0x0002, meters_modbus_format_u32, 
+                    meters_modbus_order_high_first, meters_modbus_target_float, 
+                    meters_values_dc_t, power, 0.1f),
+    METERS_MODBUS_REG(METERS_MODBUS_READ_HOLDING, 0x0004, meters_modbus_format_u32, 
+                    meters_modbus_order_high_first, meters_modbus_target_u64, 
+                    meters_values_dc_t, energy, 10.0f * 3600), // десятки Вт*ч в Вт*с
+};
+
+static const meters_modbus_map_t spm90_map = {
+    .regs = spm90_regs,
+    .count = ARRAY_SIZE(spm90_regs),
+    .max_gap = 0,
+};
+
+// Для снимка только мощность и энергия, вдвое короче ответ
+static const meters_modbus_map_t spm90_sample_map = {
+    .regs = &spm90_regs[2],
+    .count = 2,
+    .max_gap = 0,
+};
 
 int32_t meters_spm90_get_values(meters_context_t * context, uint16_t id, 
-                                uint16_t baudrate, meters_values_dc_t *shadow, uint32_t is_wait_before_send)
+                                uint32_t baudrate, meters_values_dc_t *shadow)
 {
-    meters_tools_context_t *tool = context->tools;
-    int32_t ret;
-    uint8_t req[8] = {id, 0x03, 0x00, 0x00, 0x00, 0x06};
-    uint16_t registers[6] = {0};
-    uint16_t crc = crc16_reflect(0xA001, 0xFFFF, req, 6);
-    req[6] = crc & 0xff;
-    req[7] = (crc >> 8) & 0xff;
-    
-    bus485_lock(tool->bus485);
-    
-    ret = bus485_set_baudrate(tool->bus485, baudrate);
-    if(ret < 0){
-        LOG_ERR("set baudrate error: %d", ret);
-        bus485_release(tool->bus485);
-        return ret;
-    }
-
-    bus485_flush(tool->bus485);
-    
-    if(is_wait_before_send)
-        k_sleep(K_MSEC(CONFIG_STRIM_METERS2_SPM90_SILENSE_BEFORE_REQUEST));
-
-    ret = bus485_send(tool->bus485, req, 8);
-    if(ret < 0){
-        LOG_ERR("send spm90 query error: %d", ret);
-        bus485_release(tool->bus485);
-        return ret;
-    }
-
-    ret = meters_spm90_get_responce(context, id, registers, ARRAY_SIZE(registers));
-    
-    if(ret == 0){
-        shadow->voltage = registers[0] / 10.0f;
-        shadow->current = registers[1] / 100.0f;
-        uint32_t power_100mW = (registers[2] << 16) | registers[3];
-        shadow->power = power_100mW / 10.0f;
-        uint32_t energy_10Wh = (registers[4] << 16) | registers[5];
-        shadow->energy = (uint64_t)energy_10Wh * 10 * 3600;
-    }
-    bus485_release(tool->bus485);
-    return ret;
+    return meters_modbus_read_map(context, id, baudrate, &spm90_map, shadow);
 }
 
-
-
 int32_t meters_spm90_read(meters_context_t * context, uint32_t item_idx)
 {
     int32_t ret;
     meters_item_t * item = &context->items[item_idx];
-    meter_parameters_t *param = &context->parameters[item_idx];
-    meters_values_dc_t * shadow = &item->data.spm90.shadow;
+    const meter_parameters_t *param = &context->parameters[item_idx];
+    meters_data_spm90_t * spm90 = item->data;
+    meters_values_dc_t * shadow = &spm90->shadow;
     meters_tools_context_t *tool = context->tools;
 
-    uint32_t is_wait_before_send = 0;
-    
     if(!item->is_valid_values) {
         if(k_uptime_get_32() - item->error_timemark < CONFIG_STRIM_METERS2_SPM90_WAIT_AFTER_ERROR)
             return 0;//пропускаем опрос, пока не вышло время
         
         item->error_timemark = 0;
-        is_wait_before_send = 1;
     }
 
-    ret = meters_spm90_get_values(context, param->address, param->baudrate, shadow, is_wait_before_send);
+    ret = meters_spm90_get_values(context, param->address, param->baudrate, shadow);
     if(ret == 0){
         if(!item->is_valid_values)
             LOG_INF("spm90 poll recovered");
@@ -122,11 +75,11 @@ int32_t meters_spm90_read(meters_context_t * context, uint32_t item_idx)
             if(item->is_valid_values)
                 LOG_DBG("spm90 exclude of poll next %d ms", CONFIG_STRIM_METERS2_SPM90_WAIT_AFTER_ERROR);
             
-            k_mutex_lock(&tool->data_access_mutex, K_FOREVER);
+            meters_data_lock(tool);
             {
                 item->is_valid_values = false;
             }
-            k_mutex_unlock(&tool->data_access_mutex);
+            meters_data_unlock(tool);
             item->error_timemark = k_uptime_get_32();
 
         }
@@ -134,8 +87,7 @@ int32_t meters_spm90_read(meters_context_t * context, uint32_t item_idx)
             item->error_timemark = k_uptime_get_32();
         }
         if(item->is_valid_values){
-            if((ret != -ETIMEDOUT) && (ret != -EILSEQ) && (ret != -EBADMSG) &&
-            (ret != -EADDRNOTAVAIL) && (ret != -ENODATA) && (ret != -EMSGSIZE)){
+            if(!meters_modbus_is_meter_error(ret) && (ret != -EILSEQ)){
                 LOG_ERR("read spm90 %d error: %d", param->address, ret);
                 return ret; //unknown error
             }
@@ -144,8 +96,6 @@ int32_t meters_spm90_read(meters_context_t * context, uint32_t item_idx)
             }
         }
     }
-    is_wait_before_send = 0;
-    
     return 0;
 }
 
@@ -157,4 +107,68 @@ int32_t meters_spm90_init(meters_context_t * context, uint32_t item_idx)
     context->items[item_idx].bad_responce_count = SPM90_ERROR_THRESHOLD;
 
     return 0;
-}
\ No newline at end of file
+}
+
+static int32_t meters_spm90_sample(meters_context_t *context, uint32_t item_idx,
+                                uint64_t *energy, float *power)
+{
+    int32_t ret;
+    const meter_parameters_t *param = &context->parameters[item_idx];
+    meters_values_dc_t value;
+
+    ret = meters_modbus_read_map(context, param->address, param->baudrate, &spm90_sample_map, &value);
+    if(ret < 0)
+        return ret;
+
+    *energy = value.energy;
+    *power = value.power;
+
+    return 0;
+}
+
+static void meters_spm90_format_address(char *buffer, size_t size, uint32_t address)
+{
+    snprintf(buffer, size, "  %3u", address);
+}
+
+static int32_t meters_spm90_probe(meters_context_t *context, uint32_t address, uint32_t baudrate,
+                                uint32_t timeout_ms, uint32_t *found_address)
+{
+    int32_t ret = meters_modbus_probe(context, address, baudrate, METERS_MODBUS_READ_HOLDING, 
+                                    spm90_regs[0].address, timeout_ms);
+    if(ret == 0)
+        *found_address = address;
+
+    return ret;
+}
+
+static const uint32_t spm90_scan_baudrates[] = {9600, 19200, 4800, 2400};
+
+// в Modbus RTU нет широковещательного чтения, только перебор адресов
+static const meters_scan_info_t spm90_scan_info = {
+    .probe = meters_spm90_probe,
+    .address_min = METERS_MODBUS_ADDRESS_MIN,
+    .address_max = METERS_MODBUS_ADDRESS_MAX,
+    .has_wildcard = false,
+    .baudrates = spm90_scan_baudrates,
+    .baudrate_count = ARRAY_SIZE(spm90_scan_baudrates),
+};
+
+// вся карта регистров одним запросом
+static const meters_budget_t spm90_budget = {
+    .requests = 1,
+    .request_bytes = 8,
+    .response_bytes = 5 + (6 * sizeof(uint16_t)),
+    .silence_x10 = METERS_BUS485_SILENCE_MODBUS,
+    .turnaround_ms = 10,
+};
+
+METERS_DRIVER_DEFINE(spm90, meters_data_spm90_t,
+                    .name = "SPM90",
+                    .values_type = meters_current_type_dc,
+                    .init = meters_spm90_init,
+                    .read = meters_spm90_read,
+                    .format_address = meters_spm90_format_address,
+                    .sample = meters_spm90_sample,
+                    .scan = &spm90_scan_info,
+                    .budget = &spm90_budget);
@@ -6,5 +6,4 @@ int32_t meters_spm90_read(meters_context_t * context, uint32_t item_idx);
 int32_t meters_spm90_init(meters_context_t * context, uint32_t item_idx);
 
 int32_t meters_spm90_get_values(meters_context_t * context, uint16_t id, 
-                                uint16_t baudrate, meters_values_dc_t *shadow, 
-                                uint32_t is_wait_before_send);
\ No newline at end of file
+                                uint32_t baudrate, meters_values_dc_t *shadow);
\ No newline at end of file
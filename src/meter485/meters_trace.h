@@ -0,0 +1,15 @@
+#pragma once
+
+/**
+ * Точки трассировки обмена по bus485. События уходят в подсистему
+ * трассировки Zephyr (CTF и другие форматы) как именованные события
+ * с двумя аргументами. При выключенной опции код не генерируется.
+ */
+#if CONFIG_STRIM_METERS2_TRACING
+#include <zephyr/tracing/tracing.h>
+
+#define METERS_TRACE(_event, _arg0, _arg1) \
+    sys_trace_named_event("meters_" _event, (uint32_t)(_arg0), (uint32_t)(_arg1))
+#else
+#define METERS_TRACE(_event, _arg0, _arg1) do{}while(0)
+#endif
@@ -0,0 +1,138 @@
+#include "meters_tunnel.h"
+#include "meters_bus485.h"
+#include "meters_poll485.h"
+#include <string.h>
+
+LOG_MODULE_DECLARE(meters2, CONFIG_STRIM_METERS2_LOG_LEVEL);
+
+enum{TUNNEL_GAP_MS = 20};               // пауза в приеме - конец ответа
+enum{TUNNEL_QUEUE_TIMEOUT_MS = 30000};  // чтение счетчика перед слотом может быть долгим
+
+typedef struct{
+    uint8_t frame[METERS_TUNNEL_FRAME_MAX_SIZE];   // запрос, затем ответ
+    meters_tunnel_stats_t stats;
+    bool is_lost;   // слот брошен по таймауту, frame еще у потока опроса
+}tunnel_context_t;
+
+// доступно потоку опроса в пользовательском режиме
+static METERS_APP_BMEM tunnel_context_t tunnel;
+// держит вызывающий на все время слота, поток опроса его не берет
+K_MUTEX_DEFINE(meters_tunnel_mutex);
+
+typedef struct{
+    uint32_t baudrate;
+    uint32_t length;
+    uint32_t submit_cycles;
+}tunnel_job_t;
+
+static int32_t tunnel_job(meters_context_t *context, void *data)
+{
+    tunnel_job_t *job = data;
+    meters_tunnel_stats_t *stats = &tunnel.stats;
+    uint32_t start_cycles = k_cycle_get_32();
+    uint32_t start_ms = k_uptime_get_32();
+    size_t count = 0;
+    int32_t ret;
+
+    stats->wait_us_last = k_cyc_to_us_floor32(start_cycles - job->submit_cycles);
+    stats->wait_us_max = MAX(stats->wait_us_max, stats->wait_us_last);
+
+    // тишина как в Modbus RTU, чтобы кадр не слился с кадрами опроса
+    ret = meters_bus485_begin(context, job->baudrate,
+                            meters_bus485_silence_us(job->baudrate, METERS_BUS485_SILENCE_MODBUS));
+    if(ret < 0)
+        return ret;
+
+    ret = meters_bus485_send(context, tunnel.frame, job->length);
+    if(ret >= 0){
+        stats->bytes_tx += job->length;
+
+        while(count < sizeof(tunnel.frame)){
+            uint32_t elapsed = k_uptime_get_32() - start_ms;
+            if(elapsed >= CONFIG_STRIM_METERS2_TUNNEL_SLOT_MS)
+                break;  // слот исчерпан, ответ обрезается
+
+            uint32_t timeout = CONFIG_STRIM_METERS2_TUNNEL_SLOT_MS - elapsed;
+            if(count != 0)
+                timeout = MIN(timeout, TUNNEL_GAP_MS);
+
+            ret = meters_bus485_recv(context, &tunnel.frame[count], sizeof(tunnel.frame) - count, timeout);
+            if(ret <= 0)
+                break;
+            count += ret;
+        }
+    }
+    meters_bus485_end(context);
+
+    stats->slots++;
+    stats->slot_us_last = k_cyc_to_us_floor32(k_cycle_get_32() - start_cycles);
+    stats->slot_us_max = MAX(stats->slot_us_max, stats->slot_us_last);
+    stats->bytes_rx += count;
+
+    if(count != 0)
+        return count;
+
+    if((ret == 0) || (ret == -ETIMEDOUT)){
+        stats->timeouts++;
+        return -ETIMEDOUT;
+    }
+
+    return ret;
+}
+
+int32_t meters_tunnel_transfer(uint32_t baudrate, const uint8_t *request, size_t length,
+                            uint8_t *response, size_t size)
+{
+    tunnel_job_t job = {.baudrate = baudrate, .length = length};
+    int32_t ret;
+
+    if((length == 0) || (length > sizeof(tunnel.frame)))
+        return -EMSGSIZE;
+
+    k_mutex_lock(&meters_tunnel_mutex, K_FOREVER);
+    {
+        // новый кадр затер бы frame, который брошенный слот еще передает или принимает
+        if(tunnel.is_lost){
+            if(meters_poll485_job_running(&meters_context)){
+                k_mutex_unlock(&meters_tunnel_mutex);
+                return -EBUSY;
+            }
+            tunnel.is_lost = false;
+        }
+
+        memcpy(tunnel.frame, request, length);
+        job.submit_cycles = k_cycle_get_32();
+
+        ret = meters_poll485_job(&meters_context, tunnel_job, &job, sizeof(job),
+                                K_MSEC(TUNNEL_QUEUE_TIMEOUT_MS));
+        if(ret > 0){
+            ret = MIN(ret, size);
+            memcpy(response, tunnel.frame, ret);
+        }
+        // -ETIMEDOUT и от молчащего счетчика, брошенный слот отличает незавершенный запрос
+        else if((ret == -ETIMEDOUT) && meters_poll485_job_running(&meters_context)){
+            tunnel.is_lost = true;
+        }
+    }
+    k_mutex_unlock(&meters_tunnel_mutex);
+
+    return ret;
+}
+
+void meters_tunnel_get_stats(meters_tunnel_stats_t *stats)
+{
+    k_mutex_lock(&meters_tunnel_mutex, K_FOREVER);
+    {
+        memcpy(stats, &tunnel.stats, sizeof(*stats));
+    }
+    k_mutex_unlock(&meters_tunnel_mutex);
+}
+
+void meters_tunnel_clear_stats(void)
+{
+    k_mutex_lock(&meters_tunnel_mutex, K_FOREVER);
+    {
+        memset(&tunnel.stats, 0, sizeof(tunnel.stats));
+    }
+    k_mutex_unlock(&meters_tunnel_mutex);
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include "meters_private.h"
+
+enum{METERS_TUNNEL_FRAME_MAX_SIZE = 256};
+
+// Слоты туннеля: ожидание очереди и занятость линии, мкс
+typedef struct{
+    uint32_t slots;
+    uint32_t timeouts;      // на запрос не пришло ни байта
+    uint32_t bytes_tx;
+    uint32_t bytes_rx;
+    uint32_t wait_us_last;  // от передачи кадра в опрос до начала слота
+    uint32_t wait_us_max;
+    uint32_t slot_us_last;  // линия занята туннелем
+    uint32_t slot_us_max;
+}meters_tunnel_stats_t;
+
+/**
+ * Кадр внешней программы уходит на линию как есть в слоте между чтениями
+ * счетчиков, ответ собирается до паузы в приеме. Слот целиком, с ожиданием
+ * ответа, ограничен CONFIG_STRIM_METERS2_TUNNEL_SLOT_MS, опрос продолжается
+ * с меньшей частотой. Возвращает число байт ответа, -ETIMEDOUT - ответа нет.
+ * -EBUSY - прежний слот брошен по таймауту и еще не завершился.
+ */
+int32_t meters_tunnel_transfer(uint32_t baudrate, const uint8_t *request, size_t length,
+                            uint8_t *response, size_t size);
+void meters_tunnel_get_stats(meters_tunnel_stats_t *stats);
+void meters_tunnel_clear_stats(void);
@@ -1,18 +1,41 @@
 #include <stdbool.h>
+#include <stdio.h>
 #include <zephyr/kernel.h>
 #include <zephyr/device.h>
 #include <zephyr/logging/log.h>
 #include <zephyr/app_memory/app_memdomain.h>
 #include "meters_private.h"
+#if CONFIG_STRIM_METERS2_BUS485_SIM
+#include "meters_sim485.h"
+#else
 #include "bus485.h"
+#endif
 
-#include "meters_spm90.h"
-#include "meters_ce318.h"
-#include "meters_mercury234.h"
 #include "meters_poll485.h"
+#ifdef CONFIG_STRIM_METERS2_BUS485_ENABLE
+#include "meters_bus485.h"
+#include "meters_budget.h"
+#include "meters_snapshot.h"
+#endif
+#if CONFIG_STRIM_METERS2_CAPTURE
+#include "meters_capture.h"
+#endif
+#if CONFIG_STRIM_METERS2_BALANCE
+#include "meters_balance.h"
+#endif
 
 LOG_MODULE_REGISTER(meters2, CONFIG_STRIM_METERS2_LOG_LEVEL);
 
+BUILD_ASSERT(METERS_ITEMS_MAX_COUNT <= CONFIG_STRIM_METERS2_ITEMS_MAX_COUNT,
+            "devicetree describes more meters than STRIM_METERS2_ITEMS_MAX_COUNT");
+BUILD_ASSERT(METERS_ITEMS_MAX_COUNT <= 32, "fresh_pending mask holds up to 32 meters");
+
+#if CONFIG_STRIM_METERS2_DT_TOPOLOGY && DT_NODE_HAS_PROP(METERS_DT_NODE, bus)
+#define METERS_BUS485_NODE DT_PHANDLE(METERS_DT_NODE, bus)
+#else
+#define METERS_BUS485_NODE DT_CHOSEN(strim_meter_bus485)
+#endif
+
 #if CONFIG_USERSPACE
 struct k_mem_domain app0_domain;    
 K_APPMEM_PARTITION_DEFINE(app_part0);
@@ -28,128 +51,434 @@ meters_tools_context_t tools_context;
 meters_context_t meters_context;
 #endif     
 
-typedef struct {
-    const char* name;
-    meters_current_type_t values_type;
-    meters_init_t init;
-    meters_read_t read;
-}meters_description_type_t;
-
-static const meters_description_type_t meters_description_type[meters_type_lastIndex] = {
-    [meters_type_extern_dc] = {.name = "EXTERNAL.DC",
-                            .values_type = meters_current_type_dc,
-                            .init = NULL,
-                            .read = NULL},
-    [meters_type_extern_ac] = {.name = "EXTERNAL.AC",
-                            .values_type = meters_current_type_ac,
-                            .init = NULL,
-                            .read = NULL},
-#if CONFIG_STRIM_METERS2_BUS485_ENABLE
-    [meters_type_SPM90]   = {.name = "SPM90",
-                            .values_type = meters_current_type_dc,
-                            .init = meters_spm90_init,
-                            .read = meters_spm90_read},
-    [meters_type_CE318]   = {.name = "CE318",
-                            .values_type = meters_current_type_ac,
-                            .init = meters_ce318_init,
-                            .read = meters_ce318_read},
-    [meters_type_Mercury234] = {.name = "MERCURY234",
-                                .values_type = meters_current_type_ac,
-                                .init = meters_mercury_init,
-                                .read = meters_mercury_read},
-#endif                
+const uint16_t meters_link_rtt_bounds_ms[METERS_LINK_RTT_BUCKETS - 1] = {10, 20, 50, 100, 200, 500, 1000};
+
+static void meters_extern_format_address(char *buffer, size_t size, uint32_t address)
+{
+    snprintf(buffer, size, "  %3u", address);
+}
+
+// внешние счетчики не опрашиваются, значения задаются через meters_set_values
+const STRUCT_SECTION_ITERABLE(meters_driver, meters_driver_extern_dc) = {
+    .id = "extern_dc",
+    .name = "EXTERNAL.DC",
+    .values_type = meters_current_type_dc,
+    .format_address = meters_extern_format_address,
 };
 
-meters_current_type_t meters_get_values_type(meters_type_t type){
-  if (type < meters_type_lastIndex)
-    return meters_description_type[type].values_type;
-  
-  // для неизвестных пусть будет DC
-  return meters_current_type_dc;
+const STRUCT_SECTION_ITERABLE(meters_driver, meters_driver_extern_ac) = {
+    .id = "extern_ac",
+    .name = "EXTERNAL.AC",
+    .values_type = meters_current_type_ac,
+    .format_address = meters_extern_format_address,
+};
+
+bool meters_is_type_registered(meters_type_t type)
+{
+    STRUCT_SECTION_FOREACH(meters_driver, driver){
+        if(driver == type)
+            return true;
+    }
+    return false;
 }
 
-meters_read_t meters_get_read_func(meters_type_t type)
+meters_type_t meters_get_type_by_id(const char *id)
 {
-  if (type < meters_type_lastIndex)
-    return meters_description_type[type].read;
-  
-  return NULL;
+    STRUCT_SECTION_FOREACH(meters_driver, driver){
+        if(strcmp(driver->id, id) == 0)
+            return driver;
+    }
+    return NULL;
 }
 
-meters_init_t meters_get_init_func(meters_type_t type)
+void meters_get_address_string(char *buffer, size_t size, const meter_parameters_t *param)
 {
-  if (type < meters_type_lastIndex)
-    return meters_description_type[type].init;
-  
-  return NULL;
+    if(meters_is_type_registered(param->type) && (param->type->format_address != NULL))
+        param->type->format_address(buffer, size, param->address);
+    else 
+        buffer[0] = '\0';
 }
 
-static int32_t meters_initialize_context(meters_context_t *context, 
-                                        meter_parameters_t *params, 
-                                        uint8_t count)
+#if CONFIG_STRIM_METERS2_POLL_THREAD
+enum{METERS_LOCK_RETRY_MS = 50};
+#endif
+
+void meters_data_lock(meters_tools_context_t *tool)
 {
-    int32_t ret;
-    //default properties
-    for(uint32_t i = 0; i < CONFIG_STRIM_METERS2_ITEMS_MAX_COUNT; i++){
-        context->parameters[i].current_factor = 1;
-        context->parameters[i].address = 0;
-        context->parameters[i].type = meters_type_lastIndex;
+#if CONFIG_STRIM_METERS2_POLL_THREAD
+    if(k_current_get() == &tool->poll485_thread){
+        tool->poll_data_users++;    // до захвата: погибнуть можно и в ожидании
+        k_mutex_lock(&tool->data_access_mutex, K_FOREVER);
+        return;
     }
 
-    if(params == NULL){
-        return -EINVAL;
+    // из очереди мьютекса выходим по таймауту, чтобы ее можно было опустошить перед пересозданием
+    atomic_inc(&tool->data_users);
+    while(atomic_get(&tool->is_data_recovery) ||
+        (k_mutex_lock(&tool->data_access_mutex, K_MSEC(METERS_LOCK_RETRY_MS)) != 0)){
+        if(atomic_get(&tool->is_data_recovery)){
+            atomic_dec(&tool->data_users);
+            k_msleep(METERS_LOCK_RETRY_MS);
+            atomic_inc(&tool->data_users);
+        }
     }
+#else
+    k_mutex_lock(&tool->data_access_mutex, K_FOREVER);
+#endif
+}
+
+void meters_data_unlock(meters_tools_context_t *tool)
+{
+    k_mutex_unlock(&tool->data_access_mutex);
+#if CONFIG_STRIM_METERS2_POLL_THREAD
+    if(k_current_get() == &tool->poll485_thread)
+        tool->poll_data_users--;
+    else
+        atomic_dec(&tool->data_users);
+#endif
+}
+
+void meters_fresh_wake(meters_tools_context_t *tool)
+{
+    for(; tool->fresh_waiters != 0; tool->fresh_waiters--)
+        k_sem_give(&tool->fresh_done);
+}
+
+enum{METERS_RECONFIG_TIMEOUT_MS = 30000}; // несколько циклов опроса с таймаутами
+
+K_MUTEX_DEFINE(meters_reconfig_mutex);
 
-	if(count > CONFIG_STRIM_METERS2_ITEMS_MAX_COUNT)
-		return -E2BIG;
+static void * meters_pool_alloc(meters_driver_pool_t *pool)
+{
+    for(uint32_t i = 0; i < pool->count; i++){
+        if(pool->busy & BIT(i))
+            continue;
+
+        pool->busy |= BIT(i);
+        void *data = (uint8_t *)pool->data + (i * pool->data_size);
+        memset(data, 0, pool->data_size);
+        return data;
+    }
+    return NULL;
+}
+
+static void meters_pool_free(meters_driver_pool_t *pool, void *data)
+{
+    if((pool == NULL) || (data == NULL))
+        return;
 
-	memcpy(context->parameters, params, count * sizeof(meter_parameters_t));
+    pool->busy &= ~BIT(((uint8_t *)data - (uint8_t *)pool->data) / pool->data_size);
+}
 
-    context->item_count = count;
+// Тот же счетчик на линии: его значения, статистика и состояние драйвера сохраняются
+static bool meters_is_same_meter(const meter_parameters_t *a, const meter_parameters_t *b)
+{
+    return (a->type == b->type) && (a->address == b->address) && (a->baudrate == b->baudrate);
+}
 
+// Пул исчерпан: ячейку отдает прежний счетчик того же типа, которого нет в новой таблице
+static int32_t meters_reconfig_borrow(const meters_context_t *context, meters_type_t type,
+                                    const bool *is_kept, uint32_t borrowed)
+{
     for(uint32_t i = 0; i < context->item_count; i++){
-        meters_type_t type = context->parameters[i].type;
-        if(type >= meters_type_lastIndex){
-            LOG_ERR("meter %u have unknown type %u", i, context->parameters[i].type);
-            context->item_count = 0;
+        if(!is_kept[i] && !(borrowed & BIT(i)) && (context->parameters[i].type == type) &&
+            (context->items[i].data != NULL))
+            return i;
+    }
+    return -ENOMEM;
+}
+
+/**
+ * Новая таблица собирается в нерабочем банке, пока опрос идет по старой.
+ * Прежние счетчики сопоставляются с новыми, для остальных выделяется и
+ * инициализируется состояние драйвера. Если пул типа исчерпан, берется
+ * ячейка заменяемого счетчика: ее еще опрашивают, поэтому такой счетчик
+ * инициализируется при переходе. Постоянная таблица (is_static) не
+ * копируется. При ошибке рабочая таблица не меняется.
+ */
+static int32_t meters_reconfig_stage(meters_context_t *context, const meter_parameters_t *params,
+                                    uint32_t count, bool is_reset, bool is_static)
+{
+    meters_tools_context_t *tool = context->tools;
+    meters_bank_t *bank = &context->banks[context->bank ^ 1];
+    meters_context_t staged = {
+        .items = bank->items,
+        .parameters = is_static ? params : bank->parameters,
+        .item_count = count,
+        .tools = tool,
+    };
+    bool is_kept[METERS_ITEMS_MAX_COUNT] = {false};
+    uint32_t borrowed = 0;  // прежние счетчики, отдавшие ячейку
+    uint32_t deferred = 0;  // новые счетчики на этих ячейках
+    int32_t ret = 0;
+    uint32_t j;
+
+    if((params == NULL) && (count != 0))
+        return -EINVAL;
+
+    if(count > METERS_ITEMS_MAX_COUNT)
+        return -E2BIG;
+
+    uint32_t parents = 0;
+    for(j = 0; j < count; j++){
+        if(!meters_is_type_registered(params[j].type)){
+            LOG_ERR("meter %u have unknown type %p", j, (void *)params[j].type);
             return -ENOMSG;
         }
-        context->items[i].values.type = meters_get_values_type(type);
-        context->items[i].is_valid_values = false;
-        meters_init_t init_func = meters_get_init_func(type);
-        if (init_func != NULL)
-        {
-          ret = init_func(context, i);
-          if (ret != 0)
-          {
-            LOG_ERR("init meter %d error: %d", i, ret);
-            return ret;
-          }
+        if(params[j].balance_role == meters_balance_parent)
+            parents++;
+    }
+
+    if(parents > 1){
+        LOG_ERR("balance needs one parent meter, %u given", parents);
+        return -EINVAL;
+    }
+
+    if(!is_static)
+        memcpy(bank->parameters, params, count * sizeof(meter_parameters_t));
+
+    // сначала сопоставление, чтобы до выделения знать, какие ячейки освободятся
+    for(j = 0; j < count; j++){
+        tool->reconfig_map[j] = -1;
+        for(uint32_t i = 0; !is_reset && (i < context->item_count); i++){
+            if(!is_kept[i] && meters_is_same_meter(&params[j], &context->parameters[i])){
+                is_kept[i] = true;
+                tool->reconfig_map[j] = i;
+                break;
+            }
+        }
+    }
+
+    for(j = 0; j < count; j++){
+        meters_item_t *item = &bank->items[j];
+        meters_type_t type = params[j].type;
+
+        if(tool->reconfig_map[j] >= 0)
+            continue; // скопируется из рабочей таблицы в момент перехода
+
+        memset(item, 0, sizeof(meters_item_t));
+        item->values.type = type->values_type;
+
+        if(type->pool != NULL){
+            item->data = meters_pool_alloc(type->pool);
+            if(item->data == NULL){
+                int32_t i = meters_reconfig_borrow(context, type, is_kept, borrowed);
+                if(i < 0){
+                    LOG_ERR("meter %u: no free %s state, increase pool size", j, type->name);
+                    ret = -ENOMEM;
+                    break;
+                }
+                borrowed |= BIT(i);
+                deferred |= BIT(j);
+                item->data = context->items[i].data;
+                continue;
+            }
+        }
+
+        if(type->init != NULL){
+            ret = type->init(&staged, j);
+            if(ret != 0){
+                LOG_ERR("init meter %d error: %d", j, ret);
+                j++;
+                break;
+            }
+        }
+    }
+
+    if(ret != 0){
+        while(j-- > 0){
+            if((tool->reconfig_map[j] < 0) && !(deferred & BIT(j)))
+                meters_pool_free(params[j].type->pool, bank->items[j].data);
         }
+        return ret;
     }
+
+    tool->reconfig_count = count;
+    tool->reconfig_parameters = staged.parameters;
+    tool->reconfig_borrowed = borrowed;
+    tool->reconfig_deferred = deferred;
     return 0;
 }
 
+static void meters_reconfig_swap(meters_context_t *context)
+{
+    meters_tools_context_t *tool = context->tools;
+    meters_bank_t *bank = &context->banks[context->bank ^ 1];
+    bool is_kept[METERS_ITEMS_MAX_COUNT] = {false};
+
+    meters_data_lock(tool);
+    {
+        for(uint32_t j = 0; j < tool->reconfig_count; j++){
+            int32_t i = tool->reconfig_map[j];
+            if(i >= 0){
+                bank->items[j] = context->items[i];
+                is_kept[i] = true;
+            }
+        }
+
+        for(uint32_t i = 0; i < context->item_count; i++){
+            if(!is_kept[i] && !(tool->reconfig_borrowed & BIT(i)))
+                meters_pool_free(context->parameters[i].type->pool, context->items[i].data);
+        }
+
+        context->bank ^= 1;
+        context->items = bank->items;
+        context->parameters = tool->reconfig_parameters;
+        context->item_count = tool->reconfig_count;
+        tool->reconfig_pending = false;
+
+        // прежние счетчики больше не опрашиваются, их ячейки можно готовить для новых
+        for(uint32_t j = 0; j < context->item_count; j++){
+            meters_init_t init = context->parameters[j].type->init;
+            if((tool->reconfig_deferred & BIT(j)) && (init != NULL)){
+                int32_t ret = init(context, j);
+                if(ret != 0)
+                    LOG_ERR("init meter %u error: %d", j, ret);
+            }
+        }
+
+        // индексы сменились, ожидающие срочного чтения получают ошибку
+        tool->fresh_pending = 0;
+        meters_fresh_wake(tool);
+#ifdef CONFIG_STRIM_METERS2_BUS485_ENABLE
+        meters_snapshot_invalidate();
+#endif
+#if CONFIG_STRIM_METERS2_BALANCE
+        meters_balance_rebuild(context);
+#endif
+    }
+    meters_data_unlock(tool);
+
+#ifdef CONFIG_STRIM_METERS2_BUS485_ENABLE
+    // оценивается уже действующая таблица; перегрузка линии не мешает опросу, только предупреждаем
+    meters_budget_check(context);
+#endif
+}
+
+bool meters_reconfig_apply(meters_context_t *context)
+{
+    meters_tools_context_t *tool = context->tools;
+
+    if(!tool->reconfig_pending)
+        return false;
+
+    meters_reconfig_swap(context);
+    k_sem_give(&tool->reinitSem);
+
+    return true;
+}
+
+static int32_t meters_reconfig_request(const meter_parameters_t *params, uint32_t count, bool is_reset)
+{
+    meters_context_t *context = &meters_context;
+    meters_tools_context_t *tool = context->tools;
+    int32_t ret;
+
+    if(tool == NULL)
+        return -ENODEV;
+
+    k_mutex_lock(&meters_reconfig_mutex, K_FOREVER);
+    {
+        if(tool->reconfig_pending){
+            ret = -EBUSY;   // предыдущая таблица еще ждет перехода
+        }
+        else {
+            ret = meters_reconfig_stage(context, params, count, is_reset, false);
+            if(ret == 0){
+                k_sem_reset(&tool->reinitSem);
+                tool->reconfig_pending = true;
+#ifdef CONFIG_STRIM_METERS2_BUS485_ENABLE
+                meters_poll485_kick(context);
+
+                // поток опроса переходит на новую таблицу между чтениями счетчиков
+                if(k_sem_take(&tool->reinitSem, K_MSEC(METERS_RECONFIG_TIMEOUT_MS)) != 0)
+                    ret = -EINPROGRESS;
+#else
+                meters_reconfig_apply(context);
+#endif
+            }
+        }
+    }
+    k_mutex_unlock(&meters_reconfig_mutex);
+
+    return ret;
+}
+
+int32_t meters_reconfigure(const meter_parameters_t *parameters, uint8_t count)
+{
+    return meters_reconfig_request(parameters, count, false);
+}
+
+int32_t meters_get_parameters(meter_parameters_t *parameters, uint8_t size)
+{
+    meters_context_t *context = &meters_context;
+    meters_tools_context_t *tool = context->tools;
+    int32_t ret;
+
+    if(tool == NULL)
+        return -ENODEV;
+
+    meters_data_lock(tool);
+    {
+        ret = MIN(size, context->item_count);
+        memcpy(parameters, context->parameters, ret * sizeof(meter_parameters_t));
+    }
+    meters_data_unlock(tool);
+
+    return ret;
+}
+
+// Драйверы передают показания вторичных цепей, внешние счетчики - уже первичные величины
+static void meters_apply_current_factor(const meter_parameters_t *param, meters_values_t *values)
+{
+    uint32_t factor = meters_current_factor(param);
+
+    if((factor == 1) || (param->type->read == NULL))
+        return;
+
+    if(values->type == meters_current_type_ac){
+        for(uint32_t i = 0; i < 3; i++)
+            values->AC.current[i] *= factor;
+        values->AC.power_active *= factor;
+        values->AC.energy_active *= factor;
+    }
+    else {
+        values->DC.current *= factor;
+        values->DC.power *= factor;
+        values->DC.energy *= factor;
+    }
+}
+
 int32_t z_impl_meters_set_values(uint32_t idx, const meters_values_t *buffer){
     meters_context_t *context = &meters_context;
     meters_tools_context_t *tool = context->tools;
+    int32_t ret = 0;
+
     if(buffer == NULL)
         return -EINVAL;
     
-    if(idx >= context->item_count)
-        return -ERANGE;
-    
-    if(buffer->type != meters_description_type[context->parameters[idx].type].values_type)
-        return -EINVAL; 
-    
-    k_mutex_lock(&tool->data_access_mutex, K_FOREVER);
+    // таблица счетчиков может смениться, индекс проверяется под мьютексом
+    meters_data_lock(tool);
     {
-        memcpy(&context->items[idx].values, buffer, sizeof(meters_values_t));
-        context->items[idx].timemark = k_uptime_get_32();
-        context->items[idx].is_valid_values = true;
+        if(idx >= context->item_count)
+            ret = -ERANGE;
+        else if(buffer->type != context->parameters[idx].type->values_type)
+            ret = -EINVAL; 
+        else {
+            memcpy(&context->items[idx].values, buffer, sizeof(meters_values_t));
+            meters_apply_current_factor(&context->parameters[idx], &context->items[idx].values);
+            context->items[idx].timemark = k_uptime_get_32();
+            context->items[idx].is_valid_values = true;
+#if CONFIG_STRIM_METERS2_BALANCE
+            meters_balance_update(context, idx);
+#endif
+        }
     }
-    k_mutex_unlock(&tool->data_access_mutex);
-    return 0;
+    meters_data_unlock(tool);
+
+    if(ret == 0)
+        k_poll_signal_raise(&tool->data_update, idx);
+    return ret;
 }
 
 #if CONFIG_USERSPACE
@@ -167,28 +496,32 @@ static int32_t z_vrfy_meters_set_values(uint32_t idx, const meters_values_t *buf
 
 int32_t z_impl_meters_get_values(uint32_t idx, meters_values_t *buffer){
     meters_context_t *context = &meters_context;
-    meters_item_t *item = &context->items[idx];
     meters_tools_context_t *tool = context->tools;
     
     if(buffer == NULL)
         return -EINVAL;
-    
-    if(idx >= context->item_count)
-        return -ERANGE;
 
     int32_t ret = -ENXIO;
 
-    k_mutex_lock(&tool->data_access_mutex, K_FOREVER);
+    meters_data_lock(tool);
     {
-        uint32_t curTimemark = k_uptime_get_32();
-        if((curTimemark - item->timemark) > (CONFIG_STRIM_METERS2_VALID_DATA_TIMEOUT))
-            item->is_valid_values = false;
-        if(item->is_valid_values){
-            memcpy(buffer, &item->values, sizeof(meters_values_t));
-            ret = 0;
+        // таблица счетчиков может смениться, индекс проверяется под мьютексом
+        if(idx >= context->item_count){
+            ret = -ERANGE;
+        }
+        else {
+            meters_item_t *item = &context->items[idx];
+            uint32_t curTimemark = k_uptime_get_32();
+
+            if((curTimemark - item->timemark) > (CONFIG_STRIM_METERS2_VALID_DATA_TIMEOUT))
+                item->is_valid_values = false;
+            if(item->is_valid_values){
+                memcpy(buffer, &item->values, sizeof(meters_values_t));
+                ret = 0;
+            }
         }
     }
-    k_mutex_unlock(&tool->data_access_mutex);
+    meters_data_unlock(tool);
 
     return ret;
 }
@@ -217,8 +550,8 @@ static int32_t z_vrfy_meters_get_values(uint32_t idx, meters_values_t *buffer)
 #endif
 
 const uint8_t * meters_get_typename(meters_type_t type){
-    if(type < meters_type_lastIndex)
-        return meters_description_type[type].name;
+    if(meters_is_type_registered(type))
+        return type->name;
     
     return "unknown";
 }
@@ -231,11 +564,10 @@ int32_t z_impl_meters_get_all(meters_values_collection_t *buffer){
         return -EINVAL;
     buffer->count = 0;
 
-    k_mutex_lock(&tool->data_access_mutex, K_FOREVER);
+    meters_data_lock(tool);
     {
         for(uint32_t i = 0; i < context->item_count; i++){
-            if((i < ARRAY_SIZE(context->items)) &&
-                (i < ARRAY_SIZE(context->parameters)) && 
+            if((i < METERS_ITEMS_MAX_COUNT) &&
                 (i < ARRAY_SIZE(buffer->items))){
                     uint32_t timemark = k_uptime_get_32();
                     if((timemark - context->items[i].timemark) > (CONFIG_STRIM_METERS2_VALID_DATA_TIMEOUT))
@@ -249,7 +581,7 @@ int32_t z_impl_meters_get_all(meters_values_collection_t *buffer){
             }
         }
     }
-    k_mutex_unlock(&tool->data_access_mutex);
+    meters_data_unlock(tool);
 
     return 0;
 }
@@ -276,17 +608,376 @@ static int32_t z_vrfy_meters_get_all(meters_values_collection_t *buffer)
 #include <zephyr/syscalls/meters_get_all_mrsh.c>
 #endif
 
-//TODO реализовать остановку всех подчиненных потоков, заблокировать чтение мьютексом 
-// при задании новых параметров
+int32_t z_impl_meters_get_link_stats(uint32_t idx, meters_link_stats_t *stats)
+{
+    meters_context_t *context = &meters_context;
+    meters_tools_context_t *tool = context->tools;
+
+    if(stats == NULL)
+        return -EINVAL;
+
+    if(tool == NULL)
+        return -ERANGE;
+
+    int32_t ret = 0;
+
+    meters_data_lock(tool);
+    {
+        if(idx >= context->item_count)
+            ret = -ERANGE;
+        else
+            memcpy(stats, &context->items[idx].link, sizeof(meters_link_stats_t));
+    }
+    meters_data_unlock(tool);
+
+    return ret;
+}
+
+#if CONFIG_USERSPACE
+static int32_t z_vrfy_meters_get_link_stats(uint32_t idx, meters_link_stats_t *stats)
+{
+    meters_link_stats_t copy_stats;
+    int32_t ret;
+
+    ret = z_impl_meters_get_link_stats(idx, &copy_stats);
+
+    if(k_usermode_to_copy(stats, &copy_stats, sizeof(*stats)) != 0){
+        return -EPERM;
+    }
+
+    return ret;
+}
+
+#include <zephyr/syscalls/meters_get_link_stats_mrsh.c>
+#endif
+
+// Все счетчики инициализируются заново, значения и статистика сбрасываются
 int32_t meters_reinit(void){
-#if 0
+    static meter_parameters_t parameters[METERS_ITEMS_MAX_COUNT];
+    int32_t ret;
+
+    k_mutex_lock(&meters_reconfig_mutex, K_FOREVER);
+    {
+        ret = meters_get_parameters(parameters, ARRAY_SIZE(parameters));
+        if(ret >= 0)
+            ret = meters_reconfig_request(parameters, ret, true);
+    }
+    k_mutex_unlock(&meters_reconfig_mutex);
+
+    return ret;
+}
+
+int32_t z_impl_meters_get_poll_stats(meters_poll_stats_t *stats)
+{
     meters_context_t *context = &meters_context;
-    k_sem_give(&context->reinitSem);
+    meters_tools_context_t *tool = context->tools;
+
+    if(stats == NULL)
+        return -EINVAL;
+
+    if(tool == NULL)
+        return -ENODEV;
+
+    meters_data_lock(tool);
+    {
+        memcpy(stats, &tool->poll_stats, sizeof(meters_poll_stats_t));
+#ifdef CONFIG_STRIM_METERS2_BUS485_ENABLE
+        stats->bufs_peak = tool->bufs.busy_peak;
+        stats->bufs_failures = tool->bufs.failures;
+#endif
+    }
+    meters_data_unlock(tool);
+
+#ifdef CONFIG_STRIM_METERS2_BUS485_ENABLE
+    meters_poll485_stack_info(context, &stats->stack_size, &stats->stack_unused);
 #endif
+
     return 0;
 }
 
-int32_t meters_init(meter_parameters_t *parameters, uint8_t count){
+#if CONFIG_USERSPACE
+static int32_t z_vrfy_meters_get_poll_stats(meters_poll_stats_t *stats)
+{
+    meters_poll_stats_t copy_stats;
+    int32_t ret;
+
+    ret = z_impl_meters_get_poll_stats(&copy_stats);
+
+    if(k_usermode_to_copy(stats, &copy_stats, sizeof(*stats)) != 0){
+        return -EPERM;
+    }
+
+    return ret;
+}
+
+#include <zephyr/syscalls/meters_get_poll_stats_mrsh.c>
+#endif
+
+int32_t z_impl_meters_request_fresh(uint32_t idx, uint32_t max_age_ms, k_timeout_t timeout)
+{
+    meters_context_t *context = &meters_context;
+    meters_tools_context_t *tool = context->tools;
+    k_timepoint_t end = sys_timepoint_calc(timeout);
+    bool is_requested = false;
+    int32_t ret;
+
+    if(tool == NULL)
+        return -ENODEV;
+
+    meters_data_lock(tool);
+    {
+        while(true){
+            if(idx >= context->item_count){
+                ret = -ERANGE;
+                break;
+            }
+
+            meters_item_t *item = &context->items[idx];
+            if(item->is_valid_values && ((k_uptime_get_32() - item->timemark) <= max_age_ms)){
+                ret = 0;
+                break;
+            }
+
+            if(context->parameters[idx].type->read == NULL){
+                ret = -ENOTSUP;
+                break;
+            }
+
+            // наше чтение прошло, а значение так и не обновилось
+            if(is_requested && !(tool->fresh_pending & BIT(idx))){
+                ret = (item->link.backoff_ms != 0) ? item->link.driver_error : -EIO;
+                break;
+            }
+
+#ifdef CONFIG_STRIM_METERS2_BUS485_ENABLE
+            if(!(tool->fresh_pending & BIT(idx))){
+                tool->fresh_pending |= BIT(idx);
+                meters_poll485_urgent(context, idx);
+            }
+#endif
+            is_requested = true;
+
+            // семафор вместо условной переменной: та перезахватывает мьютекс без таймаута
+            tool->fresh_waiters++;
+            meters_data_unlock(tool);
+            ret = k_sem_take(&tool->fresh_done, sys_timepoint_timeout(end));
+            meters_data_lock(tool);
+
+            if(ret != 0){
+                // отсчет мог быть выдан вместе с таймаутом, тогда он разбудит следующего вхолостую
+                if(tool->fresh_waiters != 0)
+                    tool->fresh_waiters--;
+                ret = -EAGAIN;
+                break;
+            }
+        }
+    }
+    meters_data_unlock(tool);
+
+    return ret;
+}
+
+#if CONFIG_USERSPACE
+static int32_t z_vrfy_meters_request_fresh(uint32_t idx, uint32_t max_age_ms, k_timeout_t timeout)
+{
+    return z_impl_meters_request_fresh(idx, max_age_ms, timeout);
+}
+
+#include <zephyr/syscalls/meters_request_fresh_mrsh.c>
+#endif
+
+int32_t z_impl_meters_take_snapshot(k_timeout_t timeout)
+{
+#ifdef CONFIG_STRIM_METERS2_BUS485_ENABLE
+    return meters_snapshot_take(&meters_context, timeout);
+#else
+    ARG_UNUSED(timeout);
+    return -ENOTSUP;
+#endif
+}
+
+#if CONFIG_USERSPACE
+static int32_t z_vrfy_meters_take_snapshot(k_timeout_t timeout)
+{
+    return z_impl_meters_take_snapshot(timeout);
+}
+
+#include <zephyr/syscalls/meters_take_snapshot_mrsh.c>
+#endif
+
+int32_t z_impl_meters_get_snapshot(meters_snapshot_t *snapshot)
+{
+    if(snapshot == NULL)
+        return -EINVAL;
+
+#ifdef CONFIG_STRIM_METERS2_BUS485_ENABLE
+    return meters_snapshot_get(&meters_context, snapshot);
+#else
+    return -ENODATA;
+#endif
+}
+
+#if CONFIG_USERSPACE
+static int32_t z_vrfy_meters_get_snapshot(meters_snapshot_t *snapshot)
+{
+    meters_snapshot_t copy_snapshot;
+    int32_t ret;
+
+    ret = z_impl_meters_get_snapshot(&copy_snapshot);
+
+    if(k_usermode_to_copy(snapshot, &copy_snapshot, sizeof(*snapshot)) != 0){
+        return -EPERM;
+    }
+
+    return ret;
+}
+
+#include <zephyr/syscalls/meters_get_snapshot_mrsh.c>
+#endif
+
+int32_t z_impl_meters_get_balance(meters_balance_t *balance)
+{
+    if(balance == NULL)
+        return -EINVAL;
+
+#if CONFIG_STRIM_METERS2_BALANCE
+    return meters_balance_get(&meters_context, balance);
+#else
+    return -ENOTSUP;
+#endif
+}
+
+#if CONFIG_USERSPACE
+static int32_t z_vrfy_meters_get_balance(meters_balance_t *balance)
+{
+    meters_balance_t copy_balance;
+    int32_t ret;
+
+    ret = z_impl_meters_get_balance(&copy_balance);
+
+    if(k_usermode_to_copy(balance, &copy_balance, sizeof(*balance)) != 0){
+        return -EPERM;
+    }
+
+    return ret;
+}
+
+#include <zephyr/syscalls/meters_get_balance_mrsh.c>
+#endif
+
+#if CONFIG_STRIM_METERS2_POLL_THREAD
+enum{METERS_SUPERVISOR_PERIOD_MS = 1000};
+
+static void meters_poll485_start(meters_context_t *context)
+{
+    meters_tools_context_t *tool = context->tools;
+
+#if CONFIG_USERSPACE
+    k_tid_t thread_id = meters_poll485_thread_run(context);
+    k_object_access_grant(&tool->data_access_mutex, &tool->poll485_thread);
+    k_object_access_grant(&tool->reinitSem, &tool->poll485_thread);
+    k_object_access_grant(&tool->poll_wake, &tool->poll485_thread);
+    k_object_access_grant(&tool->fresh_done, &tool->poll485_thread);
+    k_object_access_grant(&tool->job_done, &tool->poll485_thread);
+#if CONFIG_STRIM_METERS2_BUS485_SIM
+    meters_sim485_grant(&tool->poll485_thread);
+#else
+    k_object_access_grant(tool->bus485, &tool->poll485_thread);
+#endif
+#if CONFIG_STRIM_METERS2_CAPTURE
+    meters_capture_grant(&tool->poll485_thread);
+#endif
+    k_mem_domain_add_thread(&app0_domain, thread_id);
+#else
+    ARG_UNUSED(tool);
+    meters_poll485_thread_run(context);
+#endif
+}
+
+// Мьютекс данных погибшего потока: новые захваты ждут, пока не уйдут все, кто в его очереди
+static bool meters_supervisor_recover_data(meters_tools_context_t *tool)
+{
+    if(tool->poll_data_users == 0)
+        return true;
+
+    if(!atomic_get(&tool->is_data_recovery)){
+        LOG_ERR("poll thread died holding data mutex, recreating it");
+        atomic_set(&tool->is_data_recovery, 1);
+    }
+
+    if(atomic_get(&tool->data_users) != 0)
+        return false;
+
+    // данные, которые поток менял при гибели, могут остаться недописанными
+    k_mutex_init(&tool->data_access_mutex);
+    tool->poll_data_users = 0;
+    atomic_set(&tool->is_data_recovery, 0);
+    return true;
+}
+
+/**
+ * Поток опроса сам не завершается: ошибки драйверов обрабатываются в нем.
+ * Погибнуть он может только от фатальной ошибки (нарушение доступа в
+ * пользовательском режиме, переполнение стека), тогда супервизор освобождает
+ * захваченные им мьютекс данных и линию, завершает его запросы с -ECANCELED
+ * и запускает поток заново.
+ */
+static void meters_supervisor_handler(struct k_work *work)
+{
+    meters_context_t *context = &meters_context;
+    meters_tools_context_t *tool = context->tools;
+    int32_t ret;
+
+    if(k_thread_join(&tool->poll485_thread, K_NO_WAIT) == 0){
+        if(!meters_supervisor_recover_data(tool)){
+            k_work_schedule(k_work_delayable_from_work(work), K_MSEC(METERS_LOCK_RETRY_MS));
+            return;
+        }
+
+        ret = meters_bus485_abandon(context);
+        meters_poll485_cancel_jobs(context);
+        if(ret != 0){
+            // новый поток встал бы в ожидании линии навсегда, пробуем отпустить ее снова
+            LOG_ERR("poll thread died holding bus485, release error %d, retrying", ret);
+            k_work_schedule(k_work_delayable_from_work(work), K_MSEC(METERS_SUPERVISOR_PERIOD_MS));
+            return;
+        }
+
+        LOG_ERR("poll thread died, restarting");
+        meters_data_lock(tool);
+        {
+            tool->poll_stats.restarts++;
+            tool->poll_stats.last_restart_timemark = k_uptime_get_32();
+        }
+        meters_data_unlock(tool);
+
+        meters_poll485_start(context);
+    }
+
+    k_work_schedule(k_work_delayable_from_work(work), K_MSEC(METERS_SUPERVISOR_PERIOD_MS));
+}
+
+K_WORK_DELAYABLE_DEFINE(meters_supervisor_work, meters_supervisor_handler);
+
+#if CONFIG_STRIM_METERS2_FATAL_HANDLER
+// Фатальная ошибка потока опроса завершает только его, остальное - как обработчик по умолчанию
+void k_sys_fatal_error_handler(unsigned int reason, const struct arch_esf *esf)
+{
+    ARG_UNUSED(esf);
+
+    if((reason != K_ERR_KERNEL_PANIC) && !k_is_in_isr() &&
+        (k_current_get() == &tools_context.poll485_thread))
+        return;
+
+    LOG_PANIC();
+    LOG_ERR("Halting system");
+    k_fatal_halt(reason);
+}
+#endif
+#endif
+
+// is_static - постоянная таблица из devicetree, в банк она копируется только при первой замене
+static int32_t meters_start(const meter_parameters_t *parameters, uint8_t count, bool is_static){
     meters_context_t * context = &meters_context;
     int32_t ret;
     
@@ -297,31 +988,94 @@ int32_t meters_init(meter_parameters_t *parameters, uint8_t count){
         return -EINVAL;
 
     k_mutex_init(&tool->data_access_mutex);
+    k_poll_signal_init(&tool->data_update);
     k_sem_init(&tool->reinitSem, 0 ,1);
+    k_sem_init(&tool->fresh_done, 0, K_SEM_MAX_LIMIT);
+    tool->fresh_pending = 0;
+    tool->fresh_waiters = 0;
+#if CONFIG_STRIM_METERS2_POLL_THREAD
+    k_sem_init(&tool->poll_wake, 0, 1);
+    atomic_set(&tool->data_users, 0);
+    atomic_set(&tool->is_data_recovery, 0);
+    tool->poll_data_users = 0;
+#endif
+#ifdef CONFIG_STRIM_METERS2_BUS485_ENABLE
+    k_sem_init(&tool->job_done, 0, 1);
+    tool->job = NULL;
+    tool->is_job_running = false;
+    tool->is_bus_held = false;
+#endif
+
+    STRUCT_SECTION_FOREACH(meters_driver, driver){
+        if(driver->pool != NULL)
+            driver->pool->busy = 0;
+    }
+
+    context->item_count = 0;
+    ret = meters_reconfig_stage(context, parameters, count, true, is_static);
+    if(ret != 0)
+        return ret;
+    meters_reconfig_swap(context);
 
-    meters_initialize_context(context, parameters, count);
-    
-    (void)ret;
 #if CONFIG_USERSPACE
     k_mem_domain_init(&app0_domain, ARRAY_SIZE(app0_parts), app0_parts);
 #endif
-#ifdef CONFIG_STRIM_METERS_BUS485_ENABLE
-    tool->bus485 = DEVICE_DT_GET_OR_NULL(DT_CHOSEN(strim_meter_bus485));
+#ifdef CONFIG_STRIM_METERS2_BUS485_ENABLE
+#if CONFIG_STRIM_METERS2_BUS485_SIM
+    tool->bus485 = NULL;
+    meters_sim485_clear();
+    meters_sim485_populate(context->parameters, context->item_count);
+#else
+    tool->bus485 = DEVICE_DT_GET_OR_NULL(METERS_BUS485_NODE);
     if(tool->bus485 == NULL){
         LOG_ERR("bus485 init error nullpoint");
         return -ENXIO;
     }
+#endif
 
 
-#if CONFIG_USERSPACE
-    k_tid_t thread_id = meters_poll485_thread_run(context);
-    k_object_access_grant(&tool->data_access_mutex, &tool->poll485_thread);
-    k_object_access_grant(tool->bus485, &tool->poll485_thread);
-    k_mem_domain_add_thread(&app0_domain, thread_id);
+#if CONFIG_STRIM_METERS2_POLL_THREAD
+    meters_poll485_start(context);
+    k_work_schedule(&meters_supervisor_work, K_MSEC(METERS_SUPERVISOR_PERIOD_MS));
 #else
-    meters_poll485_thread_run(context);
+    meters_poll485_workq_run(context);  // работы выполняются в режиме ядра, доступ выдавать не нужно
 #endif
 #endif
 
     return 0;
 }
+
+int32_t meters_init(const meter_parameters_t *parameters, uint8_t count){
+    return meters_start(parameters, count, false);
+}
+
+#if CONFIG_STRIM_METERS2_DT_TOPOLOGY
+#define METERS_DT_TYPE_DECLARE(node) METERS_TYPE_DECLARE(DT_STRING_TOKEN(node, type));
+
+#define METERS_DT_PARAMETERS(node)                                  \
+    {                                                               \
+        .type = METERS_TYPE(DT_STRING_TOKEN(node, type)),           \
+        .address = DT_PROP(node, address),                          \
+        .baudrate = DT_PROP_OR(node, baudrate, 0),                  \
+        .current_factor = DT_PROP(node, current_factor),            \
+        .poll_period = DT_PROP(node, poll_period_ms),               \
+        .balance_role = DT_ENUM_IDX(node, balance),                 \
+    }
+
+DT_FOREACH_CHILD_STATUS_OKAY(METERS_DT_NODE, METERS_DT_TYPE_DECLARE)
+
+static const meter_parameters_t meters_dt_parameters[] = {
+    DT_FOREACH_CHILD_STATUS_OKAY_SEP(METERS_DT_NODE, METERS_DT_PARAMETERS, (,))
+};
+
+static int meters_dt_init(void)
+{
+    int32_t ret = meters_start(meters_dt_parameters, ARRAY_SIZE(meters_dt_parameters), true);
+    if(ret != 0)
+        LOG_ERR("meters init from devicetree error: %d", ret);
+
+    return 0;
+}
+
+SYS_INIT(meters_dt_init, APPLICATION, CONFIG_STRIM_METERS2_INIT_PRIORITY);
+#endif
@@ -3,16 +3,17 @@
 #include <stdint.h>
 #include <zephyr/kernel.h>
 
-typedef enum {
-    meters_type_extern_ac,
-    meters_type_extern_dc,
-#ifdef CONFIG_STRIM_METERS2_BUS485_ENABLE
-    meters_type_CE318,
-    meters_type_Mercury234,
-    meters_type_SPM90,
-#endif
-    meters_type_lastIndex
-}meters_type_t;
+// Тип счетчика - указатель на описание драйвера, зарегистрированного
+// через METERS_DRIVER_DEFINE
+struct meters_driver;
+typedef const struct meters_driver *meters_type_t;
+
+#define METERS_TYPE_DECLARE(name) extern const struct meters_driver UTIL_CAT(meters_driver_, name)
+#define METERS_TYPE(name) (&UTIL_CAT(meters_driver_, name))
+
+// Внешние счетчики, значения которых задаются через meters_set_values
+METERS_TYPE_DECLARE(extern_ac);
+METERS_TYPE_DECLARE(extern_dc);
 
 typedef enum{
     meters_current_type_dc,
@@ -43,11 +44,20 @@ typedef struct{
     meters_current_type_t type;
 }meters_values_t;
 
+// Место счетчика в балансе фидера
+typedef enum{
+    meters_balance_none = 0,
+    meters_balance_parent,      // ввод, с ним сравнивается сумма отходящих
+    meters_balance_child
+}meters_balance_role_t;
+
 typedef struct{
     meters_type_t type;
     uint32_t address;
     uint32_t baudrate;
-    uint32_t current_factor;
+    uint32_t current_factor;    // коэффициент трансформации, значения опрашиваемых счетчиков умножаются на него
+    uint32_t poll_period;   // мс, 0 - опрос в каждом цикле
+    meters_balance_role_t balance_role;
 }meter_parameters_t;
 
 typedef struct{
@@ -62,11 +72,130 @@ typedef struct{
     uint32_t count;
 }meters_values_collection_t;
 
-int32_t meters_init(meter_parameters_t *parameters, uint8_t count);
+enum{METERS_LINK_RTT_BUCKETS = 8};
+
+// Границы корзин гистограммы времени ответа, мс; последняя корзина - все, что больше
+extern const uint16_t meters_link_rtt_bounds_ms[METERS_LINK_RTT_BUCKETS - 1];
+
+// Статистика обмена со счетчиком в цикле опроса
+typedef struct{
+    uint32_t requests;
+    uint32_t successes;
+    uint32_t timeouts;
+    uint32_t crc_errors;            // искаженные кадры
+    uint32_t address_mismatches;    // ответ с чужим адресом
+    uint32_t protocol_errors;       // ошибки и исключения счетчика, неожиданный ответ
+    int32_t last_error;
+    uint32_t last_success_timemark; // мс от старта, 0 - еще не было
+    uint32_t last_failure_timemark;
+    uint32_t rtt_max_ms;
+    uint32_t rtt_histogram[METERS_LINK_RTT_BUCKETS];
+    uint32_t driver_failures;       // чтения, завершившиеся ошибкой драйвера
+    int32_t driver_error;           // код последней из них
+    uint32_t backoff_ms;            // пауза в опросе счетчика после ошибок, 0 - опрашивается
+}meters_link_stats_t;
+
+// Состояние потока опроса
+typedef struct{
+    uint32_t cycles;                // завершенных циклов опроса, в режиме очереди работ - чтений
+    uint32_t restarts;              // перезапусков потока после его гибели
+    uint32_t last_restart_timemark; // мс от старта, 0 - перезапусков не было
+    uint32_t stack_size;            // стек контекста опроса, байт
+    uint32_t stack_unused;          // ни разу не занятая часть, 0 - без CONFIG_INIT_STACKS
+    uint32_t bufs_peak;             // буферов кадров занято одновременно, наибольшее
+    uint32_t bufs_failures;         // запросов буфера, оставшихся без него
+}meters_poll_stats_t;
+
+// Величины баланса, у счетчиков постоянного тока учитываются только мощность и энергия
+typedef struct{
+    float power;            // Вт
+    float current[3];       // А по фазам
+    int64_t energy;         // Вт*с с начала учета
+}meters_balance_sums_t;
+
+typedef struct{
+    meters_balance_sums_t parent;
+    meters_balance_sums_t children;     // сумма отходящих
+    meters_balance_sums_t imbalance;    // ввод минус отходящие
+    float power_percent;    // небаланс мощности, % от ввода
+    float energy_percent;   // потери энергии с начала учета, % от ввода
+    uint32_t parent_index;
+    uint32_t children_mask;
+    uint32_t stale_mask;    // входы без достоверных значений не старше CONFIG_STRIM_METERS2_VALID_DATA_TIMEOUT
+    uint32_t since_timemark; // мс от старта, начало учета энергии
+    int32_t is_valid;       // все входы свежие и учет энергии начат
+}meters_balance_t;
+
+// Показания счетчика в согласованном снимке
+typedef struct{
+    uint64_t energy;        // активная энергия, Вт*с
+    float power;            // суммарная активная мощность, Вт
+    int32_t result;         // 0 или ошибка: -ENOTSUP - снимок не поддерживается, -EAGAIN - счетчик в паузе
+    uint32_t offset_us;     // начало чтения от начала снимка
+    uint32_t duration_us;   // показания сняты внутри [offset_us, offset_us + duration_us]
+}meters_snapshot_item_t;
+
+typedef struct{
+    meters_snapshot_item_t items[CONFIG_STRIM_METERS2_ITEMS_MAX_COUNT];
+    uint32_t count;
+    uint32_t sequence;      // номер снимка с 1
+    uint32_t timemark;      // мс от старта, начало снимка
+    uint32_t skew_us;       // наибольший разброс моментов чтения между прочитанными счетчиками
+}meters_snapshot_t;
+
+/**
+ * Таблица параметров копируется и после вызова не нужна. При описании
+ * счетчиков в devicetree инициализация выполняется автоматически из
+ * постоянной таблицы, она копируется только при первой замене таблицы.
+ */
+int32_t meters_init(const meter_parameters_t *parameters, uint8_t count);
 int32_t meters_reinit(void);
+
+/**
+ * Замена таблицы счетчиков без остановки опроса. Таблица собирается
+ * отдельно и подменяется между чтениями; у счетчиков с прежними типом,
+ * адресом и скоростью сохраняются значения, статистика и состояние драйвера.
+ * -EINPROGRESS - таблица принята, но поток опроса еще не перешел на нее.
+ */
+int32_t meters_reconfigure(const meter_parameters_t *parameters, uint8_t count);
+int32_t meters_get_parameters(meter_parameters_t *parameters, uint8_t size);
 __syscall int32_t meters_set_values(uint32_t idx, const meters_values_t *buffer);
 __syscall int32_t meters_get_values(uint32_t idx, meters_values_t *buffer);
 __syscall int32_t meters_get_all(meters_values_collection_t *buffer);
+__syscall int32_t meters_get_link_stats(uint32_t idx, meters_link_stats_t *stats);
+__syscall int32_t meters_get_poll_stats(meters_poll_stats_t *stats);
+
+/**
+ * Ожидание значения не старше max_age_ms. Если кэш старее, счетчик
+ * читается вне очереди, раньше остальных; вызовы для одного счетчика,
+ * пришедшие до конца чтения, ждут одну транзакцию. Само значение
+ * забирается через meters_get_values.
+ * -EAGAIN - не дождались за timeout, -ENOTSUP - значения счетчика задаются
+ * извне, иначе код ошибки драйвера или -EIO, если чтение не обновило значение.
+ */
+__syscall int32_t meters_request_fresh(uint32_t idx, uint32_t max_age_ms, k_timeout_t timeout);
+
+/**
+ * Согласованный снимок энергии и мощности всех счетчиков линии: вместо
+ * очередного цикла счетчики читаются подряд одной пачкой, минимальным
+ * набором запросов. Снимок забирается через meters_get_snapshot, его
+ * skew_us - измеренная граница расхождения во времени между показаниями.
+ * Широковещательная фиксация показаний не применяется, причины описаны в
+ * meters_snapshot.h.
+ * -EAGAIN - пачка не дождалась очереди за timeout.
+ */
+__syscall int32_t meters_take_snapshot(k_timeout_t timeout);
+// -ENODATA - снимков еще не было
+__syscall int32_t meters_get_snapshot(meters_snapshot_t *snapshot);
+
+/**
+ * Баланс фидера: ввод (balance_role = meters_balance_parent) против суммы
+ * отходящих (meters_balance_child). Суммы обновляются при каждой записи
+ * значений, поэтому чтение дешевое. Энергия считается от момента, когда
+ * все входы передали значения после смены таблицы счетчиков.
+ * -ENODATA - ввод не назначен, -ENOTSUP - баланс выключен в Kconfig.
+ */
+__syscall int32_t meters_get_balance(meters_balance_t *balance);
 const uint8_t * meters_get_typename(meters_type_t type);
 
 #include <zephyr/syscalls/meters.h>
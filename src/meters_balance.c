@@ -0,0 +1,171 @@
+#include "meters_balance.h"
+#include <string.h>
+
+LOG_MODULE_DECLARE(meters2, CONFIG_STRIM_METERS2_LOG_LEVEL);
+
+// суммы с плавающей точкой периодически пересчитываются целиком, чтобы не копилась ошибка вычитаний
+enum{BALANCE_RESYNC_UPDATES = 64};
+
+typedef struct{
+    meters_balance_sums_t inputs[METERS_ITEMS_MAX_COUNT];  // последние значения входов
+    uint64_t energy[METERS_ITEMS_MAX_COUNT];        // показания счетчиков энергии
+    uint64_t energy_base[METERS_ITEMS_MAX_COUNT];   // они же в начале учета
+    meters_balance_sums_t children;
+    int32_t parent;             // -1 - ввод не назначен
+    uint32_t children_mask;
+    uint32_t seen_mask;         // входы, передавшие значения после перестройки
+    uint32_t since_timemark;
+    uint32_t updates;           // изменений сумм после пересчета
+    bool is_started;            // учет энергии начат
+}balance_context_t;
+
+// перестраивается потоком опроса при смене таблицы, поэтому в разделе приложения
+static METERS_APP_DMEM balance_context_t balance = {.parent = -1};
+
+static uint32_t balance_members(void)
+{
+    return balance.children_mask | BIT(balance.parent);
+}
+
+static void balance_accumulate(meters_balance_sums_t *sums, const meters_balance_sums_t *add,
+                            const meters_balance_sums_t *sub)
+{
+    sums->power += add->power - sub->power;
+    for(uint32_t i = 0; i < ARRAY_SIZE(sums->current); i++)
+        sums->current[i] += add->current[i] - sub->current[i];
+    sums->energy += add->energy - sub->energy;
+}
+
+static void balance_resync(void)
+{
+    static const meters_balance_sums_t zero;
+
+    memset(&balance.children, 0, sizeof(balance.children));
+    for(uint32_t i = 0; i < ARRAY_SIZE(balance.inputs); i++){
+        if(balance.children_mask & BIT(i))
+            balance_accumulate(&balance.children, &balance.inputs[i], &zero);
+    }
+    balance.updates = 0;
+}
+
+// Начало учета энергии: все входы передали значения, их показания берутся за ноль
+static void balance_start(void)
+{
+    uint32_t members = balance_members();
+
+    for(uint32_t i = 0; i < ARRAY_SIZE(balance.inputs); i++){
+        if(members & BIT(i)){
+            balance.energy_base[i] = balance.energy[i];
+            balance.inputs[i].energy = 0;
+        }
+    }
+    balance.children.energy = 0;
+    balance.since_timemark = k_uptime_get_32();
+    balance.is_started = true;
+}
+
+void meters_balance_update(meters_context_t *context, uint32_t item_idx)
+{
+    const meters_values_t *values = &context->items[item_idx].values;
+    meters_balance_sums_t input = {0};
+
+    if((balance.parent < 0) || !(balance_members() & BIT(item_idx)))
+        return;
+
+    // у счетчиков постоянного тока фаз нет, ток в баланс не входит
+    if(values->type == meters_current_type_ac){
+        input.power = values->AC.power_active;
+        memcpy(input.current, values->AC.current, sizeof(input.current));
+        balance.energy[item_idx] = values->AC.energy_active;
+    }
+    else {
+        input.power = values->DC.power;
+        balance.energy[item_idx] = values->DC.energy;
+    }
+
+    if(balance.is_started)
+        input.energy = (int64_t)(balance.energy[item_idx] - balance.energy_base[item_idx]);
+
+    if(balance.children_mask & BIT(item_idx)){
+        balance_accumulate(&balance.children, &input, &balance.inputs[item_idx]);
+        balance.updates++;
+    }
+    balance.inputs[item_idx] = input;
+    balance.seen_mask |= BIT(item_idx);
+
+    if(!balance.is_started && (balance.seen_mask == balance_members()))
+        balance_start();
+
+    if(balance.updates >= BALANCE_RESYNC_UPDATES)
+        balance_resync();
+}
+
+void meters_balance_rebuild(meters_context_t *context)
+{
+    memset(&balance, 0, sizeof(balance));
+    balance.parent = -1;
+
+    for(uint32_t i = 0; i < context->item_count; i++){
+        if(context->parameters[i].balance_role == meters_balance_parent)
+            balance.parent = i;
+        else if(context->parameters[i].balance_role == meters_balance_child)
+            balance.children_mask |= BIT(i);
+    }
+
+    if(balance.parent < 0)
+        return;
+
+    for(uint32_t i = 0; i < context->item_count; i++){
+        if((balance_members() & BIT(i)) && context->items[i].is_valid_values)
+            meters_balance_update(context, i);
+    }
+}
+
+int32_t meters_balance_get(meters_context_t *context, meters_balance_t *result)
+{
+    meters_tools_context_t *tool = context->tools;
+    int32_t ret = 0;
+
+    if(tool == NULL)
+        return -ENODEV;
+
+    meters_data_lock(tool);
+    {
+        if(balance.parent < 0){
+            ret = -ENODATA;
+        }
+        else {
+            uint32_t members = balance_members();
+            uint32_t now = k_uptime_get_32();
+
+            memset(result, 0, sizeof(*result));
+            result->parent = balance.inputs[balance.parent];
+            result->children = balance.children;
+
+            result->imbalance.power = result->parent.power - result->children.power;
+            for(uint32_t i = 0; i < ARRAY_SIZE(result->imbalance.current); i++)
+                result->imbalance.current[i] = result->parent.current[i] - result->children.current[i];
+            result->imbalance.energy = result->parent.energy - result->children.energy;
+
+            if(result->parent.power != 0.0f)
+                result->power_percent = result->imbalance.power * 100.0f / result->parent.power;
+            if(result->parent.energy != 0)
+                result->energy_percent = (float)result->imbalance.energy * 100.0f / (float)result->parent.energy;
+
+            for(uint32_t i = 0; i < context->item_count; i++){
+                const meters_item_t *item = &context->items[i];
+                if((members & BIT(i)) && (!item->is_valid_values ||
+                    ((now - item->timemark) > CONFIG_STRIM_METERS2_VALID_DATA_TIMEOUT)))
+                    result->stale_mask |= BIT(i);
+            }
+
+            result->parent_index = balance.parent;
+            result->children_mask = balance.children_mask;
+            result->since_timemark = balance.is_started ? balance.since_timemark : 0;
+            result->is_valid = balance.is_started && (result->stale_mask == 0);
+        }
+    }
+    meters_data_unlock(tool);
+
+    return ret;
+}
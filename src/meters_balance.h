@@ -0,0 +1,14 @@
+#pragma once
+
+#include "meters_private.h"
+
+/**
+ * Баланс фидера по ролям из таблицы счетчиков. Все функции, кроме
+ * meters_balance_get, вызываются под data_access_mutex. Перестройка идет из
+ * потока опроса, который при CONFIG_USERSPACE работает в режиме пользователя.
+ */
+// Роли взяты из новой таблицы, значения сохраненных счетчиков учитываются сразу
+void meters_balance_rebuild(meters_context_t *context);
+// Значения счетчика записаны, суммы правятся на разницу с прежними
+void meters_balance_update(meters_context_t *context, uint32_t item_idx);
+int32_t meters_balance_get(meters_context_t *context, meters_balance_t *result);
@@ -7,61 +7,165 @@
 #include <zephyr/logging/log.h>
 #include <zephyr/sys/byteorder.h>
 #include <zephyr/shell/shell.h>
+#include <zephyr/sys/iterable_sections.h>
+#include <zephyr/devicetree.h>
 
-typedef struct{
-    meters_values_dc_t shadow;
-}meters_data_extern_dc_t;
-
-typedef struct{
-    meters_values_ac_t shadow;
-}meters_data_extern_ac_t;
-
-typedef struct {
-    meters_values_dc_t shadow;
-}meters_data_spm90_t;
-
-typedef struct {
-    meters_values_ac_t shadow;
-}meters_data_ce318_t;
+#if CONFIG_STRIM_METERS2_DT_TOPOLOGY
+#define METERS_DT_NODE DT_COMPAT_GET_ANY_STATUS_OKAY(strim_meters)
+// запас на счетчики, добавленные во время работы
+#define METERS_ITEMS_MAX_COUNT \
+    (DT_CHILD_NUM_STATUS_OKAY(METERS_DT_NODE) + CONFIG_STRIM_METERS2_RUNTIME_SPARE_COUNT)
 
-typedef struct {
-    meters_values_ac_t shadow;
-}meters_data_mercury_t;
+#define METERS_DT_TYPE_COUNT(node, _name) + DT_ENUM_HAS_VALUE(node, type, _name)
+#define METERS_DRIVER_POOL_SIZE(_name) \
+    (CONFIG_STRIM_METERS2_RUNTIME_SPARE_COUNT \
+        DT_FOREACH_CHILD_STATUS_OKAY_VARGS(METERS_DT_NODE, METERS_DT_TYPE_COUNT, _name))
+#else
+#define METERS_ITEMS_MAX_COUNT CONFIG_STRIM_METERS2_ITEMS_MAX_COUNT
+#define METERS_DRIVER_POOL_SIZE(_name) CONFIG_STRIM_METERS2_ITEMS_MAX_COUNT
+#endif
 
-typedef union{
-    meters_data_extern_ac_t extern_ac;
-    meters_data_extern_dc_t extern_dc;
-#ifdef CONFIG_STRIM_METERS2_BUS485_ENABLE
-    meters_data_spm90_t spm90;
-    meters_data_ce318_t ce318;
-    meters_data_mercury_t mercury;
-#endif    
-}meters_data_t;
+#if CONFIG_USERSPACE
+#include <zephyr/app_memory/app_memdomain.h>
+extern struct k_mem_partition app_part0;
+#define METERS_APP_BMEM K_APP_BMEM(app_part0)
+#define METERS_APP_DMEM K_APP_DMEM(app_part0)
+#else
+#define METERS_APP_BMEM
+#define METERS_APP_DMEM
+#endif
 
 typedef struct{
     meters_values_t values;
-    meters_data_t data;
+    void *data; // состояние драйвера из его пула
     uint32_t is_valid_values;
     uint32_t timemark;  
     uint32_t error_timemark;
+    uint32_t poll_timemark;
+    uint32_t read_us;   // длительность последнего чтения
     uint32_t bad_responce_count;
+    uint32_t failures;          // ошибок драйвера подряд
+    uint32_t backoff_timemark;  // время последней ошибки драйвера
+    meters_link_stats_t link;
 }meters_item_t;
 
+#if CONFIG_STRIM_METERS2_BENCH
+// Счетчики транспортного уровня bus485, время в мкс
+typedef struct{
+    uint32_t busy_us;       // от захвата линии до ее освобождения
+    uint32_t pause_us;      // выдержка тишины перед запросом
+    uint32_t timeout_us;    // ожидание ответа, закончившееся таймаутом
+    uint32_t frames_tx;
+    uint32_t bytes_tx;
+    uint32_t frames_rx;
+    uint32_t bytes_rx;
+}meters_bench_counters_t;
+
+// Итоги одного цикла опроса по каждому счетчику
+typedef struct{
+    meters_bench_counters_t items[METERS_ITEMS_MAX_COUNT];
+    uint32_t wall_us[METERS_ITEMS_MAX_COUNT];
+    uint32_t cycle_us;
+    uint32_t cycle;
+}meters_bench_cycle_t;
+#endif
+
+#ifdef CONFIG_STRIM_METERS2_BUS485_ENABLE
+// Буферы кадров линии: драйверы берут их на время транзакции вместо
+// массивов на стеке. Обмены идут по одному из контекста опроса, поэтому
+// хватает пары буферов каждого размера.
+enum{METERS_BUS485_BUF_LARGE_SIZE = 256};   // кадр SMP с заменой байт, ответ Modbus на 125 регистров
+enum{METERS_BUS485_BUF_SMALL_SIZE = 64};
+enum{METERS_BUS485_BUF_LARGE_COUNT = 2};
+enum{METERS_BUS485_BUF_SMALL_COUNT = 2};
+
+typedef struct{
+    uint8_t large[METERS_BUS485_BUF_LARGE_COUNT][METERS_BUS485_BUF_LARGE_SIZE];
+    uint8_t small[METERS_BUS485_BUF_SMALL_COUNT][METERS_BUS485_BUF_SMALL_SIZE];
+    uint32_t busy;          // маска: сначала большие, затем малые
+    uint32_t busy_peak;     // наибольшее число занятых одновременно
+    uint32_t failures;      // запросов, не получивших буфер
+}meters_bus485_bufs_t;
+#endif
+
+struct meters_context;
+typedef int32_t (*meters_job_t)(struct meters_context *context, void *data);
+enum{METERS_JOB_DATA_SIZE = 48};
+
 typedef struct{
 #ifdef CONFIG_STRIM_METERS2_BUS485_ENABLE
     const struct device *bus485;
+    uint32_t bus_idle_cycles;
+    uint32_t is_bus_idle_valid;
+    uint32_t frame_bytes;   // принято в текущей транзакции
+    uint32_t baudrate;      // скорость текущей транзакции
+    uint32_t is_bus_held;   // линия захвачена контекстом опроса
+    meters_bus485_bufs_t bufs;
 #endif
-    struct k_mutex data_access_mutex;
-    struct k_sem reinitSem;
+#ifdef CONFIG_STRIM_METERS2_BUS485_ENABLE
+    meters_link_stats_t *link_stats;    // статистика опрашиваемого счетчика
+    uint32_t link_send_cycles;
+    uint32_t link_recv_cycles;
+#endif
+#if CONFIG_STRIM_METERS2_BENCH
+    meters_bench_counters_t bench;
+    meters_bench_cycle_t bench_cycle;   // последний завершенный цикл
+    uint32_t bench_busy_cycles;
+#endif
+    struct k_mutex data_access_mutex;   // берется через meters_data_lock
+#if CONFIG_STRIM_METERS2_POLL_THREAD
+    atomic_t data_users;                // прочие потоки, держащие или ждущие мьютекс
+    atomic_t is_data_recovery;          // супервизор пересоздает мьютекс погибшего потока опроса
+    uint32_t poll_data_users;           // то же для потока опроса, меняет только он
+#endif
+    struct k_poll_signal data_update;   // поднимается при каждой записи значений
+    struct k_sem reinitSem;             // новая таблица счетчиков применена
+    uint32_t reconfig_pending;
+    uint32_t reconfig_count;
+    int8_t reconfig_map[METERS_ITEMS_MAX_COUNT];  // прежний индекс счетчика или -1 для нового
+    const meter_parameters_t *reconfig_parameters; // банк новой таблицы или постоянная таблица
+    uint32_t reconfig_borrowed;         // прежние счетчики, ячейки пула которых переходят к новым
+    uint32_t reconfig_deferred;         // новые счетчики, инициализируемые при переходе
+    meters_poll_stats_t poll_stats;
+    uint32_t fresh_pending;             // маска срочных чтений по meters_request_fresh
+    uint32_t fresh_waiters;             // ждущих срочного чтения
+    struct k_sem fresh_done;            // по отсчету каждому ждущему, см. meters_fresh_wake
+#ifdef CONFIG_STRIM_METERS2_BUS485_ENABLE
+    meters_job_t job;                   // диагностический запрос, ждет своей очереди
+    int32_t job_result;
+    uint32_t is_job_running;            // взят в работу, job_done еще не выдан
+    uint8_t job_data[METERS_JOB_DATA_SIZE] __aligned(8);
+    struct k_sem job_done;
+#endif
+#if CONFIG_STRIM_METERS2_POLL_THREAD
     struct k_thread poll485_thread;
     k_thread_stack_t *poll485_stack;
     size_t poll485_stack_size;
+    struct k_sem poll_wake;             // прерывает паузу между циклами
+#endif
+#if CONFIG_STRIM_METERS2_POLL_WORKQ
+    struct k_work_q poll_workq;
+    struct k_work_q *poll_queue;        // своя очередь или системная
+    struct k_work_delayable poll_works[METERS_ITEMS_MAX_COUNT];  // по индексу в таблице
+    struct k_work reconfig_work;
+    struct k_work job_work;
+#endif
 }meters_tools_context_t;
 
 typedef struct{
-    meters_item_t items[CONFIG_STRIM_METERS2_ITEMS_MAX_COUNT];
-    meter_parameters_t parameters[CONFIG_STRIM_METERS2_ITEMS_MAX_COUNT];
+    meters_item_t items[METERS_ITEMS_MAX_COUNT];
+    meter_parameters_t parameters[METERS_ITEMS_MAX_COUNT];
+}meters_bank_t;
+
+typedef struct meters_context{
+    // рабочая таблица и новая, которая собирается при переконфигурации;
+    // копии нужны и для доступа потока опроса в пользовательском режиме.
+    // Таблица из devicetree до первой замены используется без копии
+    meters_bank_t banks[2];
+    meters_item_t *items;
+    const meter_parameters_t *parameters;
     uint32_t item_count;
+    uint32_t bank;          // индекс рабочей таблицы
     meters_tools_context_t *tools;
 }meters_context_t;
 
@@ -69,5 +173,92 @@ extern meters_context_t meters_context;
 
 typedef int32_t (*meters_init_t)(meters_context_t *context, uint32_t itemIndex);
 typedef int32_t (*meters_read_t)(meters_context_t *context, uint32_t itemIndex);
+typedef void (*meters_format_address_t)(char *buffer, size_t size, uint32_t address);
+// Энергия (Вт*с) и суммарная мощность (Вт) минимальным числом запросов, значения счетчика не меняются
+typedef int32_t (*meters_sample_t)(meters_context_t *context, uint32_t itemIndex,
+                                uint64_t *energy, float *power);
+typedef int32_t (*meters_probe_t)(meters_context_t *context, uint32_t address, uint32_t baudrate,
+                                uint32_t timeout_ms, uint32_t *found_address);
+
+// Пул состояний драйвера, по одному на каждый счетчик этого типа
+typedef struct{
+    void *data;
+    size_t data_size;
+    uint32_t count;
+    uint32_t busy;      // занятые ячейки, по биту на ячейку
+}meters_driver_pool_t;
+
+// Параметры поиска счетчиков на шине
+typedef struct{
+    meters_probe_t probe;
+    uint32_t address_min;
+    uint32_t address_max;       // address_min > address_max - перебор адресов невозможен
+    uint32_t wildcard_address;  // на него отвечает любой счетчик протокола
+    uint32_t has_wildcard;
+    const uint32_t *baudrates;
+    uint32_t baudrate_count;
+}meters_scan_info_t;
+
+// Модель обмена за одно чтение счетчика для оценки загрузки линии
+typedef struct{
+    uint16_t requests;          // транзакций за чтение
+    uint16_t request_bytes;     // сумма по всем запросам
+    uint16_t response_bytes;    // сумма по всем ответам
+    uint16_t silence_x10;       // пауза перед запросом в десятых долях символа
+    uint16_t turnaround_ms;     // типичная задержка ответа счетчика
+}meters_budget_t;
+
+struct meters_driver{
+    const char *id;             // имя для METERS_TYPE()
+    const char *name;
+    meters_current_type_t values_type;
+    meters_init_t init;
+    meters_read_t read;
+    meters_format_address_t format_address;
+    meters_sample_t sample;     // для согласованного снимка, NULL - не поддерживается
+    const meters_scan_info_t *scan;
+    const meters_budget_t *budget;
+    meters_driver_pool_t *pool;
+};
+
+/**
+ * Регистрация драйвера счетчика. Поля описания передаются назначенными
+ * инициализаторами. Состояние _data_type выделяется статически,
+ * поэтому отключенный в Kconfig драйвер не занимает ни кода, ни памяти.
+ */
+#define METERS_DRIVER_DEFINE(_name, _data_type, ...)                                            \
+    BUILD_ASSERT(METERS_DRIVER_POOL_SIZE(_name) <= 32, "driver pool busy mask is 32 bits");     \
+    static METERS_APP_BMEM _data_type meters_driver_data_##_name[METERS_DRIVER_POOL_SIZE(_name)]; \
+    static METERS_APP_DMEM meters_driver_pool_t meters_driver_pool_##_name = {                  \
+        .data = meters_driver_data_##_name,                                                     \
+        .data_size = sizeof(_data_type),                                                        \
+        .count = ARRAY_SIZE(meters_driver_data_##_name),                                        \
+    };                                                                                          \
+    const STRUCT_SECTION_ITERABLE(meters_driver, meters_driver_##_name) = {                     \
+        .id = #_name,                                                                           \
+        .pool = &meters_driver_pool_##_name,                                                    \
+        __VA_ARGS__                                                                             \
+    }
+
+/**
+ * Захват data_access_mutex. Ожидание идет короткими попытками, а поток опроса
+ * учитывается отдельно: если он погибнет с мьютексом, супервизор дождется
+ * ухода остальных и создаст мьютекс заново. Повторно мьютекс не берется.
+ */
+void meters_data_lock(meters_tools_context_t *tool);
+void meters_data_unlock(meters_tools_context_t *tool);
+// Разбудить ждущих срочного чтения, вызывается под data_access_mutex
+void meters_fresh_wake(meters_tools_context_t *tool);
+
+// Коэффициент трансформации тока, 0 и 1 - счетчик включен напрямую
+static inline uint32_t meters_current_factor(const meter_parameters_t *param)
+{
+    return (param->current_factor > 1) ? param->current_factor : 1;
+}
+
+bool meters_is_type_registered(meters_type_t type);
+meters_type_t meters_get_type_by_id(const char *id);
+void meters_get_address_string(char *buffer, size_t size, const meter_parameters_t *param);
 
-meters_read_t meters_get_read_func(meters_type_t type);
\ No newline at end of file
+// Переход на новую таблицу счетчиков между чтениями, вызывается потоком опроса
+bool meters_reconfig_apply(meters_context_t *context);
\ No newline at end of file
@@ -1,31 +1,114 @@
 #include "meters_private.h"
+#if CONFIG_STRIM_METERS2_SPM90
 #include "meters_spm90.h"
+#endif
+#if CONFIG_STRIM_METERS2_CE318
 #include "meters_ce318.h"
+#endif
+#if CONFIG_STRIM_METERS2_MERCURY234
 #include "meters_mercury234.h"
+#endif
+#if CONFIG_STRIM_METERS2_SCAN
+#include "meters_scan.h"
+#endif
+#if CONFIG_STRIM_METERS2_BUS485_SIM
+#include "meters_sim485.h"
+#endif
+#if CONFIG_STRIM_METERS2_CAPTURE
+#include "meters_capture.h"
+#endif
+#if CONFIG_STRIM_METERS2_TUNNEL
+#include "meters_tunnel.h"
+#endif
+#if CONFIG_STRIM_METERS2_BUS485_ENABLE
+#include "meters_budget.h"
+#include "meters_codec.h"
+#include "meters_poll485.h"
+#endif
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
 
-static void get_meter_address(uint8_t * addr_str, uint32_t buffSize, meter_parameters_t *param);
 static void shell_values(const struct shell * shell, meters_values_t *values, bool horizontal);
 
-#if CONFIG_STRIM_METERS2_BUS485_ENABLE
+#if CONFIG_STRIM_METERS2_CE318 || CONFIG_STRIM_METERS2_MERCURY234 || CONFIG_STRIM_METERS2_SPM90
+  // Запросы на линию выполняются заданиями в контексте опроса и не отнимают у него bus485
+  enum{METERS_DIAG_TIMEOUT_MS = 10000};
+  // Свежее значение опрашиваемого счетчика отдается без обращения к линии
+  enum{METERS_DIAG_CACHE_MAX_AGE_MS = 2000};
+
+  typedef struct{
+    uint32_t address;
+    uint32_t baudrate;
+    union{
+      uint64_t energy;
+      float voltage[3];
+#if CONFIG_STRIM_METERS2_CE318
+      uint8_t battery[METERS_CE318_BATTERY_SIZE];
+#endif
+      meters_values_dc_t dc;
+    };
+  }meters_diag_job_t;
+
+  static int32_t meters_diag_run(meters_job_t func, meters_diag_job_t *job)
+  {
+    return meters_poll485_job(&meters_context, func, job, sizeof(*job), K_MSEC(METERS_DIAG_TIMEOUT_MS));
+  }
+
+  static bool meters_diag_cached(const struct shell *shell, const char *type_id, uint32_t address,
+                                meters_values_t *values)
+  {
+    meters_values_collection_t data;
+    meters_type_t type = meters_get_type_by_id(type_id);
+
+    if(meters_get_all(&data) != 0)
+      return false;
+
+    for(uint32_t i = 0; i < data.count; i++){
+      meter_item_info_t *item = &data.items[i];
+      uint32_t age = k_uptime_get_32() - item->timemark;
+
+      if((item->parameters.type != type) || (item->parameters.address != address) ||
+        !item->is_valid || (age > METERS_DIAG_CACHE_MAX_AGE_MS))
+        continue;
+
+      shell_print(shell, "meter %u polled %u ms ago, no bus request", i, age);
+      if(values != NULL)
+        *values = item->values;
+      return true;
+    }
+
+    return false;
+  }
+#endif
+
+#if CONFIG_STRIM_METERS2_CE318
 
   typedef struct {
     const uint8_t *name;
     int32_t (*func)(const struct shell *shell, uint32_t address, uint32_t baudrate);
   }meters_query_table_t;
 
+  static int32_t ce318_energy_job(meters_context_t *context, void *data)
+  {
+    meters_diag_job_t *job = data;
+    return meters_ce318_get_energy_active(context, job->baudrate, job->address, &job->energy);
+  }
+
   static int32_t query_energy(const struct shell *shell, uint32_t address, uint32_t baudrate)
   {
-    
-    meters_context_t * context = &meters_context;
-    uint64_t energy;
-    
-    int32_t ret = meters_ce318_get_energy_active(context, baudrate, address, &energy);
+    meters_diag_job_t job = {.address = address, .baudrate = baudrate};
+    meters_values_t values;
+    int32_t ret = 0;
+
+    if(meters_diag_cached(shell, "ce318", address, &values))
+      job.energy = values.AC.energy_active;
+    else
+      ret = meters_diag_run(ce318_energy_job, &job);
+
     if(ret == 0){
-      uint64_t energy_Wh = energy / 3600;
+      uint64_t energy_Wh = job.energy / 3600;
       uint32_t energy_kWh_fractional = energy_Wh % 1000;
       uint32_t energy_kWh_integer = energy_Wh / 1000;
       shell_print(shell, "ce318 energy = %6u.%03u  kWh", energy_kWh_integer, energy_kWh_fractional);
@@ -36,14 +119,26 @@ static void shell_values(const struct shell * shell, meters_values_t *values, bo
     return 0;
   }
 
+  static int32_t ce318_voltage_job(meters_context_t *context, void *data)
+  {
+    meters_diag_job_t *job = data;
+    return meters_ce318_get_voltage(context, job->baudrate, job->address, job->voltage);
+  }
+
   static int32_t query_voltage(const struct shell *shell, uint32_t address, uint32_t baudrate)
   {
-    meters_context_t * context = &meters_context;
-    float voltage[3];
+    meters_diag_job_t job = {.address = address, .baudrate = baudrate};
+    meters_values_t values;
+    int32_t ret = 0;
+
+    if(meters_diag_cached(shell, "ce318", address, &values))
+      memcpy(job.voltage, values.AC.voltage, sizeof(job.voltage));
+    else
+      ret = meters_diag_run(ce318_voltage_job, &job);
 
-    int32_t ret = meters_ce318_get_voltage(context, baudrate, address, voltage);
     if(ret == 0)
-      shell_print(shell, "ce318 voltage = %5.3f/%5.3f/%5.3f", (double)voltage[0], (double)voltage[1], (double)voltage[2]);
+      shell_print(shell, "ce318 voltage = %5.3f/%5.3f/%5.3f",
+                  (double)job.voltage[0], (double)job.voltage[1], (double)job.voltage[2]);
     else
       shell_warn(shell, "ce318 error = %d", ret);
 
@@ -81,6 +176,12 @@ static void shell_values(const struct shell * shell, meters_values_t *values, bo
     return 0;
   }
 
+  static int32_t ce318_battery_job(meters_context_t *context, void *data)
+  {
+    meters_diag_job_t *job = data;
+    return meters_ce318_get_battery(context, job->baudrate, job->address, job->battery);
+  }
+
   static int32_t ce318_sample_cmd(const struct shell *shell,
                                   size_t argc, uint8_t **argv)
   {
@@ -96,13 +197,12 @@ static void shell_values(const struct shell * shell, meters_values_t *values, bo
       baudrate = strtol(argv[3], NULL, 10);
     shell_print(shell, "set baudrate to  %u", baudrate);
 
-    meters_context_t * context = &meters_context;
-    uint8_t hex[8];
+    meters_diag_job_t job = {.address = address, .baudrate = baudrate};
 
-    int32_t ret = meters_ce318_get_battery(context, baudrate, address, hex);
+    int32_t ret = meters_diag_run(ce318_battery_job, &job);
     if(ret > 0){
       shell_print(shell, "received: ");
-      shell_hexdump(shell, hex, ret);
+      shell_hexdump(shell, job.battery, ret);
     }
     else
       shell_warn(shell, "ce318 error = %d", ret);
@@ -130,6 +230,14 @@ static void shell_values(const struct shell * shell, meters_values_t *values, bo
     SHELL_CMD_ARG(sample,     NULL,         "Query sample battery", ce318_sample_cmd, 4, 0),
     SHELL_SUBCMD_SET_END
   );
+#endif //CONFIG_STRIM_METERS2_CE318
+
+#if CONFIG_STRIM_METERS2_MERCURY234
+  static int32_t mercury_ping_job(meters_context_t *context, void *data)
+  {
+    meters_diag_job_t *job = data;
+    return meters_mercury_ping(context, job->address, job->baudrate);
+  }
 
   static int32_t mercury_ping_cmd(const struct shell *shell, size_t argc, uint8_t **argv)
   {
@@ -145,11 +253,14 @@ static void shell_values(const struct shell * shell, meters_values_t *values, bo
       baudrate = strtol(argv[2], NULL, 10);
     shell_print(shell, "set baudrate to  %u", baudrate);
 
-    meters_context_t * context = &meters_context;
-
     shell_print(shell, "Ping address %u", address);
 
-    int32_t ret = meters_mercury_ping(context, address, baudrate);
+    int32_t ret = 0;
+    if(!meters_diag_cached(shell, "mercury234", address, NULL)){
+      meters_diag_job_t job = {.address = address, .baudrate = baudrate};
+      ret = meters_diag_run(mercury_ping_job, &job);
+    }
+
     if(ret == 0){
       shell_print(shell, "mercury is available");
     }
@@ -163,11 +274,18 @@ static void shell_values(const struct shell * shell, meters_values_t *values, bo
     SHELL_CMD_ARG(ping, NULL, "Test link", mercury_ping_cmd, 2, 1),
     SHELL_SUBCMD_SET_END
   );
+#endif //CONFIG_STRIM_METERS2_MERCURY234
+
+#if CONFIG_STRIM_METERS2_SPM90
+  static int32_t spm90_read_job(meters_context_t *context, void *data)
+  {
+    meters_diag_job_t *job = data;
+    return meters_spm90_get_values(context, job->address, job->baudrate, &job->dc);
+  }
 
   static int32_t spm90_read_cmd(const struct shell * shell, size_t argc, uint8_t ** argv)
   {
-    meters_context_t * context = &meters_context;
-    meters_values_dc_t value;
+    meters_values_t values;
 
     uint16_t id = (uint16_t)atoi(argv[1]);
 
@@ -177,7 +295,14 @@ static void shell_values(const struct shell * shell, meters_values_t *values, bo
     }
     shell_print(shell, "set baudrate to  %u", baudrate);
 
-    int32_t ret = meters_spm90_get_values(context, id, baudrate, &value, 0);
+    meters_diag_job_t job = {.address = id, .baudrate = baudrate};
+    int32_t ret = 0;
+
+    if(meters_diag_cached(shell, "spm90", id, &values))
+      job.dc = values.DC;
+    else
+      ret = meters_diag_run(spm90_read_job, &job);
+
     if(ret == -ETIMEDOUT){
       shell_warn(shell, "meter %u no response", id);
       return 0;
@@ -187,17 +312,18 @@ static void shell_values(const struct shell * shell, meters_values_t *values, bo
       return 0;
     }
 
-    shell_print(shell, "Voltage:  %8.1f V", (double)value.voltage);
-    shell_print(shell, "Current:  %8.2f A", (double)value.current);
-    shell_print(shell, "Power:    %8.0f W", (double)value.power);
-    uint64_t energy_Wh = value.energy / 3600;
+    meters_values_dc_t *value = &job.dc;
+    shell_print(shell, "Voltage:  %8.1f V", (double)value->voltage);
+    shell_print(shell, "Current:  %8.2f A", (double)value->current);
+    shell_print(shell, "Power:    %8.0f W", (double)value->power);
+    uint64_t energy_Wh = value->energy / 3600;
     uint32_t energy_kWh_int = energy_Wh / 1000;
     uint32_t energy_kWh_fract = energy_Wh % 1000;
     shell_print(shell, "Energy:   %6u.%03u kWh", energy_kWh_int, energy_kWh_fract);
 
     return 0;
   }
-#endif //CONFIG_STRIM_METERS2_BUS485_ENABLE
+#endif //CONFIG_STRIM_METERS2_SPM90
 
 static int32_t meters_view_cmd(const struct shell * shell, 
                                  size_t argc, uint8_t ** argv)
@@ -214,7 +340,7 @@ static int32_t meters_view_cmd(const struct shell * shell,
 
   for(uint32_t i = 0; i < data.count; i++){
     uint8_t addr_str[12] = {0};
-    get_meter_address(addr_str, sizeof(addr_str), &data.items[i].parameters);
+    meters_get_address_string(addr_str, sizeof(addr_str), &data.items[i].parameters);
 
     shell_fprintf(shell, SHELL_VT100_COLOR_DEFAULT,
                   " %2u | %-12s | %-10s |", i, meters_get_typename(data.items[i].parameters.type), addr_str);
@@ -233,30 +359,6 @@ static int32_t meters_view_cmd(const struct shell * shell,
   return 0;
 }
 
-static void get_meter_address(uint8_t * addr_str, uint32_t buffSize, meter_parameters_t *param){
-  switch(param->type){
-    case meters_type_extern_ac:
-      snprintf(addr_str, buffSize, "  %3u", param->address);
-      break;
-    case meters_type_extern_dc:
-      snprintf(addr_str, buffSize, "  %3u", param->address);
-      break;
-#if CONFIG_STRIM_METERS_BUS485_ENABLE
-    case meters_type_CE318:
-      snprintf(addr_str, buffSize, " %u", param->address);
-      break;
-    case meters_type_Mercury234:
-      snprintf(addr_str, buffSize, "  %4u", param->address);
-      break;
-    case meters_type_SPM90:
-      snprintf(addr_str, buffSize, "  %3u", param->address);
-      break;
-#endif
-    default: 
-      addr_str[0] = '\0';
-  }
-}
-
 static void shell_values(const struct shell * shell, meters_values_t *values, bool horizontal){
   uint64_t energy_Ws = (values->type ==     meters_current_type_dc) 
                               ? values->DC.energy : values->AC.energy_active;
@@ -307,9 +409,440 @@ static void shell_values(const struct shell * shell, meters_values_t *values, bo
   }
 }
 
+enum{METERS_WATCH_PERIOD_MS = 1000};
+enum{METERS_WATCH_PERIOD_MIN_MS = 200};     // не чаще, чтобы не забить медленный UART
+enum{METERS_WATCH_CELL_SIZE = 24};
+enum{METERS_WATCH_ROW_PREFIX = 33};         // ширина колонок номера, типа и адреса
+
+typedef void (*meters_watch_format_t)(char *buffer, size_t size, const meters_values_t *values);
+
+typedef struct{
+  char key;
+  const char *title;
+  uint8_t width;
+  meters_watch_format_t format;
+}meters_watch_field_t;
+
+static void meters_watch_energy(char *buffer, size_t size, const meters_values_t *values)
+{
+  uint64_t energy_Wh = ((values->type == meters_current_type_dc) 
+                              ? values->DC.energy : values->AC.energy_active) / 3600;
+  snprintf(buffer, size, "%u.%03u", (uint32_t)(energy_Wh / 1000), (uint32_t)(energy_Wh % 1000));
+}
+
+static void meters_watch_power(char *buffer, size_t size, const meters_values_t *values)
+{
+  snprintf(buffer, size, "%ld", lroundf((values->type == meters_current_type_dc) 
+                                          ? values->DC.power : values->AC.power_active));
+}
+
+static void meters_watch_voltage(char *buffer, size_t size, const meters_values_t *values)
+{
+  if(values->type == meters_current_type_dc)
+    snprintf(buffer, size, "%ld", lroundf(values->DC.voltage));
+  else
+    snprintf(buffer, size, "%3ld/%3ld/%3ld", lroundf(values->AC.voltage[0]), 
+            lroundf(values->AC.voltage[1]), lroundf(values->AC.voltage[2]));
+}
+
+static void meters_watch_current(char *buffer, size_t size, const meters_values_t *values)
+{
+  if(values->type == meters_current_type_dc)
+    snprintf(buffer, size, "%.2lf", (double)values->DC.current);
+  else
+    snprintf(buffer, size, "%3.1lf/%3.1lf/%3.1lf", (double)values->AC.current[0],
+            (double)values->AC.current[1], (double)values->AC.current[2]);
+}
+
+static const meters_watch_field_t meters_watch_fields[] = {
+  {.key = 'e', .title = "Energy,kWh", .width = 12, .format = meters_watch_energy},
+  {.key = 'p', .title = "Power,W",    .width = 9,  .format = meters_watch_power},
+  {.key = 'v', .title = "Voltage,V",  .width = 13, .format = meters_watch_voltage},
+  {.key = 'c', .title = "Current,A",  .width = 16, .format = meters_watch_current},
+};
+
+enum{METERS_WATCH_FIELDS_COUNT = ARRAY_SIZE(meters_watch_fields)};
+
+typedef struct{
+  const struct shell *shell;
+  struct k_work_poll trigger;       // ждет новых значений
+  struct k_work_delayable draw;     // перерисовка не чаще периода
+  struct k_poll_event event;
+  uint32_t period_ms;
+  int64_t draw_timemark;
+  uint32_t fields;                  // битовая маска meters_watch_fields
+  uint32_t count;
+  bool is_active;
+  // последнее выведенное, чтобы перерисовывать только изменившиеся ячейки
+  bool is_valid[METERS_ITEMS_MAX_COUNT];
+  meters_values_t values[METERS_ITEMS_MAX_COUNT];
+  char cells[METERS_ITEMS_MAX_COUNT][METERS_WATCH_FIELDS_COUNT][METERS_WATCH_CELL_SIZE];
+}meters_watch_t;
+
+static meters_watch_t meters_watch;
+
+static void meters_watch_arm(meters_watch_t *watch)
+{
+  // без новых значений таблица все равно обновляется: данные могли устареть
+  k_poll_event_init(&watch->event, K_POLL_TYPE_SIGNAL, K_POLL_MODE_NOTIFY_ONLY,
+                    &meters_context.tools->data_update);
+  k_work_poll_submit(&watch->trigger, &watch->event, 1, K_MSEC(CONFIG_STRIM_METERS2_VALID_DATA_TIMEOUT));
+}
+
+static void meters_watch_trigger_handler(struct k_work *work)
+{
+  meters_watch_t *watch = CONTAINER_OF(work, meters_watch_t, trigger);
+
+  if(!watch->is_active)
+    return;
+
+  // обновления, пришедшие до перерисовки, выводятся вместе с ней
+  k_poll_signal_reset(&meters_context.tools->data_update);
+
+  int64_t elapsed = k_uptime_get() - watch->draw_timemark;
+  int64_t delay = (elapsed < watch->period_ms) ? (watch->period_ms - elapsed) : 0;
+  k_work_schedule(&watch->draw, K_MSEC(delay));
+}
+
+static void meters_watch_cell(meters_watch_t *watch, uint32_t item, uint32_t field, const char *text)
+{
+  char *cell = watch->cells[item][field];
+
+  if(strcmp(cell, text) == 0)
+    return;
+  strncpy(cell, text, METERS_WATCH_CELL_SIZE - 1);
+
+  uint32_t column = METERS_WATCH_ROW_PREFIX + 1;
+  for(uint32_t i = 0; i < field; i++){
+    if(watch->fields & BIT(i))
+      column += meters_watch_fields[i].width + 2;
+  }
+
+  // курсор стоит под таблицей: поднимаемся к строке счетчика и возвращаемся
+  uint32_t up = watch->count - item;
+  shell_fprintf(watch->shell, SHELL_VT100_COLOR_DEFAULT, "\033[%uA\033[%uG%*s\033[%uB\r", up, column,
+                meters_watch_fields[field].width, cell, up);
+}
+
+static void meters_watch_draw_handler(struct k_work *work)
+{
+  meters_watch_t *watch = CONTAINER_OF(k_work_delayable_from_work(work), meters_watch_t, draw);
+  meters_values_t values;
+  char text[METERS_WATCH_CELL_SIZE];
+
+  if(!watch->is_active)
+    return;
+
+  for(uint32_t i = 0; i < watch->count; i++){
+    bool is_valid = (meters_get_values(i, &values) == 0);
+
+    // значения не менялись - форматировать нечего
+    if((is_valid == watch->is_valid[i]) && 
+      (!is_valid || (memcmp(&values, &watch->values[i], sizeof(values)) == 0)))
+      continue;
+
+    watch->is_valid[i] = is_valid;
+    if(is_valid)
+      watch->values[i] = values;
+
+    for(uint32_t j = 0; j < METERS_WATCH_FIELDS_COUNT; j++){
+      if(!(watch->fields & BIT(j)))
+        continue;
+
+      if(is_valid)
+        meters_watch_fields[j].format(text, sizeof(text), &values);
+      else
+        strcpy(text, "---");
+      meters_watch_cell(watch, i, j, text);
+    }
+  }
+
+  watch->draw_timemark = k_uptime_get();
+  meters_watch_arm(watch);
+}
+
+static void meters_watch_stop(meters_watch_t *watch)
+{
+  struct k_work_sync sync;
+
+  watch->is_active = false;
+  k_work_poll_cancel(&watch->trigger);
+  k_work_cancel_delayable_sync(&watch->draw, &sync);
+}
+
+// Любая клавиша останавливает просмотр и возвращает ввод командной строке
+static void meters_watch_bypass(const struct shell *shell, uint8_t *data, size_t length)
+{
+  meters_watch_stop(&meters_watch);
+  shell_set_bypass(shell, NULL);
+  shell_print(shell, "");
+}
+
+static int32_t meters_watch_cmd(const struct shell * shell, size_t argc, uint8_t **argv)
+{
+  meters_watch_t *watch = &meters_watch;
+  uint32_t fields = 0;
+
+  if(meters_context.tools == NULL){
+    shell_warn(shell, "meters not initialized");
+    return 0;
+  }
+
+  if(watch->is_active)
+    meters_watch_stop(watch);
+
+  uint32_t period = (argc > 1) ? strtol(argv[1], NULL, 10) : METERS_WATCH_PERIOD_MS;
+  period = MAX(period, METERS_WATCH_PERIOD_MIN_MS);
+
+  const char *keys = (argc > 2) ? (const char *)argv[2] : "epvc";
+  for(const char *key = keys; *key != '\0'; key++){
+    uint32_t i = 0;
+    while((i < METERS_WATCH_FIELDS_COUNT) && (meters_watch_fields[i].key != *key))
+      i++;
+    if(i == METERS_WATCH_FIELDS_COUNT){
+      shell_warn(shell, "unknown field '%c', use e(nergy) p(ower) v(oltage) c(urrent)", *key);
+      return 0;
+    }
+    fields |= BIT(i);
+  }
+
+  memset(watch, 0, sizeof(*watch));
+  watch->shell = shell;
+  watch->period_ms = period;
+  watch->fields = fields;
+  watch->count = meters_context.item_count;
+  k_work_poll_init(&watch->trigger, meters_watch_trigger_handler);
+  k_work_init_delayable(&watch->draw, meters_watch_draw_handler);
+
+  shell_fprintf(shell, SHELL_VT100_COLOR_DEFAULT, "    |    Type      |   Address  |");
+  for(uint32_t i = 0; i < METERS_WATCH_FIELDS_COUNT; i++){
+    if(fields & BIT(i))
+      shell_fprintf(shell, SHELL_VT100_COLOR_DEFAULT, " %*s |", meters_watch_fields[i].width,
+                    meters_watch_fields[i].title);
+  }
+  shell_print(shell, "");
+
+  for(uint32_t i = 0; i < watch->count; i++){
+    const meter_parameters_t *param = &meters_context.parameters[i];
+    uint8_t addr_str[12] = {0};
+
+    meters_get_address_string(addr_str, sizeof(addr_str), param);
+    shell_fprintf(shell, SHELL_VT100_COLOR_DEFAULT, " %2u | %-12s | %-10s |", i, 
+                  meters_get_typename(param->type), addr_str);
+    for(uint32_t j = 0; j < METERS_WATCH_FIELDS_COUNT; j++){
+      if(fields & BIT(j))
+        shell_fprintf(shell, SHELL_VT100_COLOR_DEFAULT, " %*s |", meters_watch_fields[j].width, "");
+    }
+    shell_print(shell, "");
+  }
+
+  // значения выводит рабочая очередь, shell тем временем только ждет клавишу
+  watch->is_active = true;
+  shell_set_bypass(shell, meters_watch_bypass);
+  k_work_schedule(&watch->draw, K_NO_WAIT);
+
+  return 0;
+}
+
 static int32_t meters_reinit_cmd(const struct shell * shell, 
                                  size_t argc, uint8_t ** argv){
-  meters_reinit();
+  int32_t ret = meters_reinit();
+  if(ret < 0)
+    shell_error(shell, "reinit error: %d", ret);
+  return 0;
+}
+
+static meter_parameters_t meters_edit_table[METERS_ITEMS_MAX_COUNT];
+
+static int32_t meters_edit_apply(const struct shell * shell, uint32_t count)
+{
+  int32_t ret = meters_reconfigure(meters_edit_table, count);
+
+  if(ret == -EINPROGRESS)
+    shell_warn(shell, "accepted, poll thread has not switched yet");
+  else if(ret < 0)
+    shell_error(shell, "reconfigure error: %d", ret);
+  else
+    shell_print(shell, "%u meters", count);
+
+  return 0;
+}
+
+// Добавление счетчика в конец таблицы
+static int32_t meters_add_cmd(const struct shell * shell, size_t argc, uint8_t **argv)
+{
+  meters_type_t type = meters_get_type_by_id(argv[1]);
+  if(type == NULL){
+    shell_warn(shell, "unknown type: %s", argv[1]);
+    return 0;
+  }
+
+  int32_t count = meters_get_parameters(meters_edit_table, ARRAY_SIZE(meters_edit_table));
+  if(count < 0){
+    shell_error(shell, "meters not initialized");
+    return 0;
+  }
+  if(count >= ARRAY_SIZE(meters_edit_table)){
+    shell_warn(shell, "table is full: %d meters", count);
+    return 0;
+  }
+
+  meters_edit_table[count] = (meter_parameters_t){
+    .type = type,
+    .address = strtoul(argv[2], NULL, 10),
+    .baudrate = (argc > 3) ? strtoul(argv[3], NULL, 10) : 0,
+    .current_factor = (argc > 4) ? strtoul(argv[4], NULL, 10) : 1,
+    .poll_period = (argc > 5) ? strtoul(argv[5], NULL, 10) : 0,
+  };
+
+  return meters_edit_apply(shell, count + 1);
+}
+
+static int32_t meters_remove_cmd(const struct shell * shell, size_t argc, uint8_t **argv)
+{
+  uint32_t index = strtoul(argv[1], NULL, 10);
+
+  int32_t count = meters_get_parameters(meters_edit_table, ARRAY_SIZE(meters_edit_table));
+  if((count < 0) || (index >= count)){
+    shell_warn(shell, "no meter %u", index);
+    return 0;
+  }
+
+  memmove(&meters_edit_table[index], &meters_edit_table[index + 1],
+          (count - index - 1) * sizeof(meter_parameters_t));
+
+  return meters_edit_apply(shell, count - 1);
+}
+
+// Изменение одного поля: тип, адрес или скорость - это уже другой счетчик
+static int32_t meters_set_cmd(const struct shell * shell, size_t argc, uint8_t **argv)
+{
+  uint32_t index = strtoul(argv[1], NULL, 10);
+  const char *field = argv[2];
+  const char *value = argv[3];
+
+  int32_t count = meters_get_parameters(meters_edit_table, ARRAY_SIZE(meters_edit_table));
+  if((count < 0) || (index >= count)){
+    shell_warn(shell, "no meter %u", index);
+    return 0;
+  }
+
+  meter_parameters_t *param = &meters_edit_table[index];
+
+  if(strcmp(field, "type") == 0){
+    param->type = meters_get_type_by_id(value);
+    if(param->type == NULL){
+      shell_warn(shell, "unknown type: %s", value);
+      return 0;
+    }
+  }
+  else if(strcmp(field, "address") == 0)
+    param->address = strtoul(value, NULL, 10);
+  else if(strcmp(field, "baudrate") == 0)
+    param->baudrate = strtoul(value, NULL, 10);
+  else if(strcmp(field, "ct") == 0)
+    param->current_factor = strtoul(value, NULL, 10);
+  else if(strcmp(field, "period") == 0)
+    param->poll_period = strtoul(value, NULL, 10);
+  else if(strcmp(field, "balance") == 0){
+    if(strcmp(value, "parent") == 0)
+      param->balance_role = meters_balance_parent;
+    else if(strcmp(value, "child") == 0)
+      param->balance_role = meters_balance_child;
+    else if(strcmp(value, "none") == 0)
+      param->balance_role = meters_balance_none;
+    else {
+      shell_warn(shell, "unknown balance role: %s, use none|parent|child", value);
+      return 0;
+    }
+  }
+  else {
+    shell_warn(shell, "unknown field: %s, use type|address|baudrate|ct|period|balance", field);
+    return 0;
+  }
+
+  return meters_edit_apply(shell, count);
+}
+
+static int32_t meters_fresh_cmd(const struct shell *shell, size_t argc, char **argv)
+{
+  uint32_t index = strtoul(argv[1], NULL, 10);
+  uint32_t max_age = (argc > 2) ? strtoul(argv[2], NULL, 10) : 0;
+  uint32_t timeout = (argc > 3) ? strtoul(argv[3], NULL, 10) : CONFIG_STRIM_METERS2_BUS485_RESPONSE_TIMEOUT;
+  meters_values_t values;
+
+  uint32_t start = k_uptime_get_32();
+  int32_t ret = meters_request_fresh(index, max_age, K_MSEC(timeout));
+  uint32_t elapsed = k_uptime_get_32() - start;
+
+  if(ret != 0){
+    shell_warn(shell, "fresh read error: %d after %u ms", ret, elapsed);
+    return 0;
+  }
+
+  ret = meters_get_values(index, &values);
+  if(ret != 0){
+    shell_warn(shell, "get values error: %d", ret);
+    return 0;
+  }
+
+  shell_print(shell, "waited %u ms", elapsed);
+  shell_values(shell, &values, false);
+  return 0;
+}
+
+enum{METERS_SNAPSHOT_TIMEOUT_MS = 10000};
+
+static int32_t meters_snapshot_cmd(const struct shell *shell, size_t argc, char **argv)
+{
+  static meters_snapshot_t snapshot;
+  static meter_parameters_t parameters[METERS_ITEMS_MAX_COUNT];
+  int32_t ret;
+
+  if((argc < 2) || (strcmp(argv[1], "last") != 0)){
+    uint32_t timeout = (argc > 1) ? strtoul(argv[1], NULL, 10) : METERS_SNAPSHOT_TIMEOUT_MS;
+
+    ret = meters_take_snapshot(K_MSEC(timeout));
+    if(ret < 0){
+      shell_warn(shell, "snapshot error: %d", ret);
+      return 0;
+    }
+  }
+
+  ret = meters_get_snapshot(&snapshot);
+  if(ret < 0){
+    shell_warn(shell, "no snapshot: %d", ret);
+    return 0;
+  }
+
+  int32_t count = meters_get_parameters(parameters, ARRAY_SIZE(parameters));
+  if(count < 0){
+    shell_warn(shell, "get parameters error: %d", count);
+    return 0;
+  }
+
+  shell_print(shell, "snapshot #%u at %u ms, skew %u us", snapshot.sequence, snapshot.timemark, snapshot.skew_us);
+  shell_print(shell, " # | Type         |    Address |     Energy kWh | Power W | Start us |  Read us | Result");
+  shell_print(shell, "---|--------------|------------|----------------|---------|----------|----------|-------");
+
+  for(uint32_t i = 0; i < MIN(snapshot.count, (uint32_t)count); i++){
+    const meters_snapshot_item_t *item = &snapshot.items[i];
+    uint8_t addr_str[12] = {0};
+
+    meters_get_address_string(addr_str, sizeof(addr_str), &parameters[i]);
+    if(item->result != 0){
+      shell_print(shell, "%2u | %-12s | %10s | %14s | %7s | %8s | %8s | %6d", i,
+                  meters_get_typename(parameters[i].type), addr_str, "-", "-", "-", "-", item->result);
+      continue;
+    }
+
+    uint64_t energy_Wh = item->energy / 3600;
+    shell_print(shell, "%2u | %-12s | %10s | %10u.%03u | %7ld | %8u | %8u | %6d", i,
+                meters_get_typename(parameters[i].type), addr_str,
+                (uint32_t)(energy_Wh / 1000), (uint32_t)(energy_Wh % 1000), lroundf(item->power),
+                item->offset_us, item->duration_us, item->result);
+  }
+
   return 0;
 }
 
@@ -336,7 +869,7 @@ static int32_t meters_view_single_cmd(const struct shell * shell,
   meter_item_info_t *item = &data.items[index];
   uint8_t addr_str[12] = {0};
 
-  get_meter_address(addr_str, sizeof(addr_str), &item->parameters);
+  meters_get_address_string(addr_str, sizeof(addr_str), &item->parameters);
 
   shell_print(shell, "parameter   : value");
   shell_print(shell, "------------:--------------");
@@ -396,17 +929,867 @@ static int32_t meters_testAC_cmd(const struct shell * shell,
   return 0;
 }
 
-SHELL_STATIC_SUBCMD_SET_CREATE(sub_meters,
-  #if CONFIG_STRIM_METERS2_BUS485_ENABLE
-    SHELL_CMD(ce318, &sub_ce318,  "Energomera CE318BY", NULL),
-    SHELL_CMD(mercury, &sub_mercury, "Mercury protocol", NULL),
-    SHELL_CMD_ARG(spm90, NULL,    "spm90 read",         spm90_read_cmd, 2, 1),
-  #endif
-  SHELL_CMD(testdc, NULL, "test to write data", meters_testDC_cmd),
-  SHELL_CMD(testac, NULL, "test to write data", meters_testAC_cmd),
-  SHELL_CMD_ARG(get, NULL, "view data for single meter by index", meters_view_single_cmd, 2, 1),
+#if CONFIG_STRIM_METERS2_SCAN
+typedef struct {
+  const struct shell *shell;
+  meters_scan_result_t found[CONFIG_STRIM_METERS2_ITEMS_MAX_COUNT * 2];
+  uint32_t count;
+}meters_scan_shell_t;
+
+static void meters_scan_found(const meters_scan_result_t *result, void *user_data)
+{
+  meters_scan_shell_t *scan = user_data;
+
+  shell_print(scan->shell, " %-12s | %10u | %6u", meters_get_typename(result->type), 
+              result->address, result->baudrate);
+  
+  if(scan->count < ARRAY_SIZE(scan->found))
+    scan->found[scan->count++] = *result;
+}
+
+static int32_t meters_scan_cmd(const struct shell * shell, size_t argc, uint8_t **argv)
+{
+  static meters_scan_shell_t scan;
+  meters_scan_config_t config = {
+    .timeout_ms = CONFIG_STRIM_METERS2_SCAN_TIMEOUT,
+    .callback = meters_scan_found,
+    .user_data = &scan,
+  };
+  bool is_generate = false;
+
+  if((argc > 1) && (strcmp(argv[1], "all") != 0)){
+    config.type = meters_get_type_by_id(argv[1]);
+    if((config.type == NULL) || (config.type->scan == NULL)){
+      shell_warn(shell, "unknown or not scannable type: %s", argv[1]);
+      return 0;
+    }
+  }
+  if(argc > 2)
+    config.baudrate = strtol(argv[2], NULL, 10);
+  if(argc > 3)
+    config.timeout_ms = strtol(argv[3], NULL, 10);
+  if(argc > 4)
+    is_generate = (strcmp(argv[4], "gen") == 0);
+
+  scan.shell = shell;
+  scan.count = 0;
+
+  shell_print(shell, " Type         |    Address | Baud");
+  shell_print(shell, "--------------|------------|-------");
+
+  int32_t ret = meters_scan(&meters_context, &config);
+  shell_print(shell, "found %d meters", ret);
+
+  if(is_generate){
+    shell_print(shell, "");
+    for(uint32_t i = 0; i < scan.count; i++){
+      shell_print(shell, "\t{.type = METERS_TYPE(%s), .address = %u, .baudrate = %u, .current_factor = 1},",
+                  scan.found[i].type->id, scan.found[i].address, scan.found[i].baudrate);
+    }
+  }
+
+  return 0;
+}
+#endif //CONFIG_STRIM_METERS2_SCAN
+
+static void meters_stats_ago(const struct shell *shell, const char *name, uint32_t timemark)
+{
+  if(timemark == 0){
+    shell_print(shell, "%s: never", name);
+    return;
+  }
+
+  uint32_t time = (k_uptime_get_32() - timemark) / 100;
+  shell_print(shell, "%s: %u.%u seconds ago", name, time / 10, time % 10);
+}
+
+static void meters_stats_single(const struct shell *shell, const meters_link_stats_t *stats)
+{
+  shell_print(shell, "requests     : %u", stats->requests);
+  shell_print(shell, "successes    : %u", stats->successes);
+  shell_print(shell, "timeouts     : %u", stats->timeouts);
+  shell_print(shell, "crc errors   : %u", stats->crc_errors);
+  shell_print(shell, "address      : %u", stats->address_mismatches);
+  shell_print(shell, "protocol     : %u", stats->protocol_errors);
+  shell_print(shell, "last error   : %d", stats->last_error);
+  meters_stats_ago(shell, "last success ", stats->last_success_timemark);
+  meters_stats_ago(shell, "last failure ", stats->last_failure_timemark);
+  shell_print(shell, "rtt max      : %u ms", stats->rtt_max_ms);
+  shell_print(shell, "driver errors: %u, last %d", stats->driver_failures, stats->driver_error);
+  shell_print(shell, "backoff      : %u ms", stats->backoff_ms);
+
+  for(uint32_t i = 0; i < METERS_LINK_RTT_BUCKETS; i++){
+    if(i < ARRAY_SIZE(meters_link_rtt_bounds_ms))
+      shell_print(shell, "rtt <= %4u  : %u", meters_link_rtt_bounds_ms[i], stats->rtt_histogram[i]);
+    else
+      shell_print(shell, "rtt >  %4u  : %u", meters_link_rtt_bounds_ms[i - 1], stats->rtt_histogram[i]);
+  }
+}
+
+static int32_t meters_stats_cmd(const struct shell * shell, size_t argc, uint8_t **argv)
+{
+  static meters_values_collection_t data;
+  meters_link_stats_t stats;
+
+  int32_t ret = meters_get_all(&data);
+  if(ret < 0){
+    shell_warn(shell, "collect data error: %d", ret);
+    return 0;
+  }
+
+  if(argc > 1){
+    uint32_t index = atoi(argv[1]);
+    ret = meters_get_link_stats(index, &stats);
+    if(ret < 0)
+      shell_warn(shell, "wrong index");
+    else
+      meters_stats_single(shell, &stats);
+    return 0;
+  }
+
+  meters_poll_stats_t poll;
+  if(meters_get_poll_stats(&poll) == 0){
+    shell_print(shell, "poll cycles %u, thread restarts %u", poll.cycles, poll.restarts);
+    if(poll.restarts != 0)
+      meters_stats_ago(shell, "last restart", poll.last_restart_timemark);
+    if(poll.stack_unused != 0)
+      shell_print(shell, "poll stack %u of %u bytes used", poll.stack_size - poll.stack_unused, poll.stack_size);
+#if CONFIG_STRIM_METERS2_BUS485_ENABLE
+    shell_print(shell, "frame buffers peak %u of %u, misses %u", poll.bufs_peak,
+                METERS_BUS485_BUF_LARGE_COUNT + METERS_BUS485_BUF_SMALL_COUNT, poll.bufs_failures);
+#endif
+  }
+
+  shell_print(shell, " # | Type         |    Address | Requests |  Success | Timeout |  CRC | Addr | Proto | Last err | RTT max | Backoff");
+  shell_print(shell, "---|--------------|------------|----------|----------|---------|------|------|-------|----------|---------|--------");
+
+  for(uint32_t i = 0; i < data.count; i++){
+    uint8_t addr_str[12] = {0};
+
+    if(meters_get_link_stats(i, &stats) < 0)
+      continue;
+
+    meters_get_address_string(addr_str, sizeof(addr_str), &data.items[i].parameters);
+    shell_print(shell, "%2u | %-12s | %10s | %8u | %8u | %7u | %4u | %4u | %5u | %8d | %4u ms | %5u ms", i,
+                meters_get_typename(data.items[i].parameters.type), addr_str, stats.requests,
+                stats.successes, stats.timeouts, stats.crc_errors, stats.address_mismatches,
+                stats.protocol_errors, stats.last_error, stats.rtt_max_ms, stats.backoff_ms);
+  }
+
+  return 0;
+}
+
+#if CONFIG_STRIM_METERS2_BALANCE
+static void meters_balance_row(const struct shell *shell, const char *name, const meters_balance_sums_t *sums)
+{
+  shell_print(shell, "%-9s | %9ld | %6.1lf/%6.1lf/%6.1lf | %10lld", name, lroundf(sums->power),
+              (double)sums->current[0], (double)sums->current[1], (double)sums->current[2],
+              (long long)(sums->energy / 3600));
+}
+
+static int32_t meters_balance_cmd(const struct shell *shell, size_t argc, char **argv)
+{
+  meters_balance_t balance;
+
+  int32_t ret = meters_get_balance(&balance);
+  if(ret < 0){
+    shell_warn(shell, "no balance: %d, mark meters with 'meters set <index> balance parent|child'", ret);
+    return 0;
+  }
+
+  shell_print(shell, "parent %u, children 0x%08x, %s", balance.parent_index, balance.children_mask,
+              balance.is_valid ? "valid" : "not valid");
+  if(balance.stale_mask != 0)
+    shell_print(shell, "stale inputs 0x%08x", balance.stale_mask);
+  if(balance.since_timemark != 0)
+    meters_stats_ago(shell, "energy since", balance.since_timemark);
+
+  shell_print(shell, "          |   Power W |      Current A (L1/L2/L3) |  Energy Wh");
+  shell_print(shell, "----------|-----------|---------------------------|-----------");
+  meters_balance_row(shell, "parent", &balance.parent);
+  meters_balance_row(shell, "children", &balance.children);
+  meters_balance_row(shell, "imbalance", &balance.imbalance);
+  shell_print(shell, "imbalance %.2lf %% of power, %.2lf %% of energy",
+              (double)balance.power_percent, (double)balance.energy_percent);
+
+  return 0;
+}
+#endif
+
+#if CONFIG_STRIM_METERS2_BUS485_ENABLE
+static int32_t meters_budget_cmd(const struct shell * shell, size_t argc, uint8_t **argv)
+{
+  meters_context_t *context = &meters_context;
+  meters_budget_load_t load;
+
+  shell_print(shell, " # | Type         |   Baud | Period ms | Model ms | Last ms | Model load | Last load");
+  shell_print(shell, "---|--------------|--------|-----------|----------|---------|------------|----------");
+
+  for(uint32_t i = 0; i < context->item_count; i++){
+    const meter_parameters_t *param = &context->parameters[i];
+
+    if(param->type->read == NULL)
+      continue; // внешние счетчики линию не занимают
+
+    meters_budget_item_load(context, i, &load);
+    shell_print(shell, "%2u | %-12s | %6u | %9u | %8u | %7u | %8u.%u%% | %7u.%u%%", i,
+                meters_get_typename(param->type), param->baudrate,
+                meters_budget_period_ms(context, i),
+                meters_budget_read_us(param->type, param->baudrate) / USEC_PER_MSEC,
+                context->items[i].read_us / USEC_PER_MSEC,
+                load.predicted_permille / 10, load.predicted_permille % 10,
+                load.measured_permille / 10, load.measured_permille % 10);
+  }
+
+  meters_budget_total_load(context, &load);
+  shell_print(shell, "total load: model %u.%u%%, last cycle %u.%u%%",
+              load.predicted_permille / 10, load.predicted_permille % 10,
+              load.measured_permille / 10, load.measured_permille % 10);
+
+  if(load.predicted_permille > 1000)
+    shell_warn(shell, "bus over-subscribed, poll periods will stretch");
+
+  return 0;
+}
+#endif //CONFIG_STRIM_METERS2_BUS485_ENABLE
+
+#if CONFIG_STRIM_METERS2_BENCH
+enum{METERS_BENCH_CYCLE_WAIT_MS = 60000};
+
+static void meters_bench_get(meters_bench_cycle_t *bench)
+{
+  meters_tools_context_t *tool = meters_context.tools;
+
+  meters_data_lock(tool);
+  {
+    *bench = tool->bench_cycle;
+  }
+  meters_data_unlock(tool);
+}
+
+static void meters_bench_add(meters_bench_counters_t *total, const meters_bench_counters_t *item)
+{
+  total->busy_us += item->busy_us;
+  total->pause_us += item->pause_us;
+  total->timeout_us += item->timeout_us;
+  total->frames_tx += item->frames_tx;
+  total->bytes_tx += item->bytes_tx;
+  total->frames_rx += item->frames_rx;
+  total->bytes_rx += item->bytes_rx;
+}
+
+static void meters_bench_row(const struct shell *shell, uint32_t cycle, const char *item,
+                            const char *driver, uint32_t address, uint32_t baudrate,
+                            uint32_t wall_us, const meters_bench_counters_t *counters)
+{
+  shell_print(shell, "%u,%s,%s,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u", cycle, item, driver, address, baudrate,
+              wall_us, counters->busy_us, counters->pause_us, counters->timeout_us,
+              counters->frames_tx, counters->bytes_tx, counters->frames_rx, counters->bytes_rx);
+}
+
+// Отчет по следующим завершенным циклам опроса в формате CSV
+static int32_t meters_bench_cmd(const struct shell * shell, size_t argc, uint8_t **argv)
+{
+  static meters_bench_cycle_t bench;
+  meters_context_t *context = &meters_context;
+  uint32_t cycles = (argc > 1) ? strtol(argv[1], NULL, 10) : 1;
+
+  if(context->tools == NULL){
+    shell_warn(shell, "meters not initialized");
+    return 0;
+  }
+
+  meters_bench_get(&bench);
+  uint32_t last = bench.cycle;
+
+  shell_print(shell, "cycle,item,driver,address,baudrate,wall_us,busy_us,pause_us,timeout_us,"
+                     "frames_tx,bytes_tx,frames_rx,bytes_rx");
+
+  for(uint32_t n = 0; n < cycles; n++){
+    int64_t deadline = k_uptime_get() + METERS_BENCH_CYCLE_WAIT_MS;
+
+    while((bench.cycle == last) && (k_uptime_get() < deadline)){
+      k_msleep(50);
+      meters_bench_get(&bench);
+    }
+
+    if(bench.cycle == last){
+      shell_warn(shell, "no poll cycle completed in %u ms", METERS_BENCH_CYCLE_WAIT_MS);
+      return 0;
+    }
+    last = bench.cycle;
+
+    meters_bench_counters_t total = {0};
+    for(uint32_t i = 0; i < context->item_count; i++){
+      const meter_parameters_t *param = &context->parameters[i];
+      char item[8];
+
+      snprintf(item, sizeof(item), "%u", i);
+      meters_bench_row(shell, bench.cycle, item, param->type->id, param->address, param->baudrate,
+                      bench.wall_us[i], &bench.items[i]);
+      meters_bench_add(&total, &bench.items[i]);
+    }
+    meters_bench_row(shell, bench.cycle, "-", "total", 0, 0, bench.cycle_us, &total);
+  }
+
+  return 0;
+}
+
+enum{METERS_CODEC_BENCH_ITERATIONS = 10000};
+
+typedef struct{
+  const char *name;
+  int32_t (*decode)(const uint8_t *frame, size_t length);
+  uint8_t frame[METERS_CODEC_SMP_FRAME_MAX_SIZE];
+  size_t length;
+}meters_codec_bench_t;
+
+static int32_t meters_codec_bench_smp(const uint8_t *frame, size_t length)
+{
+  uint8_t data[32];
+  int64_t field;
+  int32_t ret = meters_codec_smp_decode(frame, length, data, sizeof(data), NULL);
+
+  for(int32_t offset = 3; (ret > 0) && (offset < ret); ){
+    int32_t count = meters_codec_dff_parse(&data[offset], ret - offset, &field, true);
+    if(count < 0)
+      return count;
+    offset += count;
+  }
+
+  return ret;
+}
+
+static int32_t meters_codec_bench_mercury(const uint8_t *frame, size_t length)
+{
+  if(!meters_codec_crc16_is_valid(frame, length))
+    return -EBADMSG;
+
+  return meters_codec_unpack3(&frame[1], 0x3F) + meters_codec_unpack3(&frame[4], 0x3F);
+}
+
+static int32_t meters_codec_bench_modbus(const uint8_t *frame, size_t length)
+{
+  int32_t expected = meters_codec_modbus_frame_length(frame, length);
+
+  if((expected <= 0) || ((size_t)expected != length) || !meters_codec_crc16_is_valid(frame, expected))
+    return -EBADMSG;
+
+  return expected;
+}
+
+// Пропускная способность разбора кадров без обмена по линии
+static int32_t meters_codec_cmd(const struct shell * shell, size_t argc, uint8_t **argv)
+{
+  static meters_codec_bench_t bench[3] = {
+    {.name = "ce318", .decode = meters_codec_bench_smp},
+    {.name = "mercury234", .decode = meters_codec_bench_mercury},
+    {.name = "spm90", .decode = meters_codec_bench_modbus},
+  };
+  uint32_t iterations = (argc > 1) ? strtol(argv[1], NULL, 10) : METERS_CODEC_BENCH_ITERATIONS;
+  // эхо запроса и три поля DFF токов фаз, в том числе со служебными байтами
+  const uint8_t smp_data[] = {10, 0, 22, 0xC0, 0x0F, 0xDB, 0x1D, 0x85, 0x7F};
+  int32_t ret;
+
+  if(iterations == 0)
+    iterations = METERS_CODEC_BENCH_ITERATIONS;
+
+  ret = meters_codec_smp_encode(80114997, 6, smp_data, sizeof(smp_data),
+                                bench[0].frame, sizeof(bench[0].frame));
+  bench[0].length = (ret > 0) ? ret : 0;
+
+  // ответ на чтение 16 байт: адрес и данные
+  bench[1].frame[0] = 47;
+  for(uint32_t i = 1; i <= 16; i++)
+    bench[1].frame[i] = i * 13;
+  bench[1].length = meters_codec_crc16_append(bench[1].frame, 17);
+
+  // ответ на чтение шести регистров
+  bench[2].frame[0] = 1;
+  bench[2].frame[1] = 0x03;
+  bench[2].frame[2] = 12;
+  for(uint32_t i = 0; i < 12; i++)
+    bench[2].frame[3 + i] = i * 7;
+  bench[2].length = meters_codec_crc16_append(bench[2].frame, 15);
+
+  shell_print(shell, "decoder,frame_bytes,iterations,total_us,ns_per_frame,frames_per_s");
+
+  for(uint32_t n = 0; n < ARRAY_SIZE(bench); n++){
+    meters_codec_bench_t *item = &bench[n];
+
+    if(item->decode(item->frame, item->length) < 0){
+      shell_error(shell, "%s: sample frame rejected", item->name);
+      continue;
+    }
+
+    uint32_t start = k_cycle_get_32();
+    for(uint32_t i = 0; i < iterations; i++){
+      ret = item->decode(item->frame, item->length);
+      compiler_barrier();
+    }
+    uint64_t ns = k_cyc_to_ns_floor64(k_cycle_get_32() - start);
+
+    shell_print(shell, "%s,%u,%u,%llu,%llu,%llu", item->name, item->length, iterations, ns / 1000,
+                ns / iterations, (ns > 0) ? (iterations * 1000000000ULL / ns) : 0);
+  }
+
+  return 0;
+}
+#endif //CONFIG_STRIM_METERS2_BENCH
+
+#if CONFIG_STRIM_METERS2_CAPTURE
+enum{METERS_CAPTURE_LINE_SIZE = 32};   // байт дампа в строке
+
+static int32_t meters_capture_on_cmd(const struct shell * shell, size_t argc, uint8_t **argv)
+{
+  meters_capture_set_enabled(true);
+  return 0;
+}
+
+static int32_t meters_capture_off_cmd(const struct shell * shell, size_t argc, uint8_t **argv)
+{
+  meters_capture_set_enabled(false);
+  return 0;
+}
+
+static int32_t meters_capture_clear_cmd(const struct shell * shell, size_t argc, uint8_t **argv)
+{
+  meters_capture_clear();
+  return 0;
+}
+
+// Кольцо целиком в hex, строки дампа принимает 'meters capture load'
+static int32_t meters_capture_dump_cmd(const struct shell * shell, size_t argc, uint8_t **argv)
+{
+  uint8_t data[METERS_CAPTURE_LINE_SIZE];
+  char hex[(2 * METERS_CAPTURE_LINE_SIZE) + 1];
+  uint32_t offset = 0;
+  int32_t ret;
+
+  shell_print(shell, "# capture %s, %u bytes, %u dropped", meters_capture_is_enabled() ? "on" : "off",
+              meters_capture_get_size(), meters_capture_get_dropped());
+
+  while((ret = meters_capture_read(offset, data, sizeof(data))) > 0){
+    bin2hex(data, ret, hex, sizeof(hex));
+    shell_print(shell, "%s", hex);
+    offset += ret;
+  }
+
+  return 0;
+}
+
+static int32_t meters_capture_load_cmd(const struct shell * shell, size_t argc, uint8_t **argv)
+{
+  uint8_t data[METERS_CAPTURE_LINE_SIZE];
+
+  for(size_t i = 1; i < argc; i++){
+    size_t length = hex2bin(argv[i], strlen(argv[i]), data, sizeof(data));
+    if(length == 0){
+      shell_error(shell, "bad hex: %s", argv[i]);
+      return 0;
+    }
+
+    int32_t ret = meters_capture_load(data, length);
+    if(ret < 0){
+      shell_error(shell, "load error: %d%s", ret, (ret == -EBUSY) ? ", capture is on" : "");
+      return 0;
+    }
+  }
+
+  return 0;
+}
+
+// Записи по порядку: время, направление, счетчик, скорость и байты кадра
+static int32_t meters_capture_show_cmd(const struct shell * shell, size_t argc, uint8_t **argv)
+{
+  static uint8_t data[256];
+  meters_capture_record_t record;
+  uint32_t offset = 0;
+  uint32_t first_us = 0;
+  int32_t ret;
+
+  while(true){
+    uint32_t position = offset;
+
+    ret = meters_capture_get(&offset, &record, data, sizeof(data));
+    if((ret == -ENODATA) || (ret == -EBADMSG))
+      break;
+
+    if(position == 0)
+      first_us = record.timestamp_us;
+
+    shell_print(shell, "%10u %s item %3u %6u baud, %u bytes", record.timestamp_us - first_us,
+                (record.direction == meters_capture_tx) ? "TX" : "RX", record.item,
+                record.baudrate, record.length);
+    if(ret > 0)
+      shell_hexdump(shell, data, ret);
+  }
+
+  if(ret == -EBADMSG)
+    shell_warn(shell, "truncated record at offset %u", offset);
+
+  return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_capture,
+  SHELL_CMD(on, NULL, "Start capture", meters_capture_on_cmd),
+  SHELL_CMD(off, NULL, "Stop capture", meters_capture_off_cmd),
+  SHELL_CMD(clear, NULL, "Clear capture ring", meters_capture_clear_cmd),
+  SHELL_CMD(dump, NULL, "Dump capture ring in hex", meters_capture_dump_cmd),
+  SHELL_CMD_ARG(load, NULL, "Append dump lines to the ring: <hex> [hex]...", meters_capture_load_cmd, 2, 8),
+  SHELL_CMD(show, NULL, "Show captured frames", meters_capture_show_cmd),
+  SHELL_SUBCMD_SET_END
+);
+#endif //CONFIG_STRIM_METERS2_CAPTURE
+
+#if CONFIG_STRIM_METERS2_TUNNEL
+enum{METERS_TUNNEL_GAP_MS = 20};        // пауза во вводе - конец кадра
+enum{METERS_TUNNEL_STACK_SIZE = 2048};
+
+typedef struct{
+  const struct shell *shell;
+  struct k_work_delayable flush;    // кадр уходит после паузы во вводе
+  struct k_mutex lock;
+  uint32_t baudrate;
+  size_t length;
+  bool is_overflow;
+  bool is_active;
+  uint8_t input[METERS_TUNNEL_FRAME_MAX_SIZE];    // копится, пока предыдущий кадр на линии
+  uint8_t request[METERS_TUNNEL_FRAME_MAX_SIZE];
+  uint8_t response[METERS_TUNNEL_FRAME_MAX_SIZE];
+}meters_tunnel_t;
+
+static meters_tunnel_t meters_tunnel;
+// слот ждет своей очереди в опросе, системную очередь этим не занимаем
+static struct k_work_q meters_tunnel_workq;
+static K_THREAD_STACK_DEFINE(meters_tunnel_stack, METERS_TUNNEL_STACK_SIZE);
+
+static void meters_tunnel_write(const struct shell *shell, const uint8_t *data, size_t length)
+{
+  while(length > 0){
+    size_t count = 0;
+
+    if(shell->iface->api->write(shell->iface, data, length, &count) != 0)
+      return;
+    data += count;
+    length -= count;
+  }
+}
+
+static void meters_tunnel_close(meters_tunnel_t *tunnel)
+{
+  tunnel->is_active = false;
+  shell_set_bypass(tunnel->shell, NULL);
+  shell_print(tunnel->shell, "\ntunnel closed");
+}
+
+static void meters_tunnel_flush_handler(struct k_work *work)
+{
+  meters_tunnel_t *tunnel = CONTAINER_OF(k_work_delayable_from_work(work), meters_tunnel_t, flush);
+  size_t length;
+  bool is_overflow;
+
+  k_mutex_lock(&tunnel->lock, K_FOREVER);
+  {
+    length = tunnel->length;
+    is_overflow = tunnel->is_overflow;
+    memcpy(tunnel->request, tunnel->input, length);
+    tunnel->length = 0;
+    tunnel->is_overflow = false;
+  }
+  k_mutex_unlock(&tunnel->lock);
+
+  if(!tunnel->is_active || (length == 0))
+    return;
+
+  // "+++" отдельным кадром закрывает туннель
+  if((length == 3) && (memcmp(tunnel->request, "+++", 3) == 0)){
+    meters_tunnel_close(tunnel);
+    return;
+  }
+
+  if(is_overflow)
+    return; // обрезанный кадр счетчик все равно отвергнет
+
+  int32_t ret = meters_tunnel_transfer(tunnel->baudrate, tunnel->request, length,
+                                      tunnel->response, sizeof(tunnel->response));
+  if(ret > 0)
+    meters_tunnel_write(tunnel->shell, tunnel->response, ret);
+}
+
+// Байты внешней программы не разбираются, кадры делятся паузами
+static void meters_tunnel_bypass(const struct shell *shell, uint8_t *data, size_t length)
+{
+  meters_tunnel_t *tunnel = &meters_tunnel;
+
+  k_mutex_lock(&tunnel->lock, K_FOREVER);
+  {
+    size_t count = MIN(length, sizeof(tunnel->input) - tunnel->length);
+
+    memcpy(&tunnel->input[tunnel->length], data, count);
+    tunnel->length += count;
+    if(count < length)
+      tunnel->is_overflow = true;
+  }
+  k_mutex_unlock(&tunnel->lock);
+
+  k_work_reschedule_for_queue(&meters_tunnel_workq, &tunnel->flush, K_MSEC(METERS_TUNNEL_GAP_MS));
+}
+
+static int32_t meters_tunnel_open_cmd(const struct shell * shell, size_t argc, uint8_t **argv)
+{
+  static bool is_started;
+  meters_tunnel_t *tunnel = &meters_tunnel;
+  uint32_t baudrate = strtoul(argv[1], NULL, 10);
+
+  if(meters_context.tools == NULL){
+    shell_warn(shell, "meters not initialized");
+    return 0;
+  }
+
+  if(baudrate == 0){
+    shell_warn(shell, "wrong baudrate");
+    return 0;
+  }
+
+  if(!is_started){
+    const struct k_work_queue_config config = {.name = "meters_tunnel"};
+
+    k_mutex_init(&tunnel->lock);
+    k_work_init_delayable(&tunnel->flush, meters_tunnel_flush_handler);
+    k_work_queue_init(&meters_tunnel_workq);
+    k_work_queue_start(&meters_tunnel_workq, meters_tunnel_stack, K_THREAD_STACK_SIZEOF(meters_tunnel_stack),
+                      CONFIG_STRIM_METERS2_MAIN_THREAD_PRIORITY, &config);
+    is_started = true;
+  }
+
+  tunnel->shell = shell;
+  tunnel->baudrate = baudrate;
+  tunnel->length = 0;
+  tunnel->is_overflow = false;
+  tunnel->is_active = true;
+
+  shell_print(shell, "tunnel at %u baud, '+++' after a pause closes it", baudrate);
+  shell_set_bypass(shell, meters_tunnel_bypass);
+
+  return 0;
+}
+
+static int32_t meters_tunnel_send_cmd(const struct shell * shell, size_t argc, uint8_t **argv)
+{
+  static uint8_t request[METERS_TUNNEL_FRAME_MAX_SIZE];
+  static uint8_t response[METERS_TUNNEL_FRAME_MAX_SIZE];
+  uint32_t baudrate = strtoul(argv[1], NULL, 10);
+  size_t length = 0;
+
+  for(size_t i = 2; i < argc; i++){
+    size_t hex_length = strlen(argv[i]);
+    // hex2bin возвращает 0 и на нехватку места, и на ошибку в строке
+    if((hex_length + 1) / 2 > sizeof(request) - length){
+      shell_error(shell, "frame exceeds %u bytes", METERS_TUNNEL_FRAME_MAX_SIZE);
+      return 0;
+    }
+
+    size_t count = hex2bin(argv[i], hex_length, &request[length], sizeof(request) - length);
+    if(count == 0){
+      shell_error(shell, "bad hex: %s", argv[i]);
+      return 0;
+    }
+    length += count;
+  }
+
+  int32_t ret = meters_tunnel_transfer(baudrate, request, length, response, sizeof(response));
+  if(ret == -EBUSY){
+    shell_warn(shell, "previous frame is still on the line");
+    return 0;
+  }
+  if(ret < 0){
+    shell_warn(shell, "tunnel error: %d", ret);
+    return 0;
+  }
+
+  shell_hexdump(shell, response, ret);
+  return 0;
+}
+
+static int32_t meters_tunnel_stats_cmd(const struct shell * shell, size_t argc, uint8_t **argv)
+{
+  meters_tunnel_stats_t stats;
+
+  meters_tunnel_get_stats(&stats);
+  if((argc > 1) && (strcmp(argv[1], "clear") == 0))
+    meters_tunnel_clear_stats();
+
+  shell_print(shell, "slots %u, no answer %u, tx %u bytes, rx %u bytes",
+              stats.slots, stats.timeouts, stats.bytes_tx, stats.bytes_rx);
+  shell_print(shell, "wait for slot  : last %u us, max %u us", stats.wait_us_last, stats.wait_us_max);
+  shell_print(shell, "slot bus time  : last %u us, max %u us, limit %u ms",
+              stats.slot_us_last, stats.slot_us_max, CONFIG_STRIM_METERS2_TUNNEL_SLOT_MS);
+
+  return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_tunnel,
+  SHELL_CMD_ARG(open, NULL, "Raw pass-through of the shell transport: <baudrate>", meters_tunnel_open_cmd, 2, 0),
+  SHELL_CMD_ARG(send, NULL, "Send one frame: <baudrate> <hex> [hex]...", meters_tunnel_send_cmd, 3, 8),
+  SHELL_CMD_ARG(stats, NULL, "Slot latency: [clear]", meters_tunnel_stats_cmd, 1, 1),
+  SHELL_SUBCMD_SET_END
+);
+#endif //CONFIG_STRIM_METERS2_TUNNEL
+
+#if CONFIG_STRIM_METERS2_BUS485_SIM
+static int32_t meters_sim_faults_cmd(const struct shell * shell, size_t argc, uint8_t **argv)
+{
+  meters_sim485_faults_t faults;
+
+  meters_sim485_get_faults(&faults);
+
+  if(argc > 1)
+    faults.latency_ms = strtol(argv[1], NULL, 10);
+  if(argc > 2)
+    faults.drop_permille = strtol(argv[2], NULL, 10);
+  if(argc > 3)
+    faults.corrupt_permille = strtol(argv[3], NULL, 10);
+  if(argc > 4)
+    faults.split_size = strtol(argv[4], NULL, 10);
+
+  meters_sim485_set_faults(&faults);
+
+  shell_print(shell, "latency %u ms, drop %u/1000, corrupt %u/1000, split %u bytes",
+              faults.latency_ms, faults.drop_permille, faults.corrupt_permille, faults.split_size);
+  return 0;
+}
+
+static int32_t meters_sim_oops_cmd(const struct shell * shell, size_t argc, uint8_t **argv)
+{
+  meters_sim485_oops();
+  shell_print(shell, "poll thread faults on its next request");
+  return 0;
+}
+
+static int32_t meters_sim_add_cmd(const struct shell * shell, size_t argc, uint8_t **argv)
+{
+  meters_type_t type = meters_get_type_by_id(argv[1]);
+  if(type == NULL){
+    shell_warn(shell, "unknown type: %s", argv[1]);
+    return 0;
+  }
+
+  int32_t ret = meters_sim485_add(type, strtol(argv[2], NULL, 10), strtol(argv[3], NULL, 10));
+  if(ret < 0)
+    shell_error(shell, "emulator add error: %d", ret);
+  else
+    shell_print(shell, "emulator %d added, %u total", ret, meters_sim485_get_count());
+
+  return 0;
+}
+
+static int32_t meters_sim_block_cmd(const struct shell * shell, size_t argc, uint8_t **argv)
+{
+  static const char * const modes[] = {"native", "rejected", "foreign"};
+  uint32_t mode;
+
+  for(mode = 0; mode < ARRAY_SIZE(modes); mode++){
+    if(strcmp(argv[2], modes[mode]) == 0)
+      break;
+  }
+  if(mode >= ARRAY_SIZE(modes)){
+    shell_warn(shell, "unknown mode: %s, use native|rejected|foreign", argv[2]);
+    return 0;
+  }
+
+  int32_t ret = meters_sim485_set_mercury_block(strtoul(argv[1], NULL, 10), mode);
+  if(ret < 0)
+    shell_error(shell, "emulator error: %d", ret);
+
+  return 0;
+}
+
+#if CONFIG_STRIM_METERS2_CAPTURE
+static int32_t meters_sim_replay_cmd(const struct shell * shell, size_t argc, uint8_t **argv)
+{
+  meters_sim485_replay_t replay;
+
+  if((argc > 1) && (strcmp(argv[1], "stop") == 0))
+    meters_sim485_replay_stop();
+  else if(argc > 1){
+    shell_warn(shell, "unknown argument: %s", argv[1]);
+    return 0;
+  }
+  else
+    meters_sim485_replay_start();
+
+  meters_sim485_get_replay(&replay);
+  shell_print(shell, "replay %s: offset %u of %u, requests %u, misses %u",
+              replay.is_active ? "on" : "off", replay.offset, meters_capture_get_size(),
+              replay.requests, replay.misses);
+  return 0;
+}
+#endif
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_sim,
+  SHELL_CMD_ARG(faults, NULL, "Line faults: [latency ms] [drop 1/1000] [corrupt 1/1000] [split bytes]",
+                meters_sim_faults_cmd, 1, 4),
+  SHELL_CMD(oops, NULL, "Fault the poll thread on its next request, see FATAL_HANDLER", meters_sim_oops_cmd),
+  SHELL_CMD_ARG(add, NULL, "Add emulator: <type> <address> <baudrate>", meters_sim_add_cmd, 4, 0),
+  SHELL_CMD_ARG(block, NULL, "Mercury answer to the parameters array: <emulator> <native|rejected|foreign>",
+                meters_sim_block_cmd, 3, 0),
+#if CONFIG_STRIM_METERS2_CAPTURE
+  SHELL_CMD_ARG(replay, NULL, "Replay loaded capture instead of emulators: [stop]",
+                meters_sim_replay_cmd, 1, 1),
+#endif
+  SHELL_SUBCMD_SET_END
+);
+#endif //CONFIG_STRIM_METERS2_BUS485_SIM
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_meters,
+  #if CONFIG_STRIM_METERS2_CE318
+    SHELL_CMD(ce318, &sub_ce318,  "Energomera CE318BY", NULL),
+  #endif
+  #if CONFIG_STRIM_METERS2_MERCURY234
+    SHELL_CMD(mercury, &sub_mercury, "Mercury protocol", NULL),
+  #endif
+  #if CONFIG_STRIM_METERS2_SPM90
+    SHELL_CMD_ARG(spm90, NULL,    "spm90 read",         spm90_read_cmd, 2, 1),
+  #endif
+  #if CONFIG_STRIM_METERS2_SCAN
+    SHELL_CMD_ARG(scan, NULL,   "Find meters: [type|all] [baudrate|0] [timeout ms] [gen]", 
+                  meters_scan_cmd, 1, 4),
+  #endif
+  #if CONFIG_STRIM_METERS2_BENCH
+    SHELL_CMD_ARG(bench, NULL, "Poll cycle costs as CSV: [cycles]", meters_bench_cmd, 1, 1),
+    SHELL_CMD_ARG(codec, NULL, "Frame decoding throughput as CSV: [iterations]", meters_codec_cmd, 1, 1),
+  #endif
+  #if CONFIG_STRIM_METERS2_BUS485_SIM
+    SHELL_CMD(sim, &sub_sim, "Simulated bus485 line", NULL),
+  #endif
+  #if CONFIG_STRIM_METERS2_CAPTURE
+    SHELL_CMD(capture, &sub_capture, "Bus traffic capture", NULL),
+  #endif
+  #if CONFIG_STRIM_METERS2_TUNNEL
+    SHELL_CMD(tunnel, &sub_tunnel, "RS485 pass-through for vendor tools", NULL),
+  #endif
+  SHELL_CMD(testdc, NULL, "test to write data", meters_testDC_cmd),
+  SHELL_CMD(testac, NULL, "test to write data", meters_testAC_cmd),
+  SHELL_CMD_ARG(get, NULL, "view data for single meter by index", meters_view_single_cmd, 2, 1),
+  SHELL_CMD_ARG(fresh, NULL, "Read meter out of turn: <index> [max age ms] [timeout ms]",
+    meters_fresh_cmd, 2, 2),
+  SHELL_CMD_ARG(snapshot, NULL, "Read energy and power of all meters in one burst: [timeout ms|last]",
+    meters_snapshot_cmd, 1, 1),
+  #if CONFIG_STRIM_METERS2_BALANCE
+    SHELL_CMD(balance, NULL, "Parent meter against the sum of children", meters_balance_cmd),
+  #endif
+  SHELL_CMD_ARG(stats, NULL, "Link statistics: [index]", meters_stats_cmd, 1, 1),
+  #if CONFIG_STRIM_METERS2_BUS485_ENABLE
+    SHELL_CMD(budget, NULL, "Predicted and measured bus load", meters_budget_cmd),
+  #endif
   SHELL_CMD(view, NULL,  "View all data", meters_view_cmd),
-  SHELL_CMD(reinit, NULL, "Reinite invoke", meters_reinit_cmd),
+  SHELL_CMD_ARG(watch, NULL, "Live view, any key stops: [period ms] [fields epvc]", meters_watch_cmd, 1, 2),
+  SHELL_CMD(reinit, NULL, "Reinitialize all meters, values are reset", meters_reinit_cmd),
+  SHELL_CMD_ARG(add, NULL, "Add meter: <type> <address> [baudrate] [ct] [period ms]", meters_add_cmd, 3, 3),
+  SHELL_CMD_ARG(remove, NULL, "Remove meter: <index>", meters_remove_cmd, 2, 0),
+  SHELL_CMD_ARG(set, NULL, "Edit meter: <index> <type|address|baudrate|ct|period|balance> <value>", 
+                meters_set_cmd, 4, 0),
   SHELL_SUBCMD_SET_END /* Array terminated */
 );
 
@@ -0,0 +1,91 @@
+#include "meters_codec.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Скорость сборки и разбора кадров на хосте, кадров в секунду
+enum{BENCH_DEFAULT_FRAMES = 1000000};
+enum{BENCH_SMP_PAYLOAD_SIZE = 64};
+enum{BENCH_MODBUS_REGISTERS = 40};
+
+static volatile int32_t bench_sink;
+
+static double bench_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+static void bench_report(const char *name, uint32_t frames, double seconds)
+{
+    printf("%-16s %10u frames %8.3f s %12.0f frames/s\n", name, frames, seconds, frames / seconds);
+}
+
+// Ответ CE318 с замененными байтами: сборка и полный разбор с проверкой CRC
+static int32_t bench_smp(uint32_t frames)
+{
+    uint8_t payload[BENCH_SMP_PAYLOAD_SIZE];
+    uint8_t frame[METERS_CODEC_SMP_FRAME_MAX_SIZE * 2];
+    uint8_t data[METERS_CODEC_SMP_FRAME_MAX_SIZE];
+    uint32_t source;
+
+    for(size_t i = 0; i < sizeof(payload); i++)
+        payload[i] = (i % 16 == 0) ? METERS_CODEC_SMP_END : (uint8_t)(i * 37);
+
+    int32_t length = meters_codec_smp_encode(80114997, 0x01, payload, sizeof(payload), frame, sizeof(frame));
+    if(length < 0)
+        return length;
+
+    double start = bench_now();
+    for(uint32_t i = 0; i < frames; i++)
+        bench_sink = meters_codec_smp_decode(frame, length, data, sizeof(data), &source);
+    bench_report("smp_decode", frames, bench_now() - start);
+
+    if((bench_sink != sizeof(payload)) || (memcmp(data, payload, sizeof(payload)) != 0))
+        return -1;
+
+    start = bench_now();
+    for(uint32_t i = 0; i < frames; i++)
+        bench_sink = meters_codec_smp_encode(80114997, 0x01, payload, sizeof(payload), frame, sizeof(frame));
+    bench_report("smp_encode", frames, bench_now() - start);
+
+    return 0;
+}
+
+// Ответ Modbus на чтение регистров: длина по заголовку и проверка CRC
+static int32_t bench_modbus(uint32_t frames)
+{
+    uint8_t frame[3 + BENCH_MODBUS_REGISTERS * 2 + METERS_CODEC_CRC_SIZE] = {1, 0x04, BENCH_MODBUS_REGISTERS * 2};
+
+    for(size_t i = 3; i < sizeof(frame) - METERS_CODEC_CRC_SIZE; i++)
+        frame[i] = (uint8_t)(i * 13);
+    size_t length = meters_codec_crc16_append(frame, sizeof(frame) - METERS_CODEC_CRC_SIZE);
+
+    double start = bench_now();
+    for(uint32_t i = 0; i < frames; i++){
+        int32_t expected = meters_codec_modbus_frame_length(frame, METERS_CODEC_MODBUS_HEADER_SIZE);
+        bench_sink = (expected == (int32_t)length) && meters_codec_crc16_is_valid(frame, length);
+    }
+    bench_report("modbus_rx", frames, bench_now() - start);
+
+    return bench_sink ? 0 : -1;
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t frames = (argc > 1) ? (uint32_t)strtoul(argv[1], NULL, 0) : BENCH_DEFAULT_FRAMES;
+
+    if(frames == 0)
+        frames = BENCH_DEFAULT_FRAMES;
+
+    if((bench_smp(frames) < 0) || (bench_modbus(frames) < 0)){
+        fprintf(stderr, "codec self-check failed\n");
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,35 @@
+#include "meters_codec.h"
+#include <stdlib.h>
+#include <string.h>
+
+// CRC Mercury/Modbus: кадр с дописанной суммой проходит проверку, испорченный
+// байт - нет; проверка коротких кадров не читает за их конец
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    static uint8_t frame[1024 + METERS_CODEC_CRC_SIZE];
+
+    (void)meters_codec_crc16_is_valid(data, size);
+
+    if(size > sizeof(frame) - METERS_CODEC_CRC_SIZE)
+        size = sizeof(frame) - METERS_CODEC_CRC_SIZE;
+    memcpy(frame, data, size);
+
+    size_t length = meters_codec_crc16_append(frame, size);
+    if(length != size + METERS_CODEC_CRC_SIZE)
+        abort();
+
+    // кадр из одной суммы без данных проверку не проходит
+    if(size > 0){
+        if(!meters_codec_crc16_is_valid(frame, length))
+            abort();
+
+        // CRC16 ловит любую одиночную ошибку в байте
+        frame[data[0] % size] ^= 0x5A;
+        if(meters_codec_crc16_is_valid(frame, length))
+            abort();
+    }
+
+    (void)meters_codec_smp_crc16(0, data, size);
+
+    return 0;
+}
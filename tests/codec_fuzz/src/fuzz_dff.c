@@ -0,0 +1,23 @@
+#include "meters_codec.h"
+#include <stdlib.h>
+
+// Поле DFF: разбор не читает дальше remaining и занимает не больше 9 байт
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    size_t offset = 0;
+    int64_t field;
+
+    while(offset < size){
+        bool is_signed = data[offset] & 0x01;
+        int32_t count = meters_codec_dff_parse(&data[offset], size - offset, &field, is_signed);
+
+        if(count <= 0)
+            break;
+        if(((size_t)count > size - offset) || (count > 9))
+            abort();
+
+        offset += count;
+    }
+
+    return 0;
+}
@@ -0,0 +1,76 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Замена libFuzzer для компиляторов без -fsanitize=fuzzer: файлы из аргументов
+// прогоняются как готовый корпус, без аргументов - псевдослучайные входы
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+enum{DRIVER_RANDOM_RUNS = 200000};
+enum{DRIVER_INPUT_MAX_SIZE = 600};
+
+static uint32_t driver_seed = 0x1234567;
+
+static uint32_t driver_random(void)
+{
+    driver_seed ^= driver_seed << 13;
+    driver_seed ^= driver_seed >> 17;
+    driver_seed ^= driver_seed << 5;
+
+    return driver_seed;
+}
+
+static int driver_run_file(const char *path)
+{
+    static uint8_t data[1 << 16];
+    FILE *file = fopen(path, "rb");
+
+    if(file == NULL){
+        perror(path);
+        return -1;
+    }
+
+    size_t size = fread(data, 1, sizeof(data), file);
+    fclose(file);
+
+    LLVMFuzzerTestOneInput(data, size);
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    static uint8_t data[DRIVER_INPUT_MAX_SIZE];
+
+    if(argc > 1){
+        for(int i = 1; i < argc; i++){
+            if(driver_run_file(argv[i]) < 0)
+                return EXIT_FAILURE;
+        }
+        return EXIT_SUCCESS;
+    }
+
+    for(uint32_t run = 0; run < DRIVER_RANDOM_RUNS; run++){
+        size_t size = driver_random() % (sizeof(data) + 1);
+
+        // редкие значения служебных байт, чтобы чаще попадать в ветви разбора
+        for(size_t i = 0; i < size; i++){
+            uint32_t value = driver_random();
+
+            switch(value & 0x07){
+                case 0: data[i] = 0xC0; break;
+                case 1: data[i] = 0xDB; break;
+                case 2: data[i] = 0xDC + ((value >> 3) & 1); break;
+                case 3: data[i] = (value >> 3) & 0x83; break;
+                default: data[i] = value >> 8; break;
+            }
+        }
+
+        LLVMFuzzerTestOneInput(data, size);
+    }
+
+    printf("%u random inputs passed\n", DRIVER_RANDOM_RUNS);
+
+    return EXIT_SUCCESS;
+}
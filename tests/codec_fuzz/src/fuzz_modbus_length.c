@@ -0,0 +1,23 @@
+#include "meters_codec.h"
+#include <errno.h>
+#include <stdlib.h>
+
+// Длина ответа Modbus по любому префиксу кадра: 0, -EBADMSG или длина, которая
+// помещается в кадр Modbus RTU
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    for(size_t length = 0; length <= size; length++){
+        int32_t expected = meters_codec_modbus_frame_length(data, length);
+
+        if((expected < 0) && (expected != -EBADMSG))
+            abort();
+        if(expected > 256)
+            abort();
+        // известная длина не меняется с приходом следующих байт
+        if((expected > 0) && (length < size) &&
+           (meters_codec_modbus_frame_length(data, length + 1) != expected))
+            abort();
+    }
+
+    return 0;
+}
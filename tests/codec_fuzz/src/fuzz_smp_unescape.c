@@ -0,0 +1,53 @@
+#include "meters_codec.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Снятие замены байт и разбор кадра SMP: не выходят за буфер, а экранированный
+// обратно результат снимается в те же байты. Разбор на месте совпадает с обычным
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    static uint8_t plain[METERS_CODEC_SMP_FRAME_MAX_SIZE];
+    static uint8_t escaped[METERS_CODEC_SMP_FRAME_MAX_SIZE * 2];
+    static uint8_t again[METERS_CODEC_SMP_FRAME_MAX_SIZE];
+    static uint8_t inplace[METERS_CODEC_SMP_FRAME_MAX_SIZE * 2];
+    uint32_t source;
+
+    // первый байт задает размер приемного буфера, чтобы проверять и его границу
+    if(size < 1)
+        return 0;
+    size_t limit = data[0] % (sizeof(plain) + 1);
+    data++;
+    size--;
+
+    int32_t count = meters_codec_smp_unescape(data, size, plain, limit);
+    if(count > (int32_t)limit)
+        abort();
+
+    if(count >= 0){
+        int32_t length = meters_codec_smp_escape(plain, count, escaped, sizeof(escaped));
+        if(length < 0)
+            abort();
+        if(meters_codec_smp_unescape(escaped, length, again, sizeof(again)) != count)
+            abort();
+        if(memcmp(plain, again, count) != 0)
+            abort();
+    }
+
+    count = meters_codec_smp_decode(data, size, plain, limit, &source);
+    if((count > (int32_t)limit) || ((count >= 0) && ((size_t)count + METERS_CODEC_SMP_HEADER_SIZE + 2 > limit)))
+        abort();
+
+    // разбор на месте, как в драйвере CE318, дает тот же результат
+    if(size <= sizeof(inplace)){
+        uint32_t inplace_source;
+
+        memcpy(inplace, data, size);
+        int32_t inplace_count = meters_codec_smp_decode(inplace, size, inplace, sizeof(inplace),
+                                                        &inplace_source);
+        if((count >= 0) && ((inplace_count != count) || (inplace_source != source) ||
+                            (memcmp(inplace, plain, count) != 0)))
+            abort();
+    }
+
+    return 0;
+}
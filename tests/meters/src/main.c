@@ -0,0 +1,449 @@
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/ztest.h>
+
+#include "meters.h"
+#include "meters_sim485.h"
+
+METERS_TYPE_DECLARE(mercury234);
+METERS_TYPE_DECLARE(ce318);
+METERS_TYPE_DECLARE(spm90);
+
+enum{METERS_TEST_FRESH_MS = 30000};
+enum{METERS_TEST_STEP_MS = 50};
+
+// Индексы в таблице; эмуляторы создаются по ней при meters_init (или из devicetree) в том же порядке
+enum{
+    test_mercury = 0,
+    test_ce318,
+    test_spm90,
+    test_extern,
+    test_count
+};
+
+// Эмуляторы, добавленные тестами после meters_init
+enum{
+    test_emulator_mercury_19200 = test_extern,
+    test_emulator_mercury_50,
+    test_emulator_mercury_51,
+    test_emulator_mercury_52,
+};
+
+static const meter_parameters_t test_table[test_count] = {
+    [test_mercury] = {.type = METERS_TYPE(mercury234), .address = 47, .baudrate = 9600},
+    [test_ce318] = {.type = METERS_TYPE(ce318), .address = 80114997, .baudrate = 4800},
+    [test_spm90] = {.type = METERS_TYPE(spm90), .address = 1, .baudrate = 9600},
+    [test_extern] = {.type = METERS_TYPE(extern_ac), .address = 3},
+};
+
+// Значения подобраны под разрядность протоколов, поэтому сравниваются без округления энергии
+static const meters_values_t test_ac = {
+    .type = meters_current_type_ac,
+    .AC = {
+        .energy_active = 123456ULL * 3600,
+        .voltage = {231.50f, 232.25f, 229.75f},
+        .current = {5.125f, 6.500f, 7.750f},
+        .power_active = 4476.63f,
+        .frequency = 49.98f,
+    },
+};
+
+static const meters_values_t test_ac_19200 = {
+    .type = meters_current_type_ac,
+    .AC = {
+        .energy_active = 777ULL * 3600,
+        .voltage = {220.00f, 221.00f, 222.00f},
+        .current = {1.000f, 2.000f, 3.000f},
+        .power_active = 1326.00f,
+        .frequency = 50.02f,
+    },
+};
+
+static const meters_values_t test_dc = {
+    .type = meters_current_type_dc,
+    .DC = {
+        .energy = 56789ULL * 36000,
+        .voltage = 401.2f,
+        .current = 12.34f,
+        .power = 4950.8f,
+    },
+};
+
+static void test_fresh(uint32_t idx, meters_values_t *values)
+{
+    int32_t ret = meters_request_fresh(idx, 0, K_MSEC(METERS_TEST_FRESH_MS));
+
+    zassert_ok(ret, "meter %u fresh read error %d", idx, ret);
+    zassert_ok(meters_get_values(idx, values), "meter %u has no values", idx);
+}
+
+static void test_fresh_fails(uint32_t idx)
+{
+    int32_t ret = meters_request_fresh(idx, 0, K_MSEC(METERS_TEST_FRESH_MS));
+
+    zassert_not_equal(ret, 0, "meter %u read must fail", idx);
+}
+
+static void test_assert_ac(const meters_values_t *values, const meters_values_t *expected,
+                        bool has_frequency)
+{
+    const meters_values_ac_t *ac = &values->AC;
+    const meters_values_ac_t *want = &expected->AC;
+
+    zassert_equal(values->type, meters_current_type_ac);
+    zassert_equal(ac->energy_active, want->energy_active, "energy %llu",
+                (unsigned long long)ac->energy_active);
+    zassert_within(ac->power_active, want->power_active, 1.0f, "power %f", (double)ac->power_active);
+    for(uint32_t i = 0; i < 3; i++){
+        zassert_within(ac->voltage[i], want->voltage[i], 0.01f, "voltage %u", i);
+        zassert_within(ac->current[i], want->current[i], 0.001f, "current %u", i);
+    }
+    if(has_frequency)
+        zassert_within(ac->frequency, want->frequency, 0.01f, "frequency %f", (double)ac->frequency);
+}
+
+static void test_assert_dc(const meters_values_t *values, const meters_values_t *expected)
+{
+    const meters_values_dc_t *dc = &values->DC;
+    const meters_values_dc_t *want = &expected->DC;
+
+    zassert_equal(values->type, meters_current_type_dc);
+    zassert_equal(dc->energy, want->energy, "energy %llu", (unsigned long long)dc->energy);
+    zassert_within(dc->voltage, want->voltage, 0.1f, "voltage %f", (double)dc->voltage);
+    zassert_within(dc->current, want->current, 0.01f, "current %f", (double)dc->current);
+    zassert_within(dc->power, want->power, 0.1f, "power %f", (double)dc->power);
+}
+
+static void test_set_faults(uint32_t drop, uint32_t corrupt, uint32_t split)
+{
+    meters_sim485_faults_t faults = {
+        .drop_permille = drop,
+        .corrupt_permille = corrupt,
+        .split_size = split,
+    };
+
+    meters_sim485_set_faults(&faults);
+}
+
+static void *meters_test_setup(void)
+{
+    // таблица из devicetree (tests/meters/dt_table.overlay) та же, модуль запущен при старте
+    if(!IS_ENABLED(CONFIG_STRIM_METERS2_DT_TOPOLOGY))
+        zassert_ok(meters_init(test_table, test_count));
+
+    zassert_equal(meters_sim485_add(METERS_TYPE(mercury234), 48, 19200), test_emulator_mercury_19200);
+    zassert_equal(meters_sim485_add(METERS_TYPE(mercury234), 50, 9600), test_emulator_mercury_50);
+    zassert_equal(meters_sim485_add(METERS_TYPE(mercury234), 51, 9600), test_emulator_mercury_51);
+    zassert_equal(meters_sim485_add(METERS_TYPE(mercury234), 52, 9600), test_emulator_mercury_52);
+
+    zassert_ok(meters_sim485_set_values(test_mercury, &test_ac));
+    zassert_ok(meters_sim485_set_values(test_ce318, &test_ac));
+    zassert_ok(meters_sim485_set_values(test_spm90, &test_dc));
+    zassert_ok(meters_sim485_set_values(test_emulator_mercury_19200, &test_ac_19200));
+    for(uint32_t i = test_emulator_mercury_50; i <= test_emulator_mercury_52; i++)
+        zassert_ok(meters_sim485_set_values(i, &test_ac));
+
+    return NULL;
+}
+
+static void meters_test_before(void *fixture)
+{
+    ARG_UNUSED(fixture);
+
+    test_set_faults(0, 0, 0);
+    zassert_ok(meters_sim485_set_mercury_block(test_mercury, meters_sim485_block_native));
+    zassert_ok(meters_reconfigure(test_table, test_count));
+}
+
+ZTEST(meters, test_decode_mercury234)
+{
+    meters_values_t values;
+
+    test_fresh(test_mercury, &values);
+    test_assert_ac(&values, &test_ac, true);
+}
+
+ZTEST(meters, test_decode_ce318)
+{
+    meters_values_t values;
+
+    test_fresh(test_ce318, &values);
+    test_assert_ac(&values, &test_ac, false);
+}
+
+ZTEST(meters, test_decode_spm90)
+{
+    meters_values_t values;
+
+    test_fresh(test_spm90, &values);
+    test_assert_dc(&values, &test_dc);
+}
+
+ZTEST(meters, test_extern_values)
+{
+    meters_values_t values;
+
+    zassert_ok(meters_set_values(test_extern, &test_ac));
+    zassert_ok(meters_get_values(test_extern, &values));
+    zassert_mem_equal(&values, &test_ac, sizeof(values));
+
+    // у внешнего счетчика срочного чтения нет, есть только записанное значение
+    k_msleep(2);
+    zassert_equal(meters_request_fresh(test_extern, 0, K_NO_WAIT), -ENOTSUP);
+}
+
+ZTEST(meters, test_fault_drop)
+{
+    meters_link_stats_t before;
+    meters_link_stats_t after;
+    meters_values_t values;
+
+    zassert_ok(meters_get_link_stats(test_spm90, &before));
+
+    test_set_faults(1000, 0, 0);
+    test_fresh_fails(test_spm90);
+    test_fresh_fails(test_mercury);
+
+    zassert_ok(meters_get_link_stats(test_spm90, &after));
+    zassert_true(after.timeouts > before.timeouts);
+    zassert_true(after.driver_failures > before.driver_failures);
+    zassert_not_equal(after.backoff_ms, 0, "failed meter must back off");
+
+    // срочное чтение идет и в паузе отступа, счетчик сразу восстанавливается
+    test_set_faults(0, 0, 0);
+    test_fresh(test_spm90, &values);
+    test_assert_dc(&values, &test_dc);
+    test_fresh(test_mercury, &values);
+    test_assert_ac(&values, &test_ac, true);
+
+    zassert_ok(meters_get_link_stats(test_spm90, &after));
+    zassert_equal(after.backoff_ms, 0);
+}
+
+ZTEST(meters, test_fault_corrupt)
+{
+    meters_link_stats_t before;
+    meters_link_stats_t after;
+    meters_values_t values;
+
+    zassert_ok(meters_get_link_stats(test_spm90, &before));
+
+    // искаженный ответ отбрасывается по контрольной сумме и не попадает в значения
+    test_set_faults(0, 1000, 0);
+    test_fresh_fails(test_ce318);
+    test_fresh_fails(test_spm90);
+    test_fresh_fails(test_mercury);
+
+    zassert_ok(meters_get_link_stats(test_spm90, &after));
+    zassert_true(after.crc_errors > before.crc_errors);
+
+    test_set_faults(0, 0, 0);
+    test_fresh(test_ce318, &values);
+    test_assert_ac(&values, &test_ac, false);
+    test_fresh(test_spm90, &values);
+    test_assert_dc(&values, &test_dc);
+    test_fresh(test_mercury, &values);
+    test_assert_ac(&values, &test_ac, true);
+}
+
+ZTEST(meters, test_fault_split)
+{
+    meters_values_t values;
+
+    // ответ приходит по частям, кадр собирается из нескольких приемов
+    test_set_faults(0, 0, 3);
+    test_fresh(test_ce318, &values);
+    test_assert_ac(&values, &test_ac, false);
+    test_fresh(test_spm90, &values);
+    test_assert_dc(&values, &test_dc);
+    test_fresh(test_mercury, &values);
+    test_assert_ac(&values, &test_ac, true);
+}
+
+ZTEST(meters, test_baudrate_isolation)
+{
+    meter_parameters_t table[test_count];
+    meters_values_t values;
+
+    memcpy(table, test_table, sizeof(table));
+
+    // эмулятор с адресом 48 работает на 19200 и на 9600 молчит
+    table[test_mercury].address = 48;
+    zassert_ok(meters_reconfigure(table, test_count));
+    test_fresh_fails(test_mercury);
+
+    // и наоборот: счетчик 47 на 9600 не отвечает на 19200
+    table[test_mercury].address = 47;
+    table[test_mercury].baudrate = 19200;
+    zassert_ok(meters_reconfigure(table, test_count));
+    test_fresh_fails(test_mercury);
+
+    table[test_mercury].address = 48;
+    zassert_ok(meters_reconfigure(table, test_count));
+    test_fresh(test_mercury, &values);
+    test_assert_ac(&values, &test_ac_19200, true);
+
+    // смена скорости между счетчиками не мешает соседям на других скоростях
+    test_fresh(test_ce318, &values);
+    test_assert_ac(&values, &test_ac, false);
+    test_fresh(test_spm90, &values);
+    test_assert_dc(&values, &test_dc);
+}
+
+ZTEST(meters, test_mercury_block_rejected)
+{
+    meters_values_t values;
+
+    // состояние драйвера сбрасывается, массив параметров снова не проверен
+    zassert_ok(meters_sim485_set_mercury_block(test_mercury, meters_sim485_block_rejected));
+    zassert_ok(meters_reinit());
+
+    for(uint32_t i = 0; i < 3; i++){
+        test_fresh(test_mercury, &values);
+        test_assert_ac(&values, &test_ac, true);
+    }
+}
+
+ZTEST(meters, test_mercury_block_foreign)
+{
+    meters_values_t values;
+
+    // чужая раскладка обнаруживается сверкой и не попадает в значения
+    zassert_ok(meters_sim485_set_mercury_block(test_mercury, meters_sim485_block_foreign));
+    zassert_ok(meters_reinit());
+
+    for(uint32_t i = 0; i < 5; i++){
+        test_fresh(test_mercury, &values);
+        test_assert_ac(&values, &test_ac, true);
+    }
+}
+
+// Состояния драйверов выделяются, пока прежние еще заняты: пулы без запаса должны это выдержать
+ZTEST(meters, test_reinit_full_table)
+{
+    meter_parameters_t table[test_count];
+    meters_values_t values;
+
+    zassert_ok(meters_reinit());
+
+    test_fresh(test_mercury, &values);
+    test_assert_ac(&values, &test_ac, true);
+    test_fresh(test_ce318, &values);
+    test_assert_ac(&values, &test_ac, false);
+    test_fresh(test_spm90, &values);
+    test_assert_dc(&values, &test_dc);
+
+    // как meters set <i> address: счетчик заменяется другим того же типа
+    memcpy(table, test_table, sizeof(table));
+    table[test_mercury].address = 48;
+    table[test_mercury].baudrate = 19200;
+    zassert_ok(meters_reconfigure(table, test_count));
+    test_fresh(test_mercury, &values);
+    test_assert_ac(&values, &test_ac_19200, true);
+}
+
+ZTEST(meters, test_reinit_shared_driver)
+{
+    static const meter_parameters_t table[] = {
+        {.type = METERS_TYPE(mercury234), .address = 47, .baudrate = 9600},
+        {.type = METERS_TYPE(mercury234), .address = 50, .baudrate = 9600},
+        {.type = METERS_TYPE(mercury234), .address = 51, .baudrate = 9600},
+        {.type = METERS_TYPE(mercury234), .address = 52, .baudrate = 9600},
+    };
+    meters_values_t values;
+
+    // пул драйвера в devicetree рассчитан по таблице, вся таблица одного типа в него не входит
+    Z_TEST_SKIP_IFDEF(CONFIG_STRIM_METERS2_DT_TOPOLOGY);
+
+    // все ячейки таблицы и весь пул Mercury заняты
+    zassert_ok(meters_reconfigure(table, ARRAY_SIZE(table)));
+    zassert_ok(meters_reinit());
+
+    for(uint32_t i = 0; i < ARRAY_SIZE(table); i++){
+        test_fresh(i, &values);
+        test_assert_ac(&values, &test_ac, true);
+    }
+}
+
+// Баланс перестраивается потоком опроса при переходе на новую таблицу, с USERSPACE - в режиме пользователя
+ZTEST(meters, test_balance_reconfigure)
+{
+    meter_parameters_t table[test_count];
+    meters_poll_stats_t before;
+    meters_poll_stats_t after;
+    meters_values_t values;
+
+    Z_TEST_SKIP_IFNDEF(CONFIG_STRIM_METERS2_BALANCE);
+
+#if CONFIG_STRIM_METERS2_BALANCE
+    meters_balance_t balance;
+
+    zassert_ok(meters_get_poll_stats(&before));
+
+    memcpy(table, test_table, sizeof(table));
+    table[test_mercury].balance_role = meters_balance_parent;
+    table[test_ce318].balance_role = meters_balance_child;
+    table[test_extern].balance_role = meters_balance_child;
+    zassert_ok(meters_reconfigure(table, test_count));
+
+    zassert_ok(meters_set_values(test_extern, &test_ac_19200));
+    test_fresh(test_mercury, &values);
+    test_fresh(test_ce318, &values);
+
+    zassert_ok(meters_get_balance(&balance));
+    zassert_equal(balance.parent_index, test_mercury);
+    zassert_equal(balance.children_mask, BIT(test_ce318) | BIT(test_extern));
+    zassert_within(balance.parent.power, test_ac.AC.power_active, 1.0f);
+    // CE318 передает мощность в целых ваттах
+    zassert_within(balance.children.power, 4477.0f + test_ac_19200.AC.power_active, 1.0f);
+
+    // поток опроса пережил перестройку, а не был перезапущен супервизором
+    zassert_ok(meters_get_poll_stats(&after));
+    zassert_equal(after.restarts, before.restarts);
+
+    // роли сняты той же заменой таблицы
+    zassert_ok(meters_reconfigure(test_table, test_count));
+    zassert_equal(meters_get_balance(&balance), -ENODATA);
+    zassert_ok(meters_get_poll_stats(&after));
+    zassert_equal(after.restarts, before.restarts);
+#else
+    ARG_UNUSED(table);
+    ARG_UNUSED(before);
+    ARG_UNUSED(after);
+    ARG_UNUSED(values);
+#endif
+}
+
+// Поток опроса гибнет посреди запроса, держа линию: супервизор отпускает ее и запускает поток заново
+ZTEST(meters, test_poll_thread_restart)
+{
+    meters_poll_stats_t before;
+    meters_poll_stats_t after;
+    meters_values_t values;
+
+    Z_TEST_SKIP_IFNDEF(CONFIG_STRIM_METERS2_FATAL_HANDLER);
+
+    zassert_ok(meters_get_poll_stats(&before));
+    meters_sim485_oops();
+
+    uint32_t start = k_uptime_get_32();
+    do{
+        k_msleep(METERS_TEST_STEP_MS);
+        zassert_ok(meters_get_poll_stats(&after));
+    }while((after.restarts == before.restarts) && ((k_uptime_get_32() - start) < METERS_TEST_FRESH_MS));
+
+    zassert_equal(after.restarts, before.restarts + 1, "poll thread not restarted");
+
+    // линия свободна, новый поток опрашивает все счетчики
+    test_fresh(test_ce318, &values);
+    test_assert_ac(&values, &test_ac, false);
+    test_fresh(test_spm90, &values);
+    test_assert_dc(&values, &test_dc);
+    test_fresh(test_mercury, &values);
+    test_assert_ac(&values, &test_ac, true);
+
+    zassert_ok(meters_get_poll_stats(&after));
+    zassert_equal(after.restarts, before.restarts + 1);
+}
+
+ZTEST_SUITE(meters, NULL, meters_test_setup, meters_test_before, NULL, NULL);